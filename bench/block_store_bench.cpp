@@ -0,0 +1,421 @@
+#include <benchmark/benchmark.h>
+#include <cstdlib>
+#include <unistd.h>
+#include <vector>
+#include "block_store.h"
+#include "bitmap.h"
+
+// Allocation benchmarks: fill an empty store one block_store_allocate at a time
+// and compare against the old allocator, which rescanned from block 0 with bitmap_test on every call.
+
+// Blocks the bitmap itself takes up in a store of n blocks of BLOCK_SIZE_BYTES
+static size_t reserved_blocks(const size_t n)
+{
+	return ((n + 7) / 8 + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+}
+
+// The pre-summary allocator, kept here as the baseline to compare against
+static size_t linear_scan_allocate(bitmap_t *const bitmap)
+{
+	const size_t n = bitmap_get_bits(bitmap);
+	const size_t reserved = reserved_blocks(n);
+	for (size_t i = 0; i < n; i++)
+	{
+		if ((i < BITMAP_START_BLOCK) || (i >= BITMAP_START_BLOCK + reserved))
+		{
+			if (!bitmap_test(bitmap, i))
+			{
+				bitmap_set(bitmap, i);
+				return i;
+			}
+		}
+	}
+	return SIZE_MAX;
+}
+
+static void BM_allocate_until_full(benchmark::State &state)
+{
+	size_t allocated = 0;
+	for (auto _ : state)
+	{
+		state.PauseTiming();
+		block_store_t *bs = block_store_create_ex(state.range(0), BLOCK_SIZE_BYTES);
+		state.ResumeTiming();
+
+		while (block_store_allocate(bs) != SIZE_MAX)
+		{
+			++allocated;
+		}
+
+		state.PauseTiming();
+		block_store_destroy(bs);
+		state.ResumeTiming();
+	}
+	state.SetItemsProcessed(allocated);
+}
+BENCHMARK(BM_allocate_until_full)->Arg(BLOCK_STORE_NUM_BLOCKS)->Arg(1 << 14)->Arg(1 << 20);
+
+static void BM_linear_scan_until_full(benchmark::State &state)
+{
+	size_t allocated = 0;
+	for (auto _ : state)
+	{
+		state.PauseTiming();
+		bitmap_t *bitmap = bitmap_create(state.range(0));
+		for (size_t i = 0; i < reserved_blocks(state.range(0)); i++)
+		{
+			bitmap_set(bitmap, BITMAP_START_BLOCK + i);
+		}
+		state.ResumeTiming();
+
+		while (linear_scan_allocate(bitmap) != SIZE_MAX)
+		{
+			++allocated;
+		}
+
+		state.PauseTiming();
+		bitmap_destroy(bitmap);
+		state.ResumeTiming();
+	}
+	state.SetItemsProcessed(allocated);
+}
+// Quadratic, so this stays at the sizes it can finish in reasonable time
+BENCHMARK(BM_linear_scan_until_full)->Arg(BLOCK_STORE_NUM_BLOCKS)->Arg(1 << 14);
+
+// Shared-store churn: every thread allocates a handful of blocks and releases them again.
+// Run with and without BS_ALLOC_CACHE to see what the per-thread caches save on contention.
+static block_store_t *shared_bs;
+
+static void BM_threaded_churn(benchmark::State &state)
+{
+	if (state.thread_index() == 0)
+	{
+		shared_bs = block_store_create_flags(1 << 16, BLOCK_SIZE_BYTES, state.range(0));
+	}
+	size_t ids[16];
+	for (auto _ : state)
+	{
+		for (size_t i = 0; i < 16; i++)
+		{
+			ids[i] = block_store_allocate(shared_bs);
+		}
+		for (size_t i = 0; i < 16; i++)
+		{
+			block_store_release(shared_bs, ids[i]);
+		}
+	}
+	state.SetItemsProcessed(state.iterations() * 16);
+	if (state.thread_index() == 0)
+	{
+		block_store_destroy(shared_bs);
+	}
+}
+BENCHMARK(BM_threaded_churn)->Arg(BS_THREADSAFE)->Arg(BS_ALLOC_CACHE)->ThreadRange(1, 8)->UseRealTime();
+
+// What every stats poll pays: block_store_get_used_blocks counts the whole bitmap
+static void BM_total_set(benchmark::State &state)
+{
+	bitmap_t *bitmap = bitmap_create(state.range(0));
+	for (size_t i = 0; i < (size_t) state.range(0); i += 3)
+	{
+		bitmap_set(bitmap, i);
+	}
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(bitmap_total_set(bitmap));
+	}
+	state.SetBytesProcessed(state.iterations() * bitmap_get_bytes(bitmap));
+	bitmap_destroy(bitmap);
+}
+BENCHMARK(BM_total_set)->Arg(BLOCK_STORE_NUM_BLOCKS)->Arg(1 << 20)->Arg(1 << 24);
+
+// Walking every set bit of a bitmap with one set bit in ten, through the callback and through batches
+static bitmap_t *sparse_bitmap(const size_t n)
+{
+	bitmap_t *bitmap = bitmap_create(n);
+	for (size_t i = 0; i < n; i += 10)
+	{
+		bitmap_set(bitmap, i);
+	}
+	return bitmap;
+}
+
+static void count_bit(size_t, void *arg)
+{
+	++*static_cast<size_t *>(arg);
+}
+
+static void BM_for_each(benchmark::State &state)
+{
+	bitmap_t *bitmap = sparse_bitmap(state.range(0));
+	for (auto _ : state)
+	{
+		size_t seen = 0;
+		bitmap_for_each(bitmap, count_bit, &seen);
+		benchmark::DoNotOptimize(seen);
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+	bitmap_destroy(bitmap);
+}
+BENCHMARK(BM_for_each)->Arg(1 << 20);
+
+static void BM_ffs_batch(benchmark::State &state)
+{
+	bitmap_t *bitmap = sparse_bitmap(state.range(0));
+	size_t bits[256];
+	for (auto _ : state)
+	{
+		size_t seen = 0;
+		for (size_t n, from = 0; (n = bitmap_ffs_batch(bitmap, from, bits, 256)) != 0; from = bits[n - 1] + 1)
+		{
+			seen += n;
+		}
+		benchmark::DoNotOptimize(seen);
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+	bitmap_destroy(bitmap);
+}
+BENCHMARK(BM_ffs_batch)->Arg(1 << 20);
+
+// ffz over a nearly full bitmap whose only free bit is the last one, flat (0) and hierarchical (1)
+static void BM_ffz_nearly_full(benchmark::State &state)
+{
+	const size_t n = 1 << 26;
+	bitmap_t *bitmap = state.range(0) ? bitmap_create_hierarchical(n) : bitmap_create(n);
+	bitmap_set_range(bitmap, 0, n - 1);
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(bitmap_ffz(bitmap));
+	}
+	bitmap_destroy(bitmap);
+}
+BENCHMARK(BM_ffz_nearly_full)->Arg(0)->Arg(1);
+
+// Fragmentation scan over a 16M-bit bitmap with one bit in ten set, flat (0) and hierarchical (1)
+static void BM_zero_runs(benchmark::State &state)
+{
+	const size_t n = 1 << 24;
+	bitmap_t *bitmap = state.range(0) ? bitmap_create_hierarchical(n) : bitmap_create(n);
+	for (size_t i = 0; i < n; i += 10)
+	{
+		bitmap_set(bitmap, i);
+	}
+	bitmap_run_stats_t stats;
+	for (auto _ : state)
+	{
+		bitmap_zero_runs(bitmap, &stats);
+		benchmark::DoNotOptimize(stats.longest);
+	}
+	state.SetBytesProcessed(state.iterations() * bitmap_get_bytes(bitmap));
+	bitmap_destroy(bitmap);
+}
+BENCHMARK(BM_zero_runs)->Arg(0)->Arg(1);
+
+// Single-bit operations over a 1M-bit bitmap, walking it with a stride so consecutive calls hit different words
+static void BM_bitmap_set(benchmark::State &state)
+{
+	const size_t n = 1 << 20;
+	bitmap_t *bitmap = bitmap_create(n);
+	size_t bit = 0;
+	for (auto _ : state)
+	{
+		bitmap_set(bitmap, bit);
+		bit = (bit + 4099) & (n - 1);
+	}
+	state.SetItemsProcessed(state.iterations());
+	bitmap_destroy(bitmap);
+}
+BENCHMARK(BM_bitmap_set);
+
+static void BM_bitmap_test(benchmark::State &state)
+{
+	const size_t n = 1 << 20;
+	bitmap_t *bitmap = sparse_bitmap(n);
+	size_t bit = 0;
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(bitmap_test(bitmap, bit));
+		bit = (bit + 4099) & (n - 1);
+	}
+	state.SetItemsProcessed(state.iterations());
+	bitmap_destroy(bitmap);
+}
+BENCHMARK(BM_bitmap_test);
+
+// ffz from the start of a 1M-bit bitmap whose first range(0) percent is full, so the search has that far to go
+static void BM_bitmap_ffz(benchmark::State &state)
+{
+	const size_t n = 1 << 20;
+	bitmap_t *bitmap = bitmap_create(n);
+	bitmap_set_range(bitmap, 0, n / 100 * state.range(0));
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(bitmap_ffz(bitmap));
+	}
+	bitmap_destroy(bitmap);
+}
+BENCHMARK(BM_bitmap_ffz)->Arg(0)->Arg(50)->Arg(90)->Arg(99);
+
+// One allocate and release pair on a 1M-block store with range(0) percent of its blocks already allocated,
+// scattered with a fixed seed so every run sees the same layout
+static void BM_allocate_at_fill(benchmark::State &state)
+{
+	const size_t n = 1 << 20;
+	block_store_t *bs = block_store_create_ex(n, BLOCK_SIZE_BYTES);
+	uint64_t seed = 88172645463325252ull;
+	for (size_t i = 0; i < n; i++)
+	{
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		if (seed % 100 < (uint64_t) state.range(0))
+		{
+			block_store_request(bs, i);
+		}
+	}
+	for (auto _ : state)
+	{
+		const size_t id = block_store_allocate(bs);
+		block_store_release(bs, id);
+	}
+	state.SetItemsProcessed(state.iterations());
+	block_store_destroy(bs);
+}
+BENCHMARK(BM_allocate_at_fill)->Arg(0)->Arg(50)->Arg(90)->Arg(99);
+
+// Copy throughput of block_store_read/write at a few block sizes, over a 16 MiB store so it isn't all in cache
+static void BM_read(benchmark::State &state)
+{
+	const size_t block_size = state.range(0);
+	const size_t n = (16 << 20) / block_size;
+	block_store_t *bs = block_store_create_ex(n, block_size);
+	std::vector<uint8_t> buffer(block_size);
+	size_t id = 0;
+	for (auto _ : state)
+	{
+		block_store_read(bs, id, buffer.data());
+		benchmark::DoNotOptimize(buffer.data());
+		id = (id + 1) % n;
+	}
+	state.SetBytesProcessed(state.iterations() * block_size);
+	block_store_destroy(bs);
+}
+BENCHMARK(BM_read)->Arg(BLOCK_SIZE_BYTES)->Arg(512)->Arg(4096);
+
+static void BM_write(benchmark::State &state)
+{
+	const size_t block_size = state.range(0);
+	const size_t n = (16 << 20) / block_size;
+	block_store_t *bs = block_store_create_ex(n, block_size);
+	std::vector<uint8_t> buffer(block_size, 'w');
+	size_t id = 0;
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(block_store_write(bs, id, buffer.data())); //the bitmap blocks just get refused
+		id = (id + 1) % n;
+	}
+	state.SetBytesProcessed(state.iterations() * block_size);
+	block_store_destroy(bs);
+}
+BENCHMARK(BM_write)->Arg(BLOCK_SIZE_BYTES)->Arg(512)->Arg(4096);
+
+// Saving and loading a 16 MiB image (to the working directory, so mostly the page cache)
+static void BM_serialize(benchmark::State &state)
+{
+	block_store_t *bs = block_store_create_ex(4096, 4096);
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(block_store_serialize(bs, "bench.bs"));
+	}
+	state.SetBytesProcessed(state.iterations() * 4096 * 4096);
+	block_store_destroy(bs);
+	unlink("bench.bs");
+}
+BENCHMARK(BM_serialize)->Unit(benchmark::kMillisecond);
+
+static void BM_deserialize(benchmark::State &state)
+{
+	block_store_t *bs = block_store_create_ex(4096, 4096);
+	block_store_serialize(bs, "bench.bs");
+	block_store_destroy(bs);
+	for (auto _ : state)
+	{
+		bs = block_store_deserialize("bench.bs");
+		benchmark::DoNotOptimize(bs);
+		block_store_destroy(bs);
+	}
+	state.SetBytesProcessed(state.iterations() * 4096 * 4096);
+	unlink("bench.bs");
+}
+BENCHMARK(BM_deserialize)->Unit(benchmark::kMillisecond);
+
+#ifdef BLOCK_STORE_LZ4 //compressed images are only built in with liblz4
+// A 16 MiB store with the given percentage of its blocks allocated, each holding half random, half repeated bytes
+static block_store_t *bench_filled_store(const size_t percent)
+{
+	block_store_t *bs = block_store_create_ex(4096, 4096);
+	std::vector<uint8_t> buffer(4096, 0x5A);
+	for (size_t id = 100; id < 4096; id++)
+	{
+		if (id % 100 < percent && block_store_request(bs, id))
+		{
+			for (size_t i = 0; i < buffer.size() / 2; i++)
+			{
+				buffer[i] = (uint8_t) rand();
+			}
+			block_store_write(bs, id, buffer.data());
+		}
+	}
+	return bs;
+}
+
+static void BM_serialize_compressed(benchmark::State &state)
+{
+	block_store_t *bs = bench_filled_store(state.range(0));
+	size_t bytes = 0;
+	for (auto _ : state)
+	{
+		bytes = block_store_serialize_compressed(bs, "bench.bs");
+		benchmark::DoNotOptimize(bytes);
+	}
+	state.SetBytesProcessed(state.iterations() * 4096 * 4096);
+	state.counters["image_bytes"] = bytes;
+	block_store_destroy(bs);
+	unlink("bench.bs");
+}
+BENCHMARK(BM_serialize_compressed)->Arg(10)->Arg(50)->Arg(100)->Unit(benchmark::kMillisecond);
+
+static void BM_deserialize_compressed(benchmark::State &state)
+{
+	block_store_t *bs = bench_filled_store(state.range(0));
+	block_store_serialize_compressed(bs, "bench.bs");
+	block_store_destroy(bs);
+	for (auto _ : state)
+	{
+		bs = block_store_deserialize("bench.bs");
+		benchmark::DoNotOptimize(bs);
+		block_store_destroy(bs);
+	}
+	state.SetBytesProcessed(state.iterations() * 4096 * 4096);
+	unlink("bench.bs");
+}
+BENCHMARK(BM_deserialize_compressed)->Arg(10)->Arg(50)->Arg(100)->Unit(benchmark::kMillisecond);
+#endif
+
+#ifndef BENCH_BUILD_TYPE
+#define BENCH_BUILD_TYPE ""
+#endif
+
+int main(int argc, char **argv)
+{
+	benchmark::Initialize(&argc, argv);
+	if (benchmark::ReportUnrecognizedArguments(argc, argv))
+	{
+		return 1;
+	}
+	// so results from different builds can be told apart in the JSON
+	benchmark::AddCustomContext("block_store_build_type", BENCH_BUILD_TYPE[0] ? BENCH_BUILD_TYPE : "unoptimized");
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+	return 0;
+}
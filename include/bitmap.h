@@ -39,6 +39,37 @@ void bitmap_reset(bitmap_t *const bitmap, const size_t bit);
 ///
 bool bitmap_test(const bitmap_t *const bitmap, const size_t bit);
 
+///
+/// Atomically sets requested bit in bitmap and reports what it was before
+///  Safe to call from several threads at once on the same bitmap, as long as every
+///  thread changing it goes through the atomic calls
+/// \param bitmap The bitmap
+/// \param bit The bit to set
+/// \return Previous state of the bit, so false means this call was the one that set it
+///
+bool bitmap_test_and_set(bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Atomically clears requested bit in bitmap and reports what it was before
+///  (same threading rules as bitmap_test_and_set)
+/// \param bitmap The bitmap
+/// \param bit The bit to clear
+/// \return Previous state of the bit, so true means this call was the one that cleared it
+///
+bool bitmap_test_and_reset(bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Atomically claims a batch of zero bits, setting them all
+///  Works through the bitmap from start a word at a time, grabbing every zero bit in a word
+///  with a single compare-and-swap (same threading rules as bitmap_test_and_set)
+/// \param bitmap The bitmap
+/// \param start The first bit to consider
+/// \param bits Receives the addresses of the claimed bits, in ascending order
+/// \param max The most bits to claim
+/// \return Number of bits claimed, 0 if there were none free at or after start
+///
+size_t bitmap_claim_zeros(bitmap_t *const bitmap, const size_t start, size_t *const bits, const size_t max);
+
 ///
 /// Flips bit in bitmap
 /// \param bitmap The bitmap
@@ -48,6 +79,7 @@ void bitmap_flip(bitmap_t *const bitmap, const size_t bit);
 
 ///
 /// Flips all bits in the bitmap
+///  (uses AVX2/AVX-512 when the CPU has it, picked at runtime)
 /// \param bitmap The bitmap to invert
 ///
 void bitmap_invert(bitmap_t *const bitmap);
@@ -66,25 +98,156 @@ size_t bitmap_ffs(const bitmap_t *const bitmap);
 ///
 size_t bitmap_ffz(const bitmap_t *const bitmap);
 
+///
+/// Find first set, starting the search at the given bit
+/// \param bitmap The bitmap
+/// \param start The first bit to consider
+/// \return The first one bit address at or after start, SIZE_MAX on error/not found
+///
+size_t bitmap_ffs_from(const bitmap_t *const bitmap, const size_t start);
+
+///
+/// Find first zero, starting the search at the given bit
+/// \param bitmap The bitmap
+/// \param start The first bit to consider
+/// \return The first zero bit address at or after start, SIZE_MAX on error/not found
+///
+size_t bitmap_ffz_from(const bitmap_t *const bitmap, const size_t start);
+
+///
+/// Find last set, searching down from the given bit
+///  Walks down a word at a time (summaries aren't used, they only help searches going up)
+/// \param bitmap The bitmap
+/// \param start The last bit to consider, anything past the end means from the last bit
+/// \return The last one bit address at or before start, SIZE_MAX on error/not found
+///
+size_t bitmap_fls_from(const bitmap_t *const bitmap, const size_t start);
+
+///
+/// Find first run of zeros long enough to hold count bits
+/// \param bitmap The bitmap
+/// \param start The first bit to consider
+/// \param count The number of consecutive zero bits needed
+/// \return The address of the first bit of the run, SIZE_MAX on error/not found
+///
+size_t bitmap_ffz_run(const bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Sets count bits starting at start, a word at a time
+/// \param bitmap The bitmap
+/// \param start The first bit to set
+/// \param count The number of bits to set (ranges that are empty or leave the bitmap are ignored)
+///
+void bitmap_set_range(bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Clears count bits starting at start, a word at a time
+/// \param bitmap The bitmap
+/// \param start The first bit to clear
+/// \param count The number of bits to clear (ranges that are empty or leave the bitmap are ignored)
+///
+void bitmap_reset_range(bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Checks whether every bit in a range is set
+///  (for all clear, see bitmap_count_range)
+/// \param bitmap The bitmap
+/// \param start The first bit to check
+/// \param count The number of bits to check
+/// \return true if all count bits are set, false if not or the range is empty or leaves the bitmap
+///
+bool bitmap_test_range(const bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Count bits set in a range
+/// \param bitmap The bitmap
+/// \param start The first bit to count
+/// \param count The number of bits to look at
+/// \return The number of set bits in the range, 0 if the range is empty or leaves the bitmap
+///
+size_t bitmap_count_range(const bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// dst = dst AND src, a word at a time
+/// \param dst The bitmap to update
+/// \param src The other operand, must have the same number of bits as dst
+/// \return true on success, false if either is NULL or the sizes differ (dst is left alone)
+///
+bool bitmap_and(bitmap_t *const dst, const bitmap_t *const src);
+
+///
+/// dst = dst OR src, a word at a time
+///  (same rules as bitmap_and)
+///
+bool bitmap_or(bitmap_t *const dst, const bitmap_t *const src);
+
+///
+/// dst = dst XOR src, a word at a time, so dst ends up with the bits that differ
+///  (same rules as bitmap_and)
+///
+bool bitmap_xor(bitmap_t *const dst, const bitmap_t *const src);
+
+///
+/// dst = dst AND NOT src, a word at a time, so dst keeps the bits src doesn't have
+///  (same rules as bitmap_and)
+///
+bool bitmap_andnot(bitmap_t *const dst, const bitmap_t *const src);
+
 ///
 /// Count all bits set
+///  (uses popcnt/AVX2/AVX-512 when the CPU has it, picked at runtime)
 /// \param bitmap the bitmap
 /// \return the total number of bits that are set in the bitmap
 ///
 size_t bitmap_total_set(const bitmap_t *const bitmap);
+///
+/// Collects the addresses of set bits, in ascending order
+///  Empty words are skipped whole, so this costs about one step per set bit rather than per bit.
+///  To walk a whole bitmap, call again from one past the last address returned until it returns 0.
+///  (one bit at a time, that's just bitmap_ffs_from / bitmap_ffz_from from one past the last hit)
+/// \param bitmap The bitmap
+/// \param start The first bit to consider
+/// \param bits Receives the addresses of the set bits
+/// \param max The most addresses to collect
+/// \return Number of addresses written to bits, 0 if there are no set bits at or after start
+///
+size_t bitmap_ffs_batch(const bitmap_t *const bitmap, const size_t start, size_t *const bits, const size_t max);
+
 ///
 /// For each loop for all set bits
 ///  (Arguments passed to func are saved across calls)
+///  Empty words are skipped whole, but it's still a call per set bit; bitmap_ffs_batch avoids that
 /// \param bitmap The bitmap
 /// \param func The function to apply (first parameter will be size_t with the bit number)
 /// \param args A generic pointer to pass to the called function
 ///
 void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *), void *arg);
 
+// Histogram buckets in bitmap_run_stats_t, enough for any run length
+#define BITMAP_RUN_BUCKETS 64
+
+// Summary of the runs of zeros in a bitmap (see bitmap_zero_runs)
+typedef struct bitmap_run_stats 
+{
+	size_t zeros; // total zero bits
+	size_t runs; // number of maximal runs of zeros
+	size_t longest; // length of the longest run, 0 if there are no zeros
+	size_t histogram[BITMAP_RUN_BUCKETS]; // runs by length: bucket i counts runs of 2^i to 2^(i+1)-1 zeros
+} bitmap_run_stats_t;
+
+///
+/// Measures how the zeros of a bitmap are broken up into runs
+///  Works a word at a time: whole zero words just extend the current run and each run inside a word costs a couple
+///  of bit tricks, so it's about one step per word plus one per run. Hierarchical bitmaps skip full words entirely.
+/// \param bitmap The bitmap
+/// \param stats Receives the counts
+///
+void bitmap_zero_runs(const bitmap_t *const bitmap, bitmap_run_stats_t *const stats);
+
 ///
 /// Resets bitmap contents to the desired pattern
 /// (pattern not guarenteed accurate for final bits
-/// 		if bit_count is not a multiple of 8)
+/// 		if bit_count is not a multiple of 64)
 /// \param bitmap The bitmap
 /// \param pattern The pattern to apply to all bytes
 ///
@@ -101,6 +264,7 @@ size_t bitmap_get_bits(const bitmap_t *const bitmap);
 /// Gets total number of bytes in bitmap
 /// \param bitmap The bitmap
 /// \return number of bytes used by bitmap storage array
+///  (storage is whole 64-bit words, so the array itself is rounded up to a multiple of 8)
 ///
 size_t bitmap_get_bytes(const bitmap_t *const bitmap);
 
@@ -111,6 +275,18 @@ size_t bitmap_get_bytes(const bitmap_t *const bitmap);
 ///
 bitmap_t *bitmap_create(const size_t n_bits);
 
+///
+/// Creates a hierarchical bitmap to contain n bits (zero initialized)
+///  Same bitmap as far as the rest of this API goes, but it also keeps summary levels where each bit
+///  says whether a 64-bit word of the level below is full/has anything set, up to a single word.
+///  ffs/ffz (and so ffz_run and the set-bit walks) then look at about two words per level instead of
+///  every word in between, at the cost of a little extra work when a word fills up or empties.
+///  The summary levels aren't updated atomically, so don't use the atomic calls from several threads at once on one.
+/// \param n_bits
+/// \return New bitmap pointer, NULL on error
+///
+bitmap_t *bitmap_create_hierarchical(const size_t n_bits);
+
 ///
 /// Gets pointer to the internal data for exporting
 /// Be sure to query the bit and byte size if it's unknown
@@ -133,12 +309,32 @@ bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data);
 /// Creates a new bitmap using the provided data
 /// Note: This uses the given block of memory
 ///  and does not free this pointer on destruction
+///  The memory is accessed as 64-bit words, so it has to be 8 byte aligned
+///  and span the bytes rounded up to a multiple of 8
 /// \param n_bits The number of bits in the bitmap
 /// \param bitmap_data The data to import
-/// \return New bitmap pointer, NULL on error
+/// \return New bitmap pointer, NULL on error (including misaligned data)
 ///
 bitmap_t *bitmap_overlay(const size_t n_bits, void *const bitmap_data);
 
+///
+/// Creates a new hierarchical bitmap using the provided data
+///  (same rules as bitmap_overlay, see bitmap_create_hierarchical for what that means)
+///  The summaries are built from the data here, so changes made to it other than through
+///  this API after that are not seen by the searches
+/// \param n_bits The number of bits in the bitmap
+/// \param bitmap_data The data to import
+/// \return New bitmap pointer, NULL on error (including misaligned data)
+///
+bitmap_t *bitmap_overlay_hierarchical(const size_t n_bits, void *const bitmap_data);
+
+///
+/// Rebuilds a hierarchical bitmap's summaries from its data, after the data was changed other than
+///  through this API (an overlay whose memory was read into, say). Does nothing to a flat bitmap
+/// \param bitmap The bitmap
+///
+void bitmap_refresh(bitmap_t *const bitmap);
+
 ///
 /// Destructs and destroys bitmap object
 /// \param bitmap The bitmap
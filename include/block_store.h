@@ -8,8 +8,11 @@ extern "C"
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 
 	// Constants
+	// These are the default geometry used by block_store_create, block_store_create_ex takes any other
 #define BLOCK_STORE_NUM_BLOCKS 512        // 2^9 data block
 #define BLOCK_SIZE_BYTES 32        // 2^5 BYTES per block
 #define BITMAP_SIZE_BITS BLOCK_STORE_NUM_BLOCKS        // 2^9 bits
@@ -17,6 +20,7 @@ extern "C"
 #define BLOCK_STORE_NUM_BYTES (BLOCK_STORE_NUM_BLOCKS * BLOCK_SIZE_BYTES)
 #define BITMAP_START_BLOCK 127
 #define BITMAP_NUM_BLOCKS (BITMAP_SIZE_BYTES / BLOCK_SIZE_BYTES)  //2
+#define BLOCK_STORE_HEADER_BYTES 64 // versioned header in front of the blocks in every serialized image
 
 	// Declaring the struct but not implementing in the header allows us to prevent users
 	//  from using the object directly and monkeying with the contents
@@ -26,15 +30,65 @@ extern "C"
 
 	typedef struct bitmap bitmap_t;
 
+	// Options for block_store_create_flags
+	typedef enum 
+	{
+		BS_NONE = 0x00,
+		// Allocation, request, release, read and write calls may come from several threads at once.
+		// Allocation claims bits with atomic compare-and-swap; block data is guarded by striped reader/writer locks.
+		// Pointers from block_store_get_block_ptr(_mut) are not covered by the locks.
+		// Creating, destroying and loading stores is still up to the caller to serialize.
+		BS_THREADSAFE = 0x01,
+		// Implies BS_THREADSAFE. Each thread allocates out of its own small cache of blocks claimed from the
+		// bitmap in bulk, so threads don't all contend on the same bitmap words. Blocks sitting in a cache
+		// count as free but look allocated to block_store_request until drained (see block_store_drain_caches),
+		// and allocation no longer hands out the lowest free block first.
+		BS_ALLOC_CACHE = 0x02,
+		// Keep the allocation bitmap hierarchical (see bitmap_create_hierarchical), so finding free blocks and
+		// extents stays cheap on stores with hundreds of millions of blocks. Can't be combined with BS_THREADSAFE
+		// or BS_ALLOC_CACHE, since the summary levels aren't updated atomically. Images keep this flag, so a store
+		// loaded from one (block_store_deserialize, block_store_open_mmap) is hierarchical again.
+		BS_HIERARCHICAL = 0x04
+	} BLOCK_STORE_FLAGS;
+
+	// One entry of a vectored read/write: a block id and the block-sized buffer to copy it to/from
+	// (like struct iovec, the buffer isn't const so the same list works for both directions)
+	typedef struct block_store_iovec 
+	{
+		size_t block_id;
+		void *buffer;
+	} block_store_iovec_t;
+
 	///
 	/// This creates a new BS device, ready to go
 	/// \return Pointer to a new block storage device, NULL on error
 	///
 	block_store_t *block_store_create();
 
+	///
+	/// This creates a new BS device with the requested geometry
+	///  The allocation bitmap is sized to match and reserves the blocks it needs,
+	///  starting at BITMAP_START_BLOCK if the store is big enough, block 0 otherwise
+	/// \param num_blocks Total number of blocks, including the ones reserved for the bitmap
+	/// \param block_size Number of bytes per block, a multiple of 8 (the bitmap is kept in whole 64-bit words)
+	/// \return Pointer to a new block storage device, NULL on error
+	///
+	block_store_t *block_store_create_ex(const size_t num_blocks, const size_t block_size);
+
+	///
+	/// This creates a new BS device like block_store_create_ex, with extra options
+	/// \param num_blocks Total number of blocks, including the ones reserved for the bitmap
+	/// \param block_size Number of bytes per block
+	/// \param flags BLOCK_STORE_FLAGS options, or'd together
+	/// \return Pointer to a new block storage device, NULL on error (EINVAL for flags that can't go together,
+	///  or bits that aren't BLOCK_STORE_FLAGS at all)
+	///
+	block_store_t *block_store_create_flags(const size_t num_blocks, const size_t block_size, const unsigned flags);
+
 	///
 	/// Destroys the provided block storage device
 	/// This is an idempotent operation, so there is no return value
+	///  Snapshots of it stay readable: its block storage is only freed along with the last of them
 	/// \param bs BS device
 	///
 	void block_store_destroy(block_store_t *const bs);
@@ -46,6 +100,14 @@ extern "C"
 	///
 	size_t block_store_allocate(block_store_t *const bs);
 
+	///
+	/// Hands every block waiting in a BS_ALLOC_CACHE store's allocation caches back to the free pool
+	///  (allocation does this by itself before reporting ENOSPC, and checkpoint before saving; serialize leaves
+	///  the caches alone and saves their blocks as free)
+	/// \param bs BS device
+	///
+	void block_store_drain_caches(block_store_t *const bs);
+
 	///
 	/// Attempts to allocate the requested block id
 	/// \param bs the block store object
@@ -54,13 +116,74 @@ extern "C"
 	///
 	bool block_store_request(block_store_t *const bs, const size_t block_id);
 
+	///
+	/// Searches for count contiguous free blocks, marks them as in use, and returns the first one's id
+	/// \param bs BS device
+	/// \param count Number of blocks in the extent
+	/// \param start Receives the id of the first block of the extent
+	/// \return boolean indicating success of operation
+	///
+	bool block_store_allocate_extent(block_store_t *const bs, const size_t count, size_t *const start);
+
 	///
 	/// Frees the specified block
+	///  (ignored, with errno EINVAL, for an id outside the store or one of the bitmap blocks)
 	/// \param bs BS device
 	/// \param block_id The block to free
 	///
 	void block_store_release(block_store_t *const bs, const size_t block_id);
 
+	///
+	/// Frees count contiguous blocks starting at start
+	///  (the whole call is ignored, with errno EINVAL, if the range is empty, leaves the store or covers the bitmap blocks)
+	/// \param bs BS device
+	/// \param start The first block to free
+	/// \param count Number of blocks to free
+	///
+	void block_store_release_extent(block_store_t *const bs, const size_t start, const size_t count);
+
+	// One block moved by block_store_compact: its contents are now in block to, and block from is free
+	typedef struct block_store_remap 
+	{
+		size_t from;
+		size_t to;
+	} block_store_remap_t;
+
+	///
+	/// Runs one batch of compaction: moves up to max_moves of the highest allocated blocks into the lowest free
+	///  blocks below them, so free space gathers at the top of the store into large extents again
+	///  Call it repeatedly (from a background thread, in a thread safe store) until it returns 0.
+	///  Each batch is applied all at once: block reads and writes, checkpoints and journal records from other
+	///  threads see the store before or after the batch, never part way through, and the moves are journaled.
+	///  Every id the caller holds has to be translated through remap before it's used again, and that includes
+	///  ids another thread is being handed by block_store_allocate while the batch runs, so callers have to keep
+	///  their own references and compaction in step. Pointers from block_store_get_block_ptr(_mut) go stale too
+	/// \param bs BS device
+	/// \param remap Receives one entry per block moved, in the order they were moved
+	/// \param max_moves Most blocks to move in this batch (the size of remap)
+	/// \return Number of blocks moved, 0 once the store is compact (or on error, with errno set)
+	///
+	size_t block_store_compact(block_store_t *const bs, block_store_remap_t *const remap, const size_t max_moves);
+
+	///
+	/// Takes a read-only, point in time view of the BS device, copy on write
+	///  Nothing is copied up front; taking one only allocates a table with a pointer per 512 blocks (so it's
+	///  O(n/512), and cheap next to copying anything) and room for the bitmap's copies. Each block is copied
+	///  the first time it is written after the snapshot (by block_store_write/writev, get_block_ptr_mut or
+	///  compaction), and each block of the allocation bitmap the first time an allocation or release changes it.
+	///  The view can be read, read_async'd or serialized while writes to bs carry on. Only a BS_THREADSAFE bs
+	///  can have them at the same time from different threads; otherwise the snapshot is used like bs itself,
+	///  one call at a time, since its reads and bs's copies aren't locked against each other.
+	///  Snapshots can't be changed: allocate, release, write, compact, journal and checkpoint calls on one fail
+	///  with EINVAL, and so does block_store_get_block_ptr(_mut), since the block under it can change.
+	///  A pointer from block_store_get_block_ptr_mut taken before the snapshot must not be written through after it.
+	///  A write to bs fails with ENOMEM if the copy for a snapshot can't be made.
+	///  Destroy snapshots with block_store_destroy, in any order with bs
+	/// \param bs BS device, which can't itself be a snapshot
+	/// \return Pointer to the snapshot, NULL on error
+	///
+	block_store_t *block_store_snapshot(block_store_t *const bs);
+
 	///
 	/// Counts the number of blocks marked as in use
 	/// \param bs BS device
@@ -75,6 +198,30 @@ extern "C"
 	///
 	size_t block_store_get_free_blocks(const block_store_t *const bs);
 
+	// Histogram buckets in block_store_fragmentation_t, enough for any extent length
+#define BLOCK_STORE_EXTENT_BUCKETS 64
+
+	// How the free space of a store is broken up (see block_store_get_fragmentation)
+	typedef struct block_store_fragmentation 
+	{
+		size_t free_blocks;
+		size_t free_extents; // maximal runs of free blocks
+		size_t largest_extent; // the biggest block_store_allocate_extent that can currently succeed
+		size_t extents[BLOCK_STORE_EXTENT_BUCKETS]; // free extents by length: bucket i counts 2^i to 2^(i+1)-1 blocks
+	} block_store_fragmentation_t;
+
+	///
+	/// Measures the fragmentation of the free space: how many free extents there are, the largest,
+	///  and a power-of-two histogram of their lengths
+	///  One pass over the bitmap a word at a time (stores made with BS_HIERARCHICAL skip full parts of it),
+	///  cheap enough to poll. Blocks sitting in BS_ALLOC_CACHE caches count as used, and in a thread safe store
+	///  other threads' allocations during the pass may or may not show up
+	/// \param bs BS device
+	/// \param fragmentation Receives the measurements
+	/// \return boolean indicating success of operation
+	///
+	bool block_store_get_fragmentation(const block_store_t *const bs, block_store_fragmentation_t *const fragmentation);
+
 	///
 	/// Returns the total number of user-addressable blocks
 	///  (since this is constant, you don't even need the bs object)
@@ -82,8 +229,23 @@ extern "C"
 	///
 	size_t block_store_get_total_blocks();
 
+	///
+	/// Returns the total number of blocks in the given BS device
+	/// \param bs BS device
+	/// \return Total blocks, 0 on error
+	///
+	size_t block_store_get_block_count(const block_store_t *const bs);
+
+	///
+	/// Returns the number of bytes per block in the given BS device
+	/// \param bs BS device
+	/// \return Block size in bytes, 0 on error
+	///
+	size_t block_store_get_block_size(const block_store_t *const bs);
+
 	///
 	/// Reads data from the specified block and writes it to the designated buffer
+	///  (the buffer must hold at least one block, see block_store_get_block_size)
 	/// \param bs BS device
 	/// \param block_id Source block id
 	/// \param buffer Data buffer to write to
@@ -93,6 +255,8 @@ extern "C"
 
 	///
 	/// Reads data from the specified buffer and writes it to the designated block
+	///  (the buffer must hold at least one block, see block_store_get_block_size)
+	///  The blocks holding the allocation bitmap can't be written
 	/// \param bs BS device
 	/// \param block_id Destination block id
 	/// \param buffer Data buffer to read from
@@ -100,8 +264,55 @@ extern "C"
 	///
 	size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer);
 
+	///
+	/// Gets a read-only pointer straight to the data of the specified block, no copy made
+	///  The pointer is good for block_size bytes and stays valid until the BS device is destroyed
+	///  It is a view, not a snapshot: later writes to the block show through it
+	/// \param bs BS device
+	/// \param block_id Block id
+	/// \return Pointer to the block's data, NULL on error
+	///
+	const void *block_store_get_block_ptr(const block_store_t *const bs, const size_t block_id);
+
+	///
+	/// Gets a writable pointer straight to the data of the specified block, no copy made
+	///  Same lifetime as block_store_get_block_ptr; writing through it is the same as block_store_write,
+	///  so the blocks holding the allocation bitmap are refused
+	/// \param bs BS device
+	/// \param block_id Block id
+	/// \return Pointer to the block's data, NULL on error
+	///
+	void *block_store_get_block_ptr_mut(block_store_t *const bs, const size_t block_id);
+
+	///
+	/// Reads a batch of blocks, each into its own buffer
+	///  Entries with consecutive block ids and back-to-back buffers are copied in one go
+	/// \param bs BS device
+	/// \param vec The blocks to read and where to put them
+	/// \param count Number of entries in vec
+	/// \return Number of bytes read, 0 on error (nothing is read if any entry is invalid)
+	///
+	size_t block_store_readv(const block_store_t *const bs, const block_store_iovec_t *const vec, const size_t count);
+
+	///
+	/// Writes a batch of blocks, each from its own buffer
+	///  Entries with consecutive block ids and back-to-back buffers are copied in one go
+	/// \param bs BS device
+	/// \param vec The blocks to write and where to take the data from
+	/// \param count Number of entries in vec
+	/// \return Number of bytes written, 0 on error (nothing is written if any entry is invalid)
+	///
+	size_t block_store_writev(block_store_t *const bs, const block_store_iovec_t *const vec, const size_t count);
+
 	///
 	/// Imports BS device from the given file - for grads/bonus
+	///  The image header is checked (magic, version, checksum, geometry against the file size)
+	///  before anything is loaded, and the store is created with the geometry and BS_HIERARCHICAL flag it records
+	///  Headerless images of the default geometry from older versions are still accepted
+	///  Allocations come from the bitmap saved in the image; older images without one
+	///  fall back to treating every non-zero block as allocated
+	///  Compressed images (block_store_serialize_compressed) are decompressed a chunk at a time as they are read,
+	///  and must end where their header says; without BLOCK_STORE_LZ4 they fail with errno ENOTSUP
 	/// \param filename The file to load
 	/// \return Pointer to new BS device, NULL on error
 	///
@@ -109,12 +320,207 @@ extern "C"
 
 	///
 	/// Writes the entirety of the BS device to file, overwriting it if it exists - for grads/bonus
+	///  The image is a BLOCK_STORE_HEADER_BYTES header followed by every block
 	/// \param bs BS device
 	/// \param filename The file to write to
-	/// \return Number of bytes written, 0 on error
+	/// \return Number of bytes written (header included), 0 on error
 	///
 	size_t block_store_serialize(const block_store_t *const bs, const char *const filename);
 
+	///
+	/// Writes the BS device to file as a compressed image, overwriting it if it exists
+	///  Free blocks are left out (the allocation bitmap, saved as is, says which they are), and the allocated
+	///  ones go through liblz4 a chunk at a time, which also squeezes runs of zeros down to a few bytes.
+	///  Only builds with BLOCK_STORE_LZ4 (which requires liblz4) have it; others fail with errno ENOTSUP.
+	///  block_store_deserialize loads the image, with free blocks coming back zeroed. block_store_open_mmap
+	///  and in-place checkpoints need plain images, so a checkpoint of a store loaded from one rewrites it whole
+	/// \param bs BS device
+	/// \param filename The file to write to
+	/// \return Number of bytes written (header included), 0 on error
+	///
+	size_t block_store_serialize_compressed(const block_store_t *const bs, const char *const filename);
+
+	///
+	/// Opens an image file written by block_store_serialize as a BS device backed directly by the file
+	///  Blocks are mmap'd rather than read, so opening is instant and data is paged in as it is touched
+	///  The header is checked the same way block_store_deserialize does, and gives the geometry and BS_HIERARCHICAL
+	///  The mapping goes away in block_store_destroy
+	/// \param filename The image file
+	/// \param flags open(2) style flags: O_RDWR writes changes through to the file,
+	///  O_RDONLY keeps changes private to this process, O_RDWR | O_CREAT creates an empty image if needed
+	/// \return Pointer to new BS device, NULL on error
+	///
+	block_store_t *block_store_open_mmap(const char *const filename, const int flags);
+
+	///
+	/// Writes a mapped BS device's changes back to its image file and waits for them to land (msync)
+	/// \param bs BS device opened with block_store_open_mmap
+	/// \return boolean indicating success of operation, false for stores not backed by a file
+	///
+	bool block_store_flush(block_store_t *const bs);
+
+	///
+	/// Starts a write-ahead journal for the BS device in filename, created if it doesn't exist
+	///  From then on block_store_write/writev, allocate/request/allocate_extent and release/release_extent
+	///  append a small record for each change (writes carry the block), buffered until block_store_journal_commit.
+	///  Writes made through block_store_get_block_ptr_mut aren't seen, so they aren't journaled.
+	///  If the journal already holds committed records, they are replayed onto bs first, so recovering after
+	///  a crash is block_store_deserialize on the last image followed by this. Anything after the last commit
+	///  (a torn or never committed tail) is dropped.
+	///  The journal goes away in block_store_destroy; records not yet committed are lost, like in a crash
+	/// \param bs BS device, which must not be journaling already
+	/// \param filename The journal file
+	/// \return boolean indicating success of operation, false with EINVAL if the journal is for another geometry,
+	///  EBUSY if bs has snapshots (replaying doesn't preserve blocks for them)
+	///
+	bool block_store_journal_open(block_store_t *const bs, const char *const filename);
+
+	///
+	/// Makes every change journaled so far durable: the buffered records from all threads go out
+	///  in one write followed by one fdatasync (group commit)
+	/// \param bs BS device with a journal
+	/// \return boolean indicating success of operation, false if this or any earlier journal write failed
+	///
+	bool block_store_journal_commit(block_store_t *const bs);
+
+	///
+	/// Writes the BS device to filename as an image, crash safely, and then empties its journal
+	///  With a journal, when filename is the image the device was loaded from (block_store_deserialize) or last
+	///  checkpointed to, only the blocks written since then and the allocation bitmap are rewritten, in place. The
+	///  journal is committed first, along with any changes it didn't see (made before block_store_journal_open, or
+	///  through block_store_get_block_ptr_mut), so a crash part way through is repaired by replaying it.
+	///  Otherwise the whole image is written to filename.tmp, synced and renamed over filename, so a crash leaves
+	///  either the old image or the new one, never a torn one. Works without a journal too, as an atomic serialize.
+	///  The image must not be changed by anything else in between (not for the file a store was opened from
+	///  with block_store_open_mmap)
+	/// \param bs BS device
+	/// \param filename The image file
+	/// \return size of the image in bytes, 0 on error
+	///
+	size_t block_store_checkpoint(block_store_t *const bs, const char *const filename);
+
+	// Completion callback for the asynchronous calls: result is what the synchronous call would have returned
+	// (bytes copied, or 1/0 for flushes) and error its errno when it failed, 0 otherwise. arg is passed through.
+	typedef void (*block_store_callback_t)(block_store_t *bs, size_t result, int error, void *arg);
+
+	///
+	/// Queues a block_store_read to run on the BS device's worker threads, calling callback (if not NULL) when done
+	///  Worker threads are started on first use. Thread safe stores get several, so many reads can be in flight
+	///  at once (reads of a mapped store can fault pages in from disk); other stores get one, which runs
+	///  requests in the order they were queued, and must not be used directly while requests are pending.
+	///  The buffer has to stay valid until the callback runs. Callbacks run on a worker thread.
+	/// \param bs BS device
+	/// \param block_id The block to read
+	/// \param buffer Where to read it to
+	/// \param callback Called with the result, may be NULL
+	/// \param arg Passed to callback
+	/// \return boolean indicating the request was queued, false with EINVAL for bad parameters
+	///
+	bool block_store_read_async(block_store_t *const bs, const size_t block_id, void *buffer, block_store_callback_t callback, void *arg);
+
+	///
+	/// Queues a block_store_write, the same way as block_store_read_async
+	/// \param bs BS device
+	/// \param block_id The block to write
+	/// \param buffer The block's new contents
+	/// \param callback Called with the result, may be NULL
+	/// \param arg Passed to callback
+	/// \return boolean indicating the request was queued, false with EINVAL for bad parameters
+	///
+	bool block_store_write_async(block_store_t *const bs, const size_t block_id, const void *buffer, block_store_callback_t callback, void *arg);
+
+	///
+	/// Queues making the BS device durable: block_store_flush for a mapped store, then
+	///  block_store_journal_commit if it has a journal. It waits for the requests queued before it to finish first,
+	///  so it covers every write queued ahead of it
+	/// \param bs BS device, mapped or with a journal
+	/// \param callback Called with the result, may be NULL
+	/// \param arg Passed to callback
+	/// \return boolean indicating the request was queued, false with EINVAL if there's nothing to flush to
+	///
+	bool block_store_flush_async(block_store_t *const bs, block_store_callback_t callback, void *arg);
+
+	///
+	/// Queues a block_store_serialize of the BS device to filename. Like block_store_flush_async it waits for the
+	///  requests queued before it to finish, so the image includes every write queued ahead of it
+	/// \param bs BS device
+	/// \param filename The file to serialize to, copied so it needn't outlive the call
+	/// \param callback Called with the image size, may be NULL
+	/// \param arg Passed to callback
+	/// \return boolean indicating the request was queued, false with EINVAL for bad parameters
+	///
+	bool block_store_serialize_async(block_store_t *const bs, const char *const filename, block_store_callback_t callback, void *arg);
+
+	///
+	/// Queues a block_store_checkpoint of the BS device to filename, the same way as block_store_serialize_async
+	/// \param bs BS device
+	/// \param filename The image file, copied so it needn't outlive the call
+	/// \param callback Called with the image size, may be NULL
+	/// \param arg Passed to callback
+	/// \return boolean indicating the request was queued, false with EINVAL for bad parameters
+	///
+	bool block_store_checkpoint_async(block_store_t *const bs, const char *const filename, block_store_callback_t callback, void *arg);
+
+	///
+	/// Waits until every asynchronous request queued so far has finished and had its callback run
+	///  (not to be called from a callback). block_store_destroy waits the same way
+	/// \param bs BS device
+	///
+	void block_store_wait_async(block_store_t *const bs);
+
+	// Operations block_store_get_stats keeps counts for
+	typedef enum 
+	{
+		BS_OP_ALLOCATE,
+		BS_OP_REQUEST,
+		BS_OP_RELEASE,
+		BS_OP_READ,
+		BS_OP_WRITE,
+		BS_OP_SERIALIZE,
+		BS_OP_DESERIALIZE, // recorded in the store it loaded, so only successful loads show up
+		BS_OP_ALLOCATE_EXTENT,
+		BS_OP_RELEASE_EXTENT,
+		BS_OP_READV, // a vectored call counts once, however many blocks it covers
+		BS_OP_WRITEV,
+		BS_OP_COUNT
+	} BLOCK_STORE_OP;
+
+	// Histogram buckets: bucket i counts values in [2^i, 2^(i+1)), bucket 0 also 0, the last bucket anything bigger
+#define BLOCK_STORE_STATS_BUCKETS 32
+
+	// Counters since the store was created (see block_store_get_stats)
+	typedef struct block_store_stats 
+	{
+		uint64_t calls[BS_OP_COUNT];
+		uint64_t failures[BS_OP_COUNT]; // calls that returned their error value
+		uint64_t nanoseconds[BS_OP_COUNT]; // total time spent in each operation
+		uint64_t latency[BS_OP_COUNT][BLOCK_STORE_STATS_BUCKETS]; // calls by how many nanoseconds they took
+		uint64_t scan_blocks; // total blocks allocation searches went through, starting from the lowest free one
+		uint64_t scans[BLOCK_STORE_STATS_BUCKETS]; // allocation searches by how many blocks they went through
+		uint64_t enospc; // failed calls that set errno to ENOSPC
+		uint64_t einval; // failed calls that set errno to EINVAL
+	} block_store_stats_t;
+
+	///
+	/// Takes a snapshot of the BS device's operation counters, latency histograms and allocation scan lengths
+	///  Only available when the library is built with BLOCK_STORE_STATS (cmake -DBLOCK_STORE_STATS=ON);
+	///  otherwise the counting is compiled out entirely and this fails with ENOTSUP
+	///  Counters are kept per thread and added up here, so a snapshot taken under load is only roughly consistent
+	/// \param bs BS device
+	/// \param stats Where to put the snapshot
+	/// \return boolean indicating success of operation
+	///
+	bool block_store_get_stats(const block_store_t *const bs, block_store_stats_t *const stats);
+
+	///
+	/// Writes a readable summary of block_store_get_stats to out: calls, failures and latency per operation,
+	///  allocation scan lengths and error counts
+	/// \param bs BS device
+	/// \param out Stream to write to
+	/// \return boolean indicating success of operation, false with ENOTSUP without BLOCK_STORE_STATS
+	///
+	bool block_store_dump_stats(const block_store_t *const bs, FILE *const out);
+
 #ifdef __cplusplus
 }
 #endif
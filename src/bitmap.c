@@ -1,16 +1,33 @@
 #include "bitmap.h"
 #include <string.h>
 
+// x86-64 only: the AVX2 popcount needs _mm256_extract_epi64, which 32-bit x86 doesn't have
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define BITMAP_X86_KERNELS
+#endif
+
 // Just the one for now. Indicates we're an overlay and should not free
 // (also, make sure that ALL is as wide as ll of the flags)
-typedef enum { NONE = 0x00, OVERLAY = 0x01, ALL = 0xFF } BITMAP_FLAGS;
+// HIERARCHICAL keeps summary levels over the data so searches don't have to walk it
+typedef enum { NONE = 0x00, OVERLAY = 0x01, HIERARCHICAL = 0x02, ALL = 0xFF } BITMAP_FLAGS;
+
+// Enough summary levels for any bit count a size_t can hold (64^11 words)
+#define BITMAP_MAX_LEVELS 11
 
 struct bitmap 
 {
-	unsigned leftover_bits;  // Packing will increase this to an int anyway 2 for second one
+	unsigned leftover_bits;  // Bits in use in the last word, 0 when it's full
 	BITMAP_FLAGS flags;	  // Generic place to store flags. Not enough flags to worry about width yet.
-	uint8_t *data;
-	size_t bit_count, byte_count;
+	uint64_t *data;
+	size_t bit_count, byte_count, word_count;
+	// HIERARCHICAL only. Level 0 has a bit per data word, level k + 1 a bit per word of level k, up to a single word.
+	// Two summaries per level, since ffz wants to skip full words and ffs wants to skip empty ones.
+	// Native order and never exported, so no bitmap_le for these.
+	unsigned levels;
+	uint64_t *full[BITMAP_MAX_LEVELS];  // bit set when that word below has all of its bits set
+	uint64_t *any[BITMAP_MAX_LEVELS];   // bit set when that word below has any bit set
+	size_t level_bits[BITMAP_MAX_LEVELS];
 };
 
 #define FLAG_CHECK(bitmap, flag) ((bitmap)->flags & flag)
@@ -18,97 +35,524 @@ struct bitmap
 // #define FLAG_SET(bitmap, flag) bitmap->flags |= flag
 // #define FLAG_UNSET(bitmap, flag) bitmap->flags &= ~flag
 
-// lookup instead of always shifting bits. Should be faster? Confirmed: 10% faster
-// Also, using native int width because it should be faster as well? - Negligible/indeterminate
-//  Won't help until bitmap uses native width for the array
-static const uint8_t mask[8] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80};
-
-// Mask for all bits at index i and lower
-static const uint8_t mask_down_inclusive[8] = {0x01, 0x03, 0x07, 0x0F, 0x1F, 0x3F, 0x7F, 0xFF};
-
-// Inverted mask
-static const uint8_t invert_mask[8] = {0xFE, 0xFD, 0xFB, 0xF7, 0xEF, 0xDF, 0xBF, 0x7F};
-
-// Way more testing than I should waste my time on suggested uint8_t was faster
-// but it may still be negligible/indeterminate.
-// Since the data store is uint8_t, we already get punished for our bad alignment
-// so this doesn't really matter until everything gets moved to generic int
-
-// Total bits set in the given byte in a handy lookup table
-// Macros, man...
-// http://graphics.stanford.edu/~seander/bithacks.html#CountBitsSetTable
-#define B2(n) n, n + 1, n + 1, n + 2
-#define B4(n) B2(n), B2(n + 1), B2(n + 1), B2(n + 2)
-#define B6(n) B4(n), B4(n + 1), B4(n + 1), B4(n + 2)
-static const uint8_t bit_totals[256] = {B6(0), B6(1), B6(1), B6(2)};
-#undef B6
-#undef B4
-#undef B2
-// There is an alternative for getting bit count that only loops as many times as there are bits set
-// but that's still a loop and this table is 256B.
-/*
-   unsigned int v; // count the number of bits set in v
-   unsigned int c; // c accumulates the total bits set in v
-
-   for (c = 0; v; v >>= 1)
-   {
-   c += v & 1;
-   }
- */
-
 // A place to generalize the creation process and setup
 bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags);
 
+// Number of 64-bit words needed to cover n bits
+#define BITMAP_WORDS(n) (((n) + 63) >> 6)
+
+// Owned storage is aligned to a cache line so the vector kernels never split one
+#define BITMAP_ALIGN 64
+
+// The array is native words now, but the exported/overlaid layout is still bit i in byte i / 8,
+// which is little-endian word order. A no-op everywhere it matters.
+static inline uint64_t bitmap_le(const uint64_t value) 
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return __builtin_bswap64(value);
+#else
+	return value;
+#endif
+}
+
+// Mask for the bit within its word, in storage order
+#define BIT_MASK(bit) bitmap_le(UINT64_C(1) << ((bit) & 0x3F))
+
+// Loads a word where bit i of the word is bit (word * 64 + i) of the bitmap
+// Relaxed atomic, since thread-safe users scan while other threads CAS bits in
+static inline uint64_t bitmap_load_word(const bitmap_t *const bitmap, const size_t word) 
+{
+	return bitmap_le(__atomic_load_n(&bitmap->data[word], __ATOMIC_RELAXED));
+}
+
+// Mask for the bits of the last word that are actually in the bitmap, the rest are undetermined
+static inline uint64_t bitmap_tail_mask(const bitmap_t *const bitmap) 
+{
+	return bitmap->leftover_bits ? (UINT64_MAX >> (64 - bitmap->leftover_bits)) : UINT64_MAX;
+}
+
+// Index of the lowest set bit, value must be non-zero
+static inline unsigned bitmap_ctz(const uint64_t value) 
+{
+	return (unsigned) __builtin_ctzll(value);
+}
+
+// Whole-array kernels. The plain versions are what every target gets; on x86 the popcnt/AVX2/AVX-512
+// versions get picked at runtime for the machine we're actually on, so the library doesn't need -march.
+typedef struct 
+{
+	size_t (*popcount)(const uint64_t *words, size_t count);
+	void (*invert)(uint64_t *words, size_t count);
+} bitmap_kernels_t;
+
+static size_t bitmap_popcount_plain(const uint64_t *words, size_t count) 
+{
+	size_t total = 0;
+	for (size_t idx = 0; idx < count; ++idx) 
+	{
+		total += (size_t) __builtin_popcountll(words[idx]);
+	}
+	return total;
+}
+
+static void bitmap_invert_plain(uint64_t *words, size_t count) 
+{
+	for (size_t idx = 0; idx < count; ++idx) 
+	{
+		words[idx] = ~words[idx];
+	}
+}
+
+static const bitmap_kernels_t bitmap_kernels_plain = {bitmap_popcount_plain, bitmap_invert_plain};
+
+#ifdef BITMAP_X86_KERNELS
+// Same loop, but the compiler gets to use the popcnt instruction instead of the bit-twiddling fallback
+__attribute__((target("popcnt"))) 
+static size_t bitmap_popcount_popcnt(const uint64_t *words, size_t count) 
+{
+	size_t total = 0;
+	for (size_t idx = 0; idx < count; ++idx) 
+	{
+		total += (size_t) __builtin_popcountll(words[idx]);
+	}
+	return total;
+}
+
+// Nibble lookup through vpshufb, summed per 64-bit lane with vpsadbw
+// http://0x80.pl/articles/sse-popcount.html
+__attribute__((target("avx2,popcnt"))) 
+static size_t bitmap_popcount_avx2(const uint64_t *words, size_t count) 
+{
+	const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 
+											0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low_mask = _mm256_set1_epi8(0x0F);
+	__m256i acc = _mm256_setzero_si256();
+	size_t idx = 0;
+	for (; idx + 4 <= count; idx += 4) 
+	{
+		const __m256i value = _mm256_loadu_si256((const __m256i *) (words + idx));
+		const __m256i lo = _mm256_and_si256(value, low_mask);
+		const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(value, 4), low_mask);
+		const __m256i bytes = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo), _mm256_shuffle_epi8(lookup, hi));
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+	}
+	size_t total = (size_t) (_mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1) 
+							+ _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3));
+	for (; idx < count; ++idx) 
+	{
+		total += (size_t) __builtin_popcountll(words[idx]);
+	}
+	return total;
+}
+
+__attribute__((target("avx2"))) 
+static void bitmap_invert_avx2(uint64_t *words, size_t count) 
+{
+	const __m256i ones = _mm256_set1_epi64x(-1);
+	size_t idx = 0;
+	for (; idx + 4 <= count; idx += 4) 
+	{
+		__m256i *const at = (__m256i *) (words + idx);
+		_mm256_storeu_si256(at, _mm256_xor_si256(_mm256_loadu_si256(at), ones));
+	}
+	for (; idx < count; ++idx) 
+	{
+		words[idx] = ~words[idx];
+	}
+}
+
+// vpopcntq does a whole word per lane, and masked loads take care of the tail
+__attribute__((target("avx512f,avx512vpopcntdq"))) 
+static size_t bitmap_popcount_avx512(const uint64_t *words, size_t count) 
+{
+	__m512i acc = _mm512_setzero_si512();
+	for (size_t idx = 0; idx < count; idx += 8) 
+	{
+		const __mmask8 lanes = (count - idx >= 8) ? 0xFF : (__mmask8) ((1u << (count - idx)) - 1);
+		acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(_mm512_maskz_loadu_epi64(lanes, words + idx)));
+	}
+	return (size_t) _mm512_reduce_add_epi64(acc);
+}
+
+__attribute__((target("avx512f"))) 
+static void bitmap_invert_avx512(uint64_t *words, size_t count) 
+{
+	const __m512i ones = _mm512_set1_epi64(-1);
+	for (size_t idx = 0; idx < count; idx += 8) 
+	{
+		const __mmask8 lanes = (count - idx >= 8) ? 0xFF : (__mmask8) ((1u << (count - idx)) - 1);
+		const __m512i value = _mm512_maskz_loadu_epi64(lanes, words + idx);
+		_mm512_mask_storeu_epi64(words + idx, lanes, _mm512_xor_si512(value, ones));
+	}
+}
+
+static const bitmap_kernels_t bitmap_kernels_popcnt = {bitmap_popcount_popcnt, bitmap_invert_plain};
+static const bitmap_kernels_t bitmap_kernels_avx2 = {bitmap_popcount_avx2, bitmap_invert_avx2};
+static const bitmap_kernels_t bitmap_kernels_avx512 = {bitmap_popcount_avx512, bitmap_invert_avx512};
+#endif
+
+// Picks the kernels once, the first time they're needed
+// Racing threads just both pick the same table, so relaxed is all this needs
+static const bitmap_kernels_t *bitmap_kernels(void) 
+{
+	static const bitmap_kernels_t *selected = NULL;
+	const bitmap_kernels_t *kernels = __atomic_load_n(&selected, __ATOMIC_RELAXED);
+	if (!kernels) 
+	{
+		kernels = &bitmap_kernels_plain;
+#ifdef BITMAP_X86_KERNELS
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq")) 
+		{
+			kernels = &bitmap_kernels_avx512;
+		} 
+		else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) 
+		{
+			kernels = &bitmap_kernels_avx2;
+		} 
+		else if (__builtin_cpu_supports("popcnt")) 
+		{
+			kernels = &bitmap_kernels_popcnt;
+		}
+#endif
+		__atomic_store_n(&selected, kernels, __ATOMIC_RELAXED);
+	}
+	return kernels;
+}
+
+// Mask for the bits of word that exist in a level (or the data) of bit_count bits
+static inline uint64_t bitmap_valid_mask(const size_t word, const size_t bit_count) 
+{
+	return (word == (bit_count - 1) >> 6 && (bit_count & 0x3F)) ? (UINT64_MAX >> (64 - (bit_count & 0x3F))) : UINT64_MAX;
+}
+
+// Brings the summaries over data word up to date after it changed. Each level only changes if the one below
+// flipped between full/not full or empty/not empty, so this usually stops at level 0.
+static void bitmap_propagate(bitmap_t *const bitmap, size_t word) 
+{
+	uint64_t full_below = bitmap_load_word(bitmap, word);
+	uint64_t any_below = full_below;
+	size_t below_bits = bitmap->bit_count;
+	bool full_changed = true, any_changed = true;
+	for (unsigned level = 0; level < bitmap->levels && (full_changed || any_changed); ++level) 
+	{
+		const uint64_t valid = bitmap_valid_mask(word, below_bits);
+		const size_t idx = word >> 6;
+		const uint64_t bit = UINT64_C(1) << (word & 0x3F);
+		if (full_changed) 
+		{
+			const uint64_t old = bitmap->full[level][idx];
+			full_below = ((full_below & valid) == valid) ? (old | bit) : (old & ~bit);
+			bitmap->full[level][idx] = full_below;
+			full_changed = (full_below != old);
+		}
+		if (any_changed) 
+		{
+			const uint64_t old = bitmap->any[level][idx];
+			any_below = (any_below & valid) ? (old | bit) : (old & ~bit);
+			bitmap->any[level][idx] = any_below;
+			any_changed = (any_below != old);
+		}
+		below_bits = bitmap->level_bits[level];
+		word = idx;
+	}
+}
+
+// Builds every summary level from scratch, for after bulk changes to the data
+static void bitmap_rebuild_levels(bitmap_t *const bitmap) 
+{
+	size_t below_words = bitmap->word_count;
+	size_t below_bits = bitmap->bit_count;
+	for (unsigned level = 0; level < bitmap->levels; ++level) 
+	{
+		memset(bitmap->full[level], 0, BITMAP_WORDS(bitmap->level_bits[level]) * sizeof(uint64_t));
+		memset(bitmap->any[level], 0, BITMAP_WORDS(bitmap->level_bits[level]) * sizeof(uint64_t));
+		for (size_t word = 0; word < below_words; ++word) 
+		{
+			const uint64_t valid = bitmap_valid_mask(word, below_bits);
+			const uint64_t full_below = level ? bitmap->full[level - 1][word] : bitmap_load_word(bitmap, word);
+			const uint64_t any_below = level ? bitmap->any[level - 1][word] : full_below;
+			const uint64_t bit = UINT64_C(1) << (word & 0x3F);
+			if ((full_below & valid) == valid) 
+			{
+				bitmap->full[level][word >> 6] |= bit;
+			}
+			if (any_below & valid) 
+			{
+				bitmap->any[level][word >> 6] |= bit;
+			}
+		}
+		below_bits = bitmap->level_bits[level];
+		below_words = BITMAP_WORDS(below_bits);
+	}
+}
+
+// Summary word idx of the given level, as bits for words below that are worth looking at:
+// not full ones when looking for a zero, non-empty ones when looking for a one
+static inline uint64_t bitmap_level_word(const bitmap_t *const bitmap, const unsigned level, const size_t idx, const bool zero) 
+{
+	return zero ? (~bitmap->full[level][idx] & bitmap_valid_mask(idx, bitmap->level_bits[level])) : bitmap->any[level][idx];
+}
+
+// First data word at or after word with a zero (or a one) in it, SIZE_MAX if there isn't one.
+// Climbs until a summary word has a hit past where we are, then follows the lowest hit back down,
+// so it touches about two words per level instead of every word in between.
+static size_t bitmap_next_word(const bitmap_t *const bitmap, size_t word, const bool zero) 
+{
+	for (unsigned level = 0; level < bitmap->levels; ++level) 
+	{
+		const size_t idx = word >> 6;
+		if (idx >= BITMAP_WORDS(bitmap->level_bits[level])) 
+		{
+			return SIZE_MAX;
+		}
+		const uint64_t hits = bitmap_level_word(bitmap, level, idx, zero) & (UINT64_MAX << (word & 0x3F));
+		if (hits) 
+		{
+			word = (idx << 6) + bitmap_ctz(hits);
+			while (level-- > 0) 
+			{
+				// Summaries are exact, so the word we land on always has a hit in it
+				word = (word << 6) + bitmap_ctz(bitmap_level_word(bitmap, level, word, zero));
+			}
+			return word;
+		}
+		word = idx + 1;
+	}
+	return SIZE_MAX;
+}
+
 void bitmap_set(bitmap_t *const bitmap, const size_t bit) 
 {
-	bitmap->data[bit >> 3] |= mask[bit & 0x07];
+	bitmap->data[bit >> 6] |= BIT_MASK(bit);
+	if (bitmap->levels) 
+	{
+		bitmap_propagate(bitmap, bit >> 6);
+	}
 }
 
 void bitmap_reset(bitmap_t *const bitmap, const size_t bit) 
 {
-	bitmap->data[bit >> 3] &= invert_mask[bit & 0x07];
+	bitmap->data[bit >> 6] &= ~BIT_MASK(bit);
+	if (bitmap->levels) 
+	{
+		bitmap_propagate(bitmap, bit >> 6);
+	}
 }
 
 bool bitmap_test(const bitmap_t *const bitmap, const size_t bit) 
 {
-	return bitmap->data[bit >> 3] & mask[bit & 0x07];
+	return bitmap->data[bit >> 6] & BIT_MASK(bit);
+}
+
+bool bitmap_test_and_set(bitmap_t *const bitmap, const size_t bit) 
+{
+	uint64_t *const word = &bitmap->data[bit >> 6];
+	// Already set means nothing to do, and no point dirtying the cache line
+	if (__atomic_load_n(word, __ATOMIC_RELAXED) & BIT_MASK(bit)) 
+	{
+		return true;
+	}
+	const bool was = __atomic_fetch_or(word, BIT_MASK(bit), __ATOMIC_ACQ_REL) & BIT_MASK(bit);
+	if (bitmap->levels) 
+	{
+		bitmap_propagate(bitmap, bit >> 6);
+	}
+	return was;
+}
+
+bool bitmap_test_and_reset(bitmap_t *const bitmap, const size_t bit) 
+{
+	uint64_t *const word = &bitmap->data[bit >> 6];
+	if (!(__atomic_load_n(word, __ATOMIC_RELAXED) & BIT_MASK(bit))) 
+	{
+		return false;
+	}
+	const bool was = __atomic_fetch_and(word, ~BIT_MASK(bit), __ATOMIC_ACQ_REL) & BIT_MASK(bit);
+	if (bitmap->levels) 
+	{
+		bitmap_propagate(bitmap, bit >> 6);
+	}
+	return was;
+}
+
+size_t bitmap_claim_zeros(bitmap_t *const bitmap, const size_t start, size_t *const bits, const size_t max) 
+{
+	size_t found = 0;
+	if (bitmap && bits) 
+	{
+		for (size_t bit = bitmap_ffz_from(bitmap, start); bit != SIZE_MAX && found < max;) 
+		{
+			const size_t idx = bit >> 6;
+			// Only bits from here up, and only the ones actually in the bitmap
+			uint64_t usable = UINT64_MAX << (bit & 0x3F);
+			if (idx == bitmap->word_count - 1) 
+			{
+				usable &= bitmap_tail_mask(bitmap);
+			}
+
+			uint64_t *const word = &bitmap->data[idx];
+			uint64_t raw = __atomic_load_n(word, __ATOMIC_RELAXED);
+			uint64_t old, want;
+			do 
+			{
+				old = bitmap_le(raw);
+				// Every free usable bit, trimmed to the lowest ones if that's more than we still need
+				want = ~old & usable;
+				if ((size_t) __builtin_popcountll(want) > max - found) 
+				{
+					uint64_t keep = 0;
+					for (size_t need = max - found; need; --need) 
+					{
+						keep |= want & -want;
+						want &= want - 1;
+					}
+					want = keep;
+				}
+			} while (want && !__atomic_compare_exchange_n(word, &raw, bitmap_le(old | want), true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+			if (want && bitmap->levels) 
+			{
+				bitmap_propagate(bitmap, idx);
+			}
+
+			for (; want; want &= want - 1) 
+			{
+				bits[found++] = (idx << 6) + bitmap_ctz(want);
+			}
+			if (((idx + 1) << 6) >= bitmap->bit_count) 
+			{
+				break;
+			}
+			bit = bitmap_ffz_from(bitmap, (idx + 1) << 6);
+		}
+	}
+	return found;
 }
 
 void bitmap_flip(bitmap_t *const bitmap, const size_t bit) 
 {
-	bitmap->data[bit >> 3] ^= mask[bit & 0x07];
+	bitmap->data[bit >> 6] ^= BIT_MASK(bit);
+	if (bitmap->levels) 
+	{
+		bitmap_propagate(bitmap, bit >> 6);
+	}
 }
 
 void bitmap_invert(bitmap_t *const bitmap) 
 {
-	for (size_t byte = 0; byte < bitmap->byte_count; ++byte) 
+	bitmap_kernels()->invert(bitmap->data, bitmap->word_count);
+	bitmap_rebuild_levels(bitmap);
+}
+
+size_t bitmap_ffs(const bitmap_t *const bitmap) 
+{
+	return bitmap_ffs_from(bitmap, 0);
+}
+
+size_t bitmap_ffz(const bitmap_t *const bitmap) 
+{
+	return bitmap_ffz_from(bitmap, 0);
+}
+
+size_t bitmap_ffs_from(const bitmap_t *const bitmap, const size_t start) 
+{
+	if (bitmap && start < bitmap->bit_count) 
 	{
-		bitmap->data[byte] = ~bitmap->data[byte];
+		const size_t word_count = bitmap->word_count;
+		size_t word = start >> 6;
+		// Drop everything below start in the first word, then skip empty words entirely
+		uint64_t value = bitmap_load_word(bitmap, word) & (UINT64_MAX << (start & 0x3F));
+		if (!value && bitmap->levels) 
+		{
+			// The summaries know which word is next
+			word = bitmap_next_word(bitmap, word + 1, false);
+			if (word == SIZE_MAX) 
+			{
+				return SIZE_MAX;
+			}
+			value = bitmap_load_word(bitmap, word);
+		}
+		while (!value && ++word < word_count) 
+		{
+			value = bitmap_load_word(bitmap, word);
+		}
+		if (value) 
+		{
+			// Bits past bit_count are undetermined, so a hit out there means there's nothing left
+			const size_t result = (word << 6) + bitmap_ctz(value);
+			return (result < bitmap->bit_count ? result : SIZE_MAX);
+		}
 	}
+	return SIZE_MAX;
 }
 
-size_t bitmap_ffs(const bitmap_t *const bitmap) 
+size_t bitmap_ffz_from(const bitmap_t *const bitmap, const size_t start) 
 {
-	if (bitmap) 
+	if (bitmap && start < bitmap->bit_count) 
 	{
-		size_t result = 0;
-		for (; result < bitmap->bit_count && !bitmap_test(bitmap, result); ++result) 
+		const size_t word_count = bitmap->word_count;
+		size_t word = start >> 6;
+		// Same as ffs, just looking for set bits in the inverted word so full words get skipped
+		uint64_t value = ~bitmap_load_word(bitmap, word) & (UINT64_MAX << (start & 0x3F));
+		if (!value && bitmap->levels) 
 		{
+			word = bitmap_next_word(bitmap, word + 1, true);
+			if (word == SIZE_MAX) 
+			{
+				return SIZE_MAX;
+			}
+			value = ~bitmap_load_word(bitmap, word);
+		}
+		while (!value && ++word < word_count) 
+		{
+			value = ~bitmap_load_word(bitmap, word);
+		}
+		if (value) 
+		{
+			// The undetermined tail can read as free; filter it out here
+			const size_t result = (word << 6) + bitmap_ctz(value);
+			return (result < bitmap->bit_count ? result : SIZE_MAX);
 		}
-		return (result == bitmap->bit_count ? SIZE_MAX : result);
 	}
 	return SIZE_MAX;
 }
 
-size_t bitmap_ffz(const bitmap_t *const bitmap) 
+size_t bitmap_fls_from(const bitmap_t *const bitmap, const size_t start) 
 {
-	if (bitmap) 
+	if (bitmap && bitmap->bit_count) 
 	{
-		size_t result = 0;
-		for (; result < bitmap->bit_count && bitmap_test(bitmap, result); ++result) 
+		const size_t last = (start < bitmap->bit_count) ? start : bitmap->bit_count - 1;
+		size_t word = last >> 6;
+		// Drop everything above start in the first word (that takes care of the undetermined tail too), then walk down
+		uint64_t value = bitmap_load_word(bitmap, word) & (UINT64_MAX >> (63 - (last & 0x3F)));
+		while (!value && word > 0) 
+		{
+			value = bitmap_load_word(bitmap, --word);
+		}
+		if (value) 
 		{
+			return (word << 6) + 63 - (size_t) __builtin_clzll(value);
+		}
+	}
+	return SIZE_MAX;
+}
+
+size_t bitmap_ffz_run(const bitmap_t *const bitmap, const size_t start, const size_t count) 
+{
+	if (bitmap && count) 
+	{
+		// Hop from the start of one zero run to the next, each hop being a word-at-a-time ffz/ffs
+		// so full and empty words get skipped instead of looking at every bit
+		size_t run = bitmap_ffz_from(bitmap, start);
+		while (run != SIZE_MAX && bitmap->bit_count - run >= count) 
+		{
+			const size_t end = bitmap_ffs_from(bitmap, run);
+			if (end == SIZE_MAX || end - run >= count) 
+			{
+				return run;
+			}
+			run = bitmap_ffz_from(bitmap, end);
 		}
-		return (result == bitmap->bit_count ? SIZE_MAX : result);
 	}
 	return SIZE_MAX;
 }
@@ -118,41 +562,294 @@ size_t bitmap_total_set(const bitmap_t *const bitmap)
 	size_t total = 0;
 	if (bitmap) 
 	{
-		// If we have leftover, stop a byte early because we have to handle it differently.
-		size_t stop = bitmap->leftover_bits ? bitmap->byte_count - 1 : bitmap->byte_count;
-		for (size_t idx = 0; idx < stop; ++idx) 
+		// Every word but the last goes through the popcount kernel in one go, the last one gets masked
+		// so we don't count the bits past our bit total (which would be considered undetermined)
+		const size_t last = bitmap->word_count - 1;
+		total = bitmap_kernels()->popcount(bitmap->data, last);
+		total += (size_t) __builtin_popcountll(bitmap_load_word(bitmap, last) & bitmap_tail_mask(bitmap));
+	}
+	return total;
+}
+
+// Mask for the bits of word that fall inside [start, end), end > start
+static inline uint64_t bitmap_range_mask(const size_t word, const size_t start, const size_t end) 
+{
+	uint64_t mask = UINT64_MAX;
+	if (word == start >> 6) 
+	{
+		mask &= UINT64_MAX << (start & 0x3F);
+	}
+	if (word == (end - 1) >> 6) 
+	{
+		mask &= UINT64_MAX >> (63 - ((end - 1) & 0x3F));
+	}
+	return mask;
+}
+
+// Ranges have to be non-empty and inside the bitmap, anything else is ignored
+static inline bool bitmap_range_ok(const bitmap_t *const bitmap, const size_t start, const size_t count) 
+{
+	return bitmap && count && start < bitmap->bit_count && count <= bitmap->bit_count - start;
+}
+
+void bitmap_set_range(bitmap_t *const bitmap, const size_t start, const size_t count) 
+{
+	if (bitmap_range_ok(bitmap, start, count)) 
+	{
+		const size_t end = start + count;
+		for (size_t word = start >> 6; word <= (end - 1) >> 6; ++word) 
 		{
-			total += bit_totals[bitmap->data[idx]];
+			bitmap->data[word] |= bitmap_le(bitmap_range_mask(word, start, end));
+			if (bitmap->levels) 
+			{
+				bitmap_propagate(bitmap, word);
+			}
 		}
-		if (bitmap->leftover_bits) 
+	}
+}
+
+void bitmap_reset_range(bitmap_t *const bitmap, const size_t start, const size_t count) 
+{
+	if (bitmap_range_ok(bitmap, start, count)) 
+	{
+		const size_t end = start + count;
+		for (size_t word = start >> 6; word <= (end - 1) >> 6; ++word) 
+		{
+			bitmap->data[word] &= ~bitmap_le(bitmap_range_mask(word, start, end));
+			if (bitmap->levels) 
+			{
+				bitmap_propagate(bitmap, word);
+			}
+		}
+	}
+}
+
+bool bitmap_test_range(const bitmap_t *const bitmap, const size_t start, const size_t count) 
+{
+	if (bitmap_range_ok(bitmap, start, count)) 
+	{
+		const size_t end = start + count;
+		for (size_t word = start >> 6; word <= (end - 1) >> 6; ++word) 
+		{
+			const uint64_t mask = bitmap_range_mask(word, start, end);
+			if ((bitmap_load_word(bitmap, word) & mask) != mask) 
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+	return false;
+}
+
+size_t bitmap_count_range(const bitmap_t *const bitmap, const size_t start, const size_t count) 
+{
+	size_t total = 0;
+	if (bitmap_range_ok(bitmap, start, count)) 
+	{
+		const size_t end = start + count;
+		size_t first = start >> 6;
+		const size_t last = (end - 1) >> 6;
+		// Partial words at either end get masked, everything in between is whole words for the popcount kernel
+		total += (size_t) __builtin_popcountll(bitmap_load_word(bitmap, first) & bitmap_range_mask(first, start, end));
+		if (last > first) 
 		{
-			// haha, this is readable
-			// get the byte at the end of the bitmap, mask it so we're only looking at the bits in use
-			// then feed that to the bit_total lookup so we don't count the bits past our bit total
-			// (which whould be considered undetermined)
-			total += bit_totals[bitmap->data[bitmap->byte_count - 1] & mask_down_inclusive[bitmap->leftover_bits - 1]];
+			total += bitmap_kernels()->popcount(bitmap->data + first + 1, last - first - 1);
+			total += (size_t) __builtin_popcountll(bitmap_load_word(bitmap, last) & bitmap_range_mask(last, start, end));
 		}
 	}
 	return total;
 }
 
+// The two bitmaps have to be the same size, then it's just the op over every word
+// (plain loops, the compiler vectorizes these fine)
+static inline bool bitmap_same_size(const bitmap_t *const dst, const bitmap_t *const src) 
+{
+	return dst && src && dst->bit_count == src->bit_count;
+}
+
+bool bitmap_and(bitmap_t *const dst, const bitmap_t *const src) 
+{
+	if (bitmap_same_size(dst, src)) 
+	{
+		for (size_t word = 0; word < dst->word_count; ++word) 
+		{
+			dst->data[word] &= src->data[word];
+		}
+		bitmap_rebuild_levels(dst);
+		return true;
+	}
+	return false;
+}
+
+bool bitmap_or(bitmap_t *const dst, const bitmap_t *const src) 
+{
+	if (bitmap_same_size(dst, src)) 
+	{
+		for (size_t word = 0; word < dst->word_count; ++word) 
+		{
+			dst->data[word] |= src->data[word];
+		}
+		bitmap_rebuild_levels(dst);
+		return true;
+	}
+	return false;
+}
+
+bool bitmap_xor(bitmap_t *const dst, const bitmap_t *const src) 
+{
+	if (bitmap_same_size(dst, src)) 
+	{
+		for (size_t word = 0; word < dst->word_count; ++word) 
+		{
+			dst->data[word] ^= src->data[word];
+		}
+		bitmap_rebuild_levels(dst);
+		return true;
+	}
+	return false;
+}
+
+bool bitmap_andnot(bitmap_t *const dst, const bitmap_t *const src) 
+{
+	if (bitmap_same_size(dst, src)) 
+	{
+		for (size_t word = 0; word < dst->word_count; ++word) 
+		{
+			dst->data[word] &= ~src->data[word];
+		}
+		bitmap_rebuild_levels(dst);
+		return true;
+	}
+	return false;
+}
+
+// Where set-bit walks go next: straight to the next non-empty word with summaries, just the next word without
+// (SIZE_MAX if there's nothing left)
+static inline size_t bitmap_next_nonempty(const bitmap_t *const bitmap, const size_t word) 
+{
+	return bitmap->levels ? bitmap_next_word(bitmap, word, false) : word;
+}
+
+size_t bitmap_ffs_batch(const bitmap_t *const bitmap, const size_t start, size_t *const bits, const size_t max) 
+{
+	size_t found = 0;
+	if (bitmap && bits && start < bitmap->bit_count) 
+	{
+		// Empty words are skipped whole, and each set bit in a word costs one ctz and a clear of the lowest bit
+		uint64_t value = bitmap_load_word(bitmap, start >> 6) & (UINT64_MAX << (start & 0x3F));
+		for (size_t word = start >> 6; found < max;) 
+		{
+			if (word == bitmap->word_count - 1) 
+			{
+				value &= bitmap_tail_mask(bitmap);
+			}
+			for (; value && found < max; value &= value - 1) 
+			{
+				bits[found++] = (word << 6) + bitmap_ctz(value);
+			}
+			word = bitmap_next_nonempty(bitmap, word + 1);
+			if (word >= bitmap->word_count) 
+			{
+				break;
+			}
+			value = bitmap_load_word(bitmap, word);
+		}
+	}
+	return found;
+}
+
 void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *), void *arg) 
 {
 	if (bitmap && func) 
 	{
-		for (size_t idx = 0; idx < bitmap->bit_count; ++idx) 
+		// Word at a time, same as the batch, just calling out instead of filling an array
+		for (size_t word = bitmap_next_nonempty(bitmap, 0); word < bitmap->word_count; word = bitmap_next_nonempty(bitmap, word + 1)) 
 		{
-			if (bitmap_test(bitmap, idx)) 
+			uint64_t value = bitmap_load_word(bitmap, word);
+			if (word == bitmap->word_count - 1) 
 			{
-				func(idx, arg);
+				value &= bitmap_tail_mask(bitmap);
+			}
+			for (; value; value &= value - 1) 
+			{
+				func((word << 6) + bitmap_ctz(value), arg);
 			}
 		}
 	}
 }
 
+// Counts one finished run of zeros
+static inline void bitmap_count_run(bitmap_run_stats_t *const stats, const size_t length) 
+{
+	stats->zeros += length;
+	stats->runs++;
+	stats->histogram[63 - __builtin_clzll((unsigned long long) length)]++;
+	if (length > stats->longest) 
+	{
+		stats->longest = length;
+	}
+}
+
+void bitmap_zero_runs(const bitmap_t *const bitmap, bitmap_run_stats_t *const stats) 
+{
+	if (bitmap && stats) 
+	{
+		memset(stats, 0, sizeof(*stats));
+		size_t open = 0; // length of the run reaching the top of the previous word, still going
+		for (size_t word = 0; word < bitmap->word_count; ++word) 
+		{
+			if (!open && bitmap->levels) 
+			{
+				// No run to carry on, so skip straight to the next word with a zero in it
+				word = bitmap_next_word(bitmap, word, true);
+				if (word >= bitmap->word_count) 
+				{
+					break;
+				}
+			}
+			const uint64_t valid = (word == bitmap->word_count - 1) ? bitmap_tail_mask(bitmap) : UINT64_MAX;
+			uint64_t zeros = ~bitmap_load_word(bitmap, word) & valid;
+			if (zeros == valid) 
+			{
+				open += (size_t) __builtin_popcountll(valid);
+				continue;
+			}
+			if (open) 
+			{
+				// The open run ends in this word's low zeros (there's a one somewhere, so ~zeros isn't 0)
+				const unsigned low = bitmap_ctz(~zeros);
+				bitmap_count_run(stats, open + low);
+				open = 0;
+				zeros &= UINT64_MAX << low;
+			}
+			while (zeros) 
+			{
+				const unsigned start = bitmap_ctz(zeros);
+				const uint64_t rest = ~(zeros >> start);
+				const unsigned length = rest ? bitmap_ctz(rest) : 64 - start;
+				if (start + length == 64) 
+				{
+					// Runs into the next word
+					open = length;
+					break;
+				}
+				bitmap_count_run(stats, length);
+				zeros &= zeros + (UINT64_C(1) << start); // clear the run just counted
+			}
+		}
+		if (open) 
+		{
+			bitmap_count_run(stats, open);
+		}
+	}
+}
+
 void bitmap_format(bitmap_t *const bitmap, const uint8_t pattern) 
 {
-	memset(bitmap->data, pattern, bitmap->byte_count);
+	// Whole words, the storage always spans them. libc's memset is already vectorized for the machine.
+	memset(bitmap->data, pattern, bitmap->word_count * sizeof(uint64_t));
+	bitmap_rebuild_levels(bitmap);
 }
 
 size_t bitmap_get_bits(const bitmap_t *const bitmap) 
@@ -170,9 +867,14 @@ bitmap_t *bitmap_create(const size_t n_bits)
 	return bitmap_initialize(n_bits, NONE);
 }
 
+bitmap_t *bitmap_create_hierarchical(const size_t n_bits) 
+{
+	return bitmap_initialize(n_bits, HIERARCHICAL);
+}
+
 const uint8_t *bitmap_export(const bitmap_t *const bitmap) 
 {
-	return bitmap->data;
+	return (const uint8_t *) bitmap->data;
 }
 
 bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data) 
@@ -191,18 +893,43 @@ bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data)
 
 bitmap_t *bitmap_overlay(const size_t n_bits, void *const bitmap_data) 
 {
-	if (bitmap_data) 
+	// Word access needs word alignment
+	if (bitmap_data && !((uintptr_t) bitmap_data & (sizeof(uint64_t) - 1))) 
 	{
 		bitmap_t *bitmap = bitmap_initialize(n_bits, OVERLAY);
 		if (bitmap) 
 		{
-			bitmap->data = (uint8_t *) bitmap_data;
+			bitmap->data = (uint64_t *) bitmap_data;
+			return bitmap;
+		}
+	}
+	return NULL;
+}
+
+bitmap_t *bitmap_overlay_hierarchical(const size_t n_bits, void *const bitmap_data) 
+{
+	if (bitmap_data && !((uintptr_t) bitmap_data & (sizeof(uint64_t) - 1))) 
+	{
+		bitmap_t *bitmap = bitmap_initialize(n_bits, (BITMAP_FLAGS) (OVERLAY | HIERARCHICAL));
+		if (bitmap) 
+		{
+			// The data is already there, so the summaries have to be built from it
+			bitmap->data = (uint64_t *) bitmap_data;
+			bitmap_rebuild_levels(bitmap);
 			return bitmap;
 		}
 	}
 	return NULL;
 }
 
+void bitmap_refresh(bitmap_t *const bitmap) 
+{
+	if (bitmap) 
+	{
+		bitmap_rebuild_levels(bitmap);
+	}
+}
+
 void bitmap_destroy(bitmap_t *bitmap) 
 {
 	if (bitmap) 
@@ -212,6 +939,8 @@ void bitmap_destroy(bitmap_t *bitmap)
 			// don't free memory that isn't ours!
 			free(bitmap->data);
 		}
+		// Every summary level lives in the one allocation
+		free(bitmap->full[0]);
 		free(bitmap);
 	}
 }
@@ -231,15 +960,41 @@ bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags)
 		{
 			bitmap->flags		 = flags;
 			bitmap->bit_count	 = n_bits;
-			bitmap->byte_count	= n_bits >> 3;
-			bitmap->leftover_bits = n_bits & 0x07;
-			bitmap->byte_count += (bitmap->leftover_bits ? 1 : 0);
+			bitmap->byte_count	= (n_bits + 7) >> 3;
+			bitmap->word_count	= BITMAP_WORDS(n_bits);
+			bitmap->leftover_bits = n_bits & 0x3F;
+			bitmap->levels		= 0;
+			bitmap->full[0]		= NULL;
 
 			// FLAG HANDLING HERE
 
 			// This logic will need to be reworked when we have more than one flag, haha
 			// Maybe something like if (flags) and then contain a giant if/else-if for each flag
 			// Then a return at the end
+			// (It's come to that: HIERARCHICAL gets handled first since it can go with either)
+
+			if (FLAG_CHECK(bitmap, HIERARCHICAL) && bitmap->word_count > 1) 
+			{
+				// Each level has a bit per word of the one below, until a level fits in one word
+				size_t summary_words = 0;
+				for (size_t below = bitmap->word_count; below > 1; below = BITMAP_WORDS(below)) 
+				{
+					bitmap->level_bits[bitmap->levels++] = below;
+					summary_words += BITMAP_WORDS(below);
+				}
+				uint64_t *summary = (uint64_t *) calloc(2 * summary_words, sizeof(uint64_t));
+				if (!summary) 
+				{
+					free(bitmap);
+					return NULL;
+				}
+				for (unsigned level = 0; level < bitmap->levels; ++level) 
+				{
+					bitmap->full[level] = summary;
+					bitmap->any[level] = summary + summary_words;
+					summary += BITMAP_WORDS(bitmap->level_bits[level]);
+				}
+			}
 
 			if (FLAG_CHECK(bitmap, OVERLAY)) 
 			{
@@ -249,13 +1004,17 @@ bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags)
 			} 
 			else 
 			{
-				bitmap->data = (uint8_t *) calloc(bitmap->byte_count, 1);
+				// aligned_alloc wants a multiple of the alignment
+				const size_t bytes = (bitmap->word_count * sizeof(uint64_t) + BITMAP_ALIGN - 1) & ~(size_t)(BITMAP_ALIGN - 1);
+				bitmap->data = (uint64_t *) aligned_alloc(BITMAP_ALIGN, bytes);
 				if (bitmap->data) 
 				{
+					memset(bitmap->data, 0, bytes);
 					return bitmap;
 				}
 			}
 
+			free(bitmap->full[0]);
 			free(bitmap);
 		}
 	}
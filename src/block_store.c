@@ -4,7 +4,15 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <stddef.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#ifdef BLOCK_STORE_LZ4
+#include <lz4.h>
+#endif
 
 
 #include "bitmap.h"
@@ -17,276 +25,2871 @@
 
 struct block_store 
 {
-	uint8_t blocks[BLOCK_STORE_NUM_BLOCKS][BLOCK_SIZE_BYTES]; //2D array representing storage
+	uint8_t *blocks; //num_blocks * block_size bytes of storage, block i starts at blocks + i * block_size
+	size_t num_blocks; //total number of blocks, including the reserved bitmap blocks
+	size_t block_size; //bytes per block
+	size_t bitmap_start; //first block reserved for the bitmap
+	size_t bitmap_blocks; //number of blocks reserved for the bitmap
 	bitmap_t  *bitmap; //pointer to a bitmap keeping track of what blocks are used vs free
-	uint8_t *secondHalf; 
+	bitmap_t *full_words; //one bit per 64-bit word of bitmap, set when that word has no free blocks left
+	size_t free_hint; //no block below this id is free, so allocation can start its search here
+	void *mapping; //start of the mmap'd image file when the blocks live in one, NULL for heap stores
+	size_t mapping_bytes; //length of that mapping
+	bool mapping_shared; //changes go back to the file (MAP_SHARED) rather than staying private
+	BLOCK_STORE_FLAGS flags; //options the store was created with
+	pthread_rwlock_t *stripes; //BS_THREADSAFE only: LOCK_STRIPES locks over the block data, block i uses stripe i % LOCK_STRIPES
+	struct block_store_cache *caches; //BS_ALLOC_CACHE only: CACHE_SLOTS magazines of pre-claimed blocks
+	size_t used; //blocks handed out plus the reserved ones; blocks sitting in a cache are claimed in the bitmap but not counted
+	struct block_store_journal *journal; //write-ahead journal, NULL unless block_store_journal_open was called
+	bitmap_t *dirty; //blocks whose contents changed since image_path was saved, all a checkpoint of it has to rewrite
+	bitmap_t *unjournaled; //dirty blocks no journal record has the contents of (written before journal_open, or through a pointer)
+	char *image_path; //the image dirty is relative to, NULL until the store is checkpointed or loaded from a file
+	struct block_store_async *async; //worker pool for the _async calls, set up on first use
+	struct block_store *snapshots; //live snapshots of this store, linked through next_snapshot; changes go under every stripe
+	struct block_store *next_snapshot;
+	bool destroyed; //destroyed while it still had snapshots, only blocks and stripes are left until the last one goes
+	struct block_store *origin; //snapshots only: the store this is a view of, whose blocks and stripes it shares
+	uint8_t ***saved; //snapshots only: pages of SAVED_PAGE_BLOCKS entries, per block the copy made before the origin changed it, NULL while still shared
+	uint8_t *saved_bitmap; //snapshots only: room for the copies of the origin's bitmap blocks, set aside so making one can't fail
+#ifdef BLOCK_STORE_STATS
+	struct block_store_stats_shard *stats; //STATS_SHARDS sets of counters, threads spread over them like the caches
+#endif
 };
-typedef enum { NONE = 0x00, OVERLAY = 0x01, ALL = 0xFF } BITMAP_FLAGS;
 
-struct bitmap 
+// Number of allocation caches in a BS_ALLOC_CACHE store; threads are spread over them round robin
+#define CACHE_SLOTS 16
+// Most block ids a cache holds at once, and so how many a refill claims in one go
+#define CACHE_MAGAZINE 32
+
+/*
+	A magazine of block ids already claimed in the bitmap, so most allocations are just a pop off a mostly
+	uncontended slot. Refills claim a batch with bitmap_claim_zeros starting at the slot's own cursor, which starts
+	each slot in a different part of the store so threads aren't all fighting over the same bitmap bytes.
+*/
+typedef struct block_store_cache 
 {
-	unsigned leftover_bits;  // Packing will increase this to an int anyway 2 for second one
-	BITMAP_FLAGS flags;	  // Generic place to store flags. Not enough flags to worry about width yet.
-	uint8_t *data;
-	size_t bit_count, byte_count;
-};
+	pthread_mutex_t lock; //more threads than slots means sharing
+	size_t cursor; //where the next refill starts looking
+	size_t next; //ids[next .. count) are ready to hand out
+	size_t count;
+	size_t ids[CACHE_MAGAZINE];
+} block_store_cache_t;
 
-// You might find this handy. I put it around unused parameters, but you should
-// remove it before you submit. Just allows things to compile initially.
+/*
+	Journal records. Each change is one of these, writes followed by the block itself, and a commit record closes
+	each group made durable by block_store_journal_commit. Replay stops at the first record that doesn't check out
+	and only applies what came before the last commit, so a torn tail just disappears.
+	Replaying is idempotent (writes carry whole blocks, alloc/release set/clear bits), so replaying a journal over an
+	image that already has some of its changes is harmless.
+*/
+typedef enum { JOURNAL_WRITE = 1, JOURNAL_ALLOC = 2, JOURNAL_RELEASE = 3, JOURNAL_COMMIT = 4 } JOURNAL_RECORD_TYPE;
+
+typedef struct block_store_journal_record 
+{
+	uint32_t type; //JOURNAL_RECORD_TYPE
+	uint32_t reserved; //zero
+	uint64_t block_id; //first block the record covers
+	uint64_t count; //blocks covered, always 1 for writes
+	uint64_t checksum; //block_store_checksum of the fields above and the block that follows, if any
+} block_store_journal_record_t;
+
+typedef struct block_store_journal 
+{
+	pthread_mutex_t lock; //covers everything below; held across a release so the record can't lag the change
+	int fd;
+	off_t offset; //where the next write out goes, the end of what's on disk
+	uint8_t *buffer; //records waiting for the next write out
+	size_t length;
+	size_t capacity;
+	bool failed; //a record or write out was lost, so the next commit has to report it (until a checkpoint)
+	int error; //errno from that failure
+} block_store_journal_t;
 
 /*
-	This function creates a new block store and returns a pointer to it. 
-	It first allocates memory for the block store and initializes it to zeros using the memset 
-	(an alternative method to initialize newly-allocated memory to all 0s is to use calloc instead of malloc). 
-	Then it sets the bitmap field of the block store to an overlay of a bitmap with size BITMAP_SIZE_BYTES on the 
-	blocks starting at index BITMAP_START_BLOCK. 
-	Finally, it marks the blocks used by the bitmap as allocated using the block_store_request function.
+	Asynchronous requests queue up here and are run by worker threads through the normal synchronous calls.
+	Flushes, serializes and checkpoints are barriers: one isn't started until everything ahead of it has finished.
 */
-block_store_t *block_store_create()
+typedef enum { ASYNC_READ, ASYNC_WRITE, ASYNC_FLUSH, ASYNC_SERIALIZE, ASYNC_CHECKPOINT } ASYNC_REQUEST_TYPE;
+
+typedef struct block_store_async_request 
 {
-	block_store_t *bs = (block_store_t *)malloc(sizeof(block_store_t)); //allocating memory for the block
-	if(bs == NULL) return NULL; //checking we allocated correctly
+	struct block_store_async_request *next;
+	ASYNC_REQUEST_TYPE type;
+	size_t block_id;
+	void *buffer; //for serializes and checkpoints, the request's own copy of the file name
+	block_store_callback_t callback;
+	void *arg;
+} block_store_async_request_t;
 
-	memset(bs, 0, sizeof(block_store_t)); //setting all values in the block to 0
-	
-	bs->bitmap = bitmap_create(BLOCK_STORE_NUM_BLOCKS); //setting up the bitmap of the block
-	if(bs->bitmap == NULL){ //checking that the bitmap was created correctly, if not, deallocate all allocated memory
-		free(bs);
-		return NULL;
+// Most worker threads a thread safe store gets; other stores get one so requests run one at a time, in order
+#define ASYNC_WORKERS 4
+
+typedef struct block_store_async 
+{
+	pthread_mutex_t lock; //covers everything below
+	pthread_cond_t work; //signalled when there may be a request for a worker to start, or it's time to stop
+	pthread_cond_t idle; //signalled when pending drops to zero
+	block_store_async_request_t *head, *tail; //queued, not started yet
+	size_t running; //started, not finished
+	size_t pending; //queued plus running
+	bool stopping;
+	size_t workers; //threads started so far
+	pthread_t threads[ASYNC_WORKERS];
+} block_store_async_t;
+
+#ifdef BLOCK_STORE_STATS
+/*
+	Counters are kept in shards, one cache line aligned set per group of threads, so threads don't all bump the same
+	counters; block_store_get_stats adds them up. Threads share a shard once there are more than STATS_SHARDS of
+	them, so updates are still atomic (but relaxed, a snapshot taken under load is only approximately consistent).
+*/
+#define STATS_SHARDS 16
+
+typedef struct block_store_stats_shard 
+{
+	_Alignas(64) block_store_stats_t counts;
+} block_store_stats_shard_t;
+
+// Public entry points are wrapped with these: time the call, count it and any failure, and put errno back as it was
+// if the call didn't set it. Compiled out entirely without BLOCK_STORE_STATS.
+#define STATS_BEGIN() const int stats_errno = errno; const uint64_t stats_start = block_store_stats_begin()
+#define STATS_END(bs, op, failed) block_store_stats_end((bs), (op), stats_start, (failed), stats_errno)
+#define STATS_SCAN(bs, blocks) block_store_stats_scan((bs), (blocks))
+#else
+#define STATS_BEGIN() ((void)0)
+#define STATS_END(bs, op, failed) ((void)(failed))
+#define STATS_SCAN(bs, blocks) ((void)0)
+#endif
+
+// Buffered records past this get written out early (but not synced), so a long group doesn't pile up in memory
+#define JOURNAL_BUFFER_BYTES (1 << 20)
+
+// Number of 64-bit bitmap words (and so summary bits) needed to cover the store
+#define SUMMARY_SIZE_BITS(bs) (((bs)->num_blocks + 63) / 64)
+
+// Number of reader/writer locks block data is striped over in thread safe stores. Whole-store operations hold every
+// stripe along with every cache slot and the journal lock, and that has to stay under the 64 locks a thread may hold
+// at once in ThreadSanitizer's deadlock detector
+#define LOCK_STRIPES 32
+
+#define THREADSAFE(bs) ((bs)->flags & BS_THREADSAFE)
+
+#define SNAPSHOT(bs) ((bs)->origin != NULL)
+
+// Sets a bit in one of the store's bitmaps, atomically if other threads may be at it too. Returns the old value.
+static inline bool block_store_bit_set(const block_store_t *const bs, bitmap_t *const bitmap, const size_t bit)
+{
+	if(THREADSAFE(bs)){
+		return bitmap_test_and_set(bitmap, bit);
 	}
+	const bool was = bitmap_test(bitmap, bit);
+	bitmap_set(bitmap, bit);
+	return was;
+}
 
-	bitmap_format(bs->bitmap, 0); //setting values in the bitmap to 0
+// Clears a bit in one of the store's bitmaps, atomically if other threads may be at it too. Returns the old value.
+static inline bool block_store_bit_reset(const block_store_t *const bs, bitmap_t *const bitmap, const size_t bit)
+{
+	if(THREADSAFE(bs)){
+		return bitmap_test_and_reset(bitmap, bit);
+	}
+	const bool was = bitmap_test(bitmap, bit);
+	bitmap_reset(bitmap, bit);
+	return was;
+}
 
-	for(size_t i = 0; i < BITMAP_NUM_BLOCKS; i++){ //itteratting through the blocks in the bitmap
-		bitmap_set(bs->bitmap, BITMAP_START_BLOCK + i); //setting the bitmap
+// Keeps the running used count, atomically if other threads may be at it too
+static inline void block_store_add_used(block_store_t *const bs, const size_t count)
+{
+	if(THREADSAFE(bs)){
+		__atomic_fetch_add(&bs->used, count, __ATOMIC_RELAXED);
+	}else{
+		bs->used += count;
 	}
+}
 
-	return bs;
+static inline void block_store_sub_used(block_store_t *const bs, const size_t count)
+{
+	if(THREADSAFE(bs)){
+		__atomic_fetch_sub(&bs->used, count, __ATOMIC_RELAXED);
+	}else{
+		bs->used -= count;
+	}
 }
 
 /*
-	This function destroys a block store by freeing the memory allocated to it. 
-	It first checks if the pointer to the block store is not NULL, and if so, 
-	it frees the memory allocated to the bitmap and then to the block store.
+	Lowers free_hint to block_id if it is above it, without losing a concurrent update (call after the block is freed).
+	The hint is exchanged even when it stays put, so this always takes its turn on free_hint: see block_store_raise_hint.
 */
-void block_store_destroy(block_store_t *const bs)
+static inline void block_store_lower_hint(block_store_t *const bs, const size_t block_id)
 {
-	if(bs){ //if the block exists, destroy its bitmap and deallocate its memory
-		bitmap_destroy(bs->bitmap);
-		free(bs);
+	size_t hint = __atomic_load_n(&bs->free_hint, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&bs->free_hint, &hint, block_id < hint ? block_id : hint, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)){
 	}
 }
+
 /*
- This function finds the first free block in the block store and marks it as allocated in the bitmap.
-  It returns the index of the allocated block or SIZE_MAX if no free block is available.
+	Moves free_hint up from seen to past (the allocation that found nothing free in between), unless it has moved
+	since. A block below past can be freed between that search and the move, by a release whose own lowering saw
+	the old hint and so left it alone; looking again after the move catches that. The lowering and the move are both
+	exchanges on free_hint, so one comes after the other: either the lowering sees the move, or the move read what
+	the lowering wrote and so sees the block it freed.
 */
-size_t block_store_allocate(block_store_t *const bs)
+static void block_store_raise_hint(block_store_t *const bs, size_t seen, const size_t past)
 {
-	if(bs == NULL || bs->blocks == NULL || bs->bitmap == NULL){ //check that parameters were passed in correctly
-		errno = EINVAL; //invalid argument
-		return SIZE_MAX; //no free block available
+	if(__atomic_compare_exchange_n(&bs->free_hint, &seen, past, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED) && THREADSAFE(bs)){
+		const size_t freed = bitmap_ffz_from(bs->bitmap, seen);
+		if(freed < past){
+			block_store_lower_hint(bs, freed);
+		}
 	}
-	
-	for(size_t i = 0; i < BLOCK_STORE_NUM_BLOCKS; i++){ //iterrate through the blocks
-		if((i < BITMAP_START_BLOCK) || (i >= BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS)){ //skipping blocks used to store the bitmap itself
-			if(!bitmap_test(bs->bitmap, i)){ //check if the current value is 0
-				bitmap_set(bs->bitmap, i); //mark it as used
-				return i; //return newly allocated index
+}
+
+/*
+	Takes the stripe locks covering count blocks from first (read or write). Stripes are always taken in ascending
+	order so two ranges can't deadlock each other, and a range that wraps all the way round just takes them all.
+	No-op for stores that aren't thread safe.
+*/
+static void block_store_lock_range(const block_store_t *const bs, const size_t first, const size_t count, const bool write)
+{
+	if(bs->stripes){
+		for(size_t stripe = 0; stripe < LOCK_STRIPES; stripe++){
+			if(count >= LOCK_STRIPES || (stripe + LOCK_STRIPES - first % LOCK_STRIPES) % LOCK_STRIPES < count){
+				if(write){
+					pthread_rwlock_wrlock(&bs->stripes[stripe]);
+				}else{
+					pthread_rwlock_rdlock(&bs->stripes[stripe]);
+				}
 			}
 		}
 	}
+}
 
-	errno = ENOSPC; //no space to allocate to
-	return SIZE_MAX;
+// Drops the locks block_store_lock_range took
+static void block_store_unlock_range(const block_store_t *const bs, const size_t first, const size_t count)
+{
+	if(bs->stripes){
+		for(size_t stripe = 0; stripe < LOCK_STRIPES; stripe++){
+			if(count >= LOCK_STRIPES || (stripe + LOCK_STRIPES - first % LOCK_STRIPES) % LOCK_STRIPES < count){
+				pthread_rwlock_unlock(&bs->stripes[stripe]);
+			}
+		}
+	}
 }
 
 /*
-	This function marks a specific block as allocated in the bitmap. 
-	It first checks if the pointer to the block store is not NULL and if the block_id is within the range of valid block indices. 
-	If the block is already marked as allocated, it returns false. 
-	Otherwise, it marks the block as allocated and checks that the block was indeed marked as allocated by testing the bitmap. 
-	It returns true if the block was successfully marked as allocated, false otherwise.
+	FNV-1a style hash over bytes, a 64-bit word at a time since records and blocks are always whole words.
+	Start with hash = BLOCK_STORE_FNV_BASIS, and chain calls to cover several pieces.
 */
-bool block_store_request(block_store_t *const bs, const size_t block_id)
+#define BLOCK_STORE_FNV_BASIS 0xcbf29ce484222325ULL
+static uint64_t block_store_checksum(uint64_t hash, const void *const data, const size_t bytes)
 {
-	if(bs == NULL || block_id >= BLOCK_STORE_NUM_BLOCKS || bs->bitmap == NULL){ //Check that parameters were passed correctly
-		return false;
+	for(size_t i = 0; i + sizeof(uint64_t) <= bytes; i += sizeof(uint64_t)){
+		uint64_t word;
+		memcpy(&word, (const uint8_t *)data + i, sizeof(word));
+		hash = (hash ^ word) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+// Writes out the buffered records (caller holds the journal lock), without syncing
+static void block_store_journal_write_out(block_store_journal_t *const journal)
+{
+	size_t done = 0;
+	while(done < journal->length && !journal->failed){
+		const ssize_t wrote = pwrite(journal->fd, journal->buffer + done, journal->length - done, journal->offset + (off_t)done);
+		if(wrote < 0 && errno == EINTR) continue;
+		if(wrote <= 0){
+			journal->failed = true;
+			journal->error = (wrote < 0) ? errno : EIO;
+			break;
+		}
+		done += (size_t)wrote;
 	}
+	journal->offset += (off_t)done;
+	journal->length = 0;
+}
 
-	if(block_id >= BITMAP_START_BLOCK && block_id < BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS) return false; //check that the block_id is within acceptable bounds
+// Takes the journal lock, if there's a journal
+static inline void block_store_journal_begin(const block_store_t *const bs)
+{
+	if(bs->journal){
+		pthread_mutex_lock(&bs->journal->lock);
+	}
+}
 
-	if(bitmap_test(bs->bitmap, block_id)){ //if set at the block_id, return false
-		return false;
+static inline void block_store_journal_end(const block_store_t *const bs)
+{
+	if(bs->journal){
+		pthread_mutex_unlock(&bs->journal->lock);
+	}
+}
+
+/*
+	Appends a record to the journal buffer (caller holds the journal lock). block is the new contents for a write,
+	NULL for everything else. Failures don't stop the change itself, they make the next commit fail instead.
+*/
+static void block_store_journal_record(const block_store_t *const bs, const JOURNAL_RECORD_TYPE type, const size_t block_id, const size_t count, const void *const block)
+{
+	block_store_journal_t *const journal = bs->journal;
+	if(journal == NULL){
+		return;
+	}
+	const size_t payload = block ? bs->block_size : 0;
+	const size_t needed = journal->length + sizeof(block_store_journal_record_t) + payload;
+	if(needed > journal->capacity){
+		size_t capacity = journal->capacity ? journal->capacity * 2 : 4096;
+		while(capacity < needed) capacity *= 2;
+		uint8_t *const grown = (uint8_t *)realloc(journal->buffer, capacity);
+		if(grown == NULL){
+			journal->failed = true;
+			journal->error = ENOMEM;
+			return;
+		}
+		journal->buffer = grown;
+		journal->capacity = capacity;
 	}
 
-	//find the first free block, set it to used, return true
-	bitmap_set(bs->bitmap, block_id);
-	return true;
+	block_store_journal_record_t record = { .type = type, .reserved = 0, .block_id = block_id, .count = count, .checksum = 0 };
+	record.checksum = block_store_checksum(block_store_checksum(BLOCK_STORE_FNV_BASIS, &record, offsetof(block_store_journal_record_t, checksum)), block, payload);
+	memcpy(journal->buffer + journal->length, &record, sizeof(record));
+	if(payload){
+		memcpy(journal->buffer + journal->length + sizeof(record), block, payload);
+	}
+	journal->length = needed;
+	if(journal->length >= JOURNAL_BUFFER_BYTES){
+		block_store_journal_write_out(journal);
+	}
+}
 
+// Journals a change that has already been made (allocations: replaying one that's already in an image is harmless)
+static inline void block_store_journal_note(const block_store_t *const bs, const JOURNAL_RECORD_TYPE type, const size_t block_id, const size_t count, const void *const block)
+{
+	if(bs->journal){
+		block_store_journal_begin(bs);
+		block_store_journal_record(bs, type, block_id, count, block);
+		block_store_journal_end(bs);
+	}
 }
 
-/*This function marks a specific block as free in the bitmap. It first checks if the pointer to the block store is
- not NULL and if the block_id is within the range of valid block indices. Then, it resets the bit corresponding to 
- the block in the bitmap.
- */
-void block_store_release(block_store_t *const bs, const size_t block_id)
+// Notes that blocks' contents changed, so the next incremental checkpoint writes them out
+static inline void block_store_mark_dirty(const block_store_t *const bs, const size_t block_id, const size_t count)
 {
-			if(bs == NULL || bs->blocks == NULL || bs->bitmap == NULL){ //check for valid parameters
-				return  ;
-			}
+	for(size_t i = 0; i < count; i++){
+		block_store_bit_set(bs, bs->dirty, block_id + i);
+		if(bs->journal == NULL){ //nothing to replay it from
+			block_store_bit_set(bs, bs->unjournaled, block_id + i);
+		}
+	}
+}
 
-			if(block_id >= BITMAP_START_BLOCK && block_id < BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS){ //check that block_id is within acceptable range
-				return;
-			}
+// Start of the given block's storage
+static inline uint8_t *block_store_block(const block_store_t *const bs, const size_t block_id)
+{
+	return bs->blocks + block_id * bs->block_size;
+}
 
-			//find the bit, reset it 
-			// int bitmapIndex = block_id / (BLOCK_SIZE_BYTES * 8 -1);
-			//uint8_t * bitmap = bs->bitmap[bitmapIndex];
-			bitmap_reset(bs->bitmap, block_id);	
+// True if block_id is one of the blocks holding the bitmap
+static inline bool block_store_is_reserved(const block_store_t *const bs, const size_t block_id)
+{
+	return block_id >= bs->bitmap_start && block_id < bs->bitmap_start + bs->bitmap_blocks;
 }
+
+// Blocks per page of a snapshot's table of saved copies; a page is only allocated once a block in it is copied
+#define SAVED_PAGE_BLOCKS 512
+
 /*
-*This function returns the number of blocks that are currently allocated in the block store. 
-*It first checks if the pointer to the block store is not NULL and then uses the bitmap_total_set function to count the number of set bits in the bitmap
+	Where a snapshot keeps its copy of block_id, NULL if that page of its table doesn't exist. With create a missing
+	page is allocated (NULL with ENOMEM if it can't be); writers under different stripes share pages, so the first
+	one to install a page wins and the others free theirs.
 */
-size_t block_store_get_used_blocks(const block_store_t *const bs)
+static uint8_t **block_store_saved_entry(const block_store_t *const snapshot, const size_t block_id, const bool create)
+{
+	uint8_t ***const slot = &snapshot->saved[block_id / SAVED_PAGE_BLOCKS];
+	uint8_t **page = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if(page == NULL && create){
+		uint8_t **const fresh = (uint8_t **)calloc(SAVED_PAGE_BLOCKS, sizeof(uint8_t *));
+		if(fresh == NULL){
+			errno = ENOMEM;
+			return NULL;
+		}
+		if(__atomic_compare_exchange_n(slot, &page, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+			page = fresh;
+		}else{
+			free(fresh);
+		}
+	}
+	return page ? &page[block_id % SAVED_PAGE_BLOCKS] : NULL;
+}
+
+/*
+	Copy on write: gives every snapshot still sharing one of count blocks from block_id its own copy of the current
+	contents, before bs changes them (caller holds the blocks' stripes for writing, which also keeps the snapshot list
+	still). Returns false with ENOMEM if a copy couldn't be made, and then the change mustn't go ahead. Copies of
+	bitmap blocks go in the room set aside for them, in pages made along with the snapshot, so those never fail.
+*/
+static bool block_store_preserve(const block_store_t *const bs, const size_t block_id, const size_t count)
 {
+	for(block_store_t *snapshot = bs->snapshots; snapshot; snapshot = snapshot->next_snapshot){
+		for(size_t id = block_id; id < block_id + count; id++){
+			uint8_t **const entry = block_store_saved_entry(snapshot, id, true);
+			if(entry == NULL){ //the copies already made are of unchanged blocks, so they can stay
+				return false;
+			}
+			if(*entry == NULL){
+				uint8_t *const copy = block_store_is_reserved(bs, id) ? snapshot->saved_bitmap + (id - bs->bitmap_start) * bs->block_size
+					: (uint8_t *)malloc(bs->block_size);
+				if(copy == NULL){
+					errno = ENOMEM;
+					return false;
+				}
+				memcpy(copy, block_store_block(bs, id), bs->block_size);
+				*entry = copy;
+			}
+		}
+	}
+	return true;
+}
 
-	if(bs == NULL || bs->bitmap == NULL) return SIZE_MAX; //check that the parameters were passed correctly
+/*
+	Copy on write for the allocation bitmap: before count of its bits from first change, gives every snapshot still
+	sharing the bitmap blocks holding them its own copy, and returns holding those blocks' stripes (for reading, or for
+	writing if it made a copy) until block_store_preserve_bits_done. The change, and the used count catching up with
+	it, go in between, so a snapshot can't be taken part way: it would see the bits changed but not the count.
+	Stores that aren't thread safe have no stripes, and only need a look at the snapshots. Caller holds no stripes;
+	with every stripe already held for writing (compaction), block_store_preserve does the same job.
+*/
+static void block_store_preserve_bits(const block_store_t *const bs, const size_t first, const size_t count)
+{
+	if(count == 0 || (bs->stripes == NULL && bs->snapshots == NULL)){ //nothing to keep, and nothing to hold
+		return;
+	}
+	const size_t bits_per_block = bs->block_size * 8;
+	const size_t block = bs->bitmap_start + first / bits_per_block;
+	const size_t blocks = (first + count - 1) / bits_per_block - first / bits_per_block + 1;
+	block_store_lock_range(bs, block, blocks, false);
+	bool shared = false;
+	for(block_store_t *snapshot = bs->snapshots; snapshot && !shared; snapshot = snapshot->next_snapshot){
+		for(size_t id = block; id < block + blocks && !shared; id++){
+			const uint8_t *const *const entry = (const uint8_t *const *)block_store_saved_entry(snapshot, id, false);
+			shared = *entry == NULL; //bitmap blocks' pages always exist
+		}
+	}
+	if(shared){ //copies are made with nobody changing the bits under them
+		block_store_unlock_range(bs, block, blocks);
+		block_store_lock_range(bs, block, blocks, true);
+		block_store_preserve(bs, block, blocks);
+	}
+}
 
-	// size_t used = 0; //count for total used blocks
-	// for(size_t i = 0; i < BLOCK_STORE_NUM_BLOCKS; i++){ //iterate through all blocks
-	// 	if(bitmap_test(bs->bitmap, i)){ //test if the bit is set
-	// 		used++; //increase the total used count
-	// 	}
-	// }
-	return bitmap_total_set(bs->bitmap);
-	// return used; //return the used count
+// Lets go of the stripes block_store_preserve_bits returned holding, once the bits and the used count have changed
+static void block_store_preserve_bits_done(const block_store_t *const bs, const size_t first, const size_t count)
+{
+	if(count && bs->stripes){
+		const size_t bits_per_block = bs->block_size * 8;
+		block_store_unlock_range(bs, bs->bitmap_start + first / bits_per_block, (first + count - 1) / bits_per_block - first / bits_per_block + 1);
+	}
+}
 
+// What a read of the given block sees: the snapshot's own copy if it has one, the shared block otherwise
+static inline const uint8_t *block_store_view(const block_store_t *const bs, const size_t block_id)
+{
+	uint8_t **const entry = bs->saved ? block_store_saved_entry(bs, block_id, false) : NULL;
+	return (entry && *entry) ? *entry : block_store_block(bs, block_id);
 }
 
 /*
-*This function returns the number of blocks that are currently free in the block store. It first checks if the pointer to the block store is not NULL and then calculates the 
-*difference between the total number of blocks and the number of used blocks using the block_store_get_used_blocks and BLOCK_STORE_NUM_BLOCKS.
+	Copies bs's bitmap blocks as it sees them into buffer (bitmap_blocks * block_size bytes). A snapshot's are taken
+	under their stripes, as the origin may be copying them for it; for anything else the caller holds writers off.
 */
-size_t block_store_get_free_blocks(const block_store_t *const bs)
+static void block_store_copy_bitmap(const block_store_t *const bs, uint8_t *const buffer)
 {
-		if(bs == NULL) return SIZE_MAX; //check correct parameter passing
-	    return BLOCK_STORE_NUM_BLOCKS - block_store_get_used_blocks(bs); //return the total number of blocks minus the amount of used blocks
+	for(size_t i = 0; i < bs->bitmap_blocks; i++){
+		if(SNAPSHOT(bs)){
+			block_store_lock_range(bs, bs->bitmap_start + i, 1, false);
+		}
+		memcpy(buffer + i * bs->block_size, block_store_view(bs, bs->bitmap_start + i), bs->block_size);
+		if(SNAPSHOT(bs)){
+			block_store_unlock_range(bs, bs->bitmap_start + i, 1);
+		}
+	}
 }
 
-//This function returns the total number of blocks in the block store, which is defined by BLOCK_STORE_NUM_BLOCKS.
-size_t block_store_get_total_blocks()
+static block_store_t *block_store_init(const size_t num_blocks, const size_t block_size, const unsigned flags, uint8_t *const storage);
+static void block_store_async_stop(block_store_t *const bs);
+static void block_store_snapshot_detach(block_store_t *const snapshot);
+static void block_store_free_saved(block_store_t *const snapshot);
+static void block_store_load_bitmap(block_store_t *const bs);
+static void block_store_mark_nonzero_blocks(block_store_t *const bs);
+
+// Keeps the summary bit for the word holding block_id in step with the allocation bitmap
+static void block_store_sync_summary(block_store_t *const bs, const size_t block_id)
 {
-	return BLOCK_STORE_NUM_BLOCKS; //return the total number of blocks
+	const size_t word = block_id / 64;
+	// ffz from the start of the word lands past the word (or SIZE_MAX) only if the word is full
+	if(bitmap_ffz_from(bs->bitmap, word * 64) / 64 != word){
+		block_store_bit_set(bs, bs->full_words, word);
+	}else{
+		block_store_bit_reset(bs, bs->full_words, word);
+	}
 }
 
-//This function reads the contents of a block into a buffer. It returns the number of bytes successfully read.
-size_t block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer)
+// Rebuilds the summary and the free hint from scratch after the bitmap was changed behind our back
+static void block_store_rebuild_summary(block_store_t *const bs)
 {
-	if(bs == NULL || buffer == NULL || block_id >= BLOCK_STORE_NUM_BLOCKS){ //check that the parameters were passed correctly
-		return 0;
+	for(size_t word = 0; word < SUMMARY_SIZE_BITS(bs); word++){
+		block_store_sync_summary(bs, word * 64);
 	}
-
-	memcpy(buffer, bs->blocks[block_id], BLOCK_SIZE_BYTES); //copy the from the block at block_id to the buffer for amount BLOCK_SIZE_BYTES
-	return BLOCK_SIZE_BYTES; //return the amount copied
+	bs->free_hint = 0;
 }
 
-//This function writes the contents of a buffer to a block. It returns the number of bytes successfully written.
-size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer)
+// You might find this handy. I put it around unused parameters, but you should
+// remove it before you submit. Just allows things to compile initially.
+
+/*
+	This function creates a new block store with the default geometry and returns a pointer to it.
+*/
+block_store_t *block_store_create()
 {
+	return block_store_create_ex(BLOCK_STORE_NUM_BLOCKS, BLOCK_SIZE_BYTES);
+}
 
-	if(bs == NULL || buffer == NULL || block_id >= BLOCK_STORE_NUM_BLOCKS){ //check for valid parameters
-		errno = EINVAL; //Invalid argument
-		return 0;
-	}
-	memcpy(bs->blocks[block_id], buffer, BLOCK_SIZE_BYTES); //copy from the buffer to the block at index block_id for amount BLOCK_SIZE_BYTES
+/*
+	This function creates a new block store with num_blocks blocks of block_size bytes and returns a pointer to it.
+	It first allocates the block store itself and the zeroed block storage (calloc, so huge stores only cost
+	what is actually touched). Then it creates a bitmap with one bit per block, and reserves enough blocks to hold
+	that bitmap, starting at BITMAP_START_BLOCK when the store is big enough and at block 0 when it is not.
+	Finally, it marks the blocks used by the bitmap as allocated.
+*/
+block_store_t *block_store_create_ex(const size_t num_blocks, const size_t block_size)
+{
+	return block_store_init(num_blocks, block_size, BS_NONE, NULL);
+}
 
-	return BLOCK_SIZE_BYTES; //return the amount copied
+/*
+	This function creates a new block store like block_store_create_ex, with the given BLOCK_STORE_FLAGS options.
+*/
+block_store_t *block_store_create_flags(const size_t num_blocks, const size_t block_size, const unsigned flags)
+{
+	return block_store_init(num_blocks, block_size, flags, NULL);
 }
-//This function deserializes a block store from a file. It returns a pointer to the resulting block_store_t struct.
 
-block_store_t *block_store_deserialize(const char *const filename)
+/*
+	The shared part of every create: validates the geometry, lays out the bitmap blocks and builds the bitmaps.
+	The allocation bitmap is overlaid on its reserved blocks, so it is part of the image and gets saved and loaded
+	with the rest of the blocks.
+	storage is the block array to use, or NULL to calloc a zeroed one; a given array is never freed by destroy
+	unless the caller marks it as such afterwards, and its bitmap blocks are loaded rather than reset.
+*/
+static block_store_t *block_store_init(const size_t num_blocks, const size_t block_size, const unsigned flags, uint8_t *const storage)
 {
-	if(filename == NULL) return NULL; //check that the filename was passed correctly
+	if(num_blocks == 0 || block_size == 0 || num_blocks > SIZE_MAX / block_size
+		|| (flags & ~(unsigned)(BS_THREADSAFE | BS_ALLOC_CACHE | BS_HIERARCHICAL)) //options this version doesn't know about
+		|| block_size % sizeof(uint64_t) //check the geometry is usable, whole words per block keep the bitmap overlay word aligned
+		|| ((flags & BS_HIERARCHICAL) && (flags & (BS_THREADSAFE | BS_ALLOC_CACHE)))){ //hierarchical summaries aren't atomic
+		errno = EINVAL;
+		return NULL;
+	}
 
-	block_store_t *bs = block_store_create(); //create a block store
-	if(bs == NULL){ //check that the block store was created correctly
+	const size_t bitmap_bytes = (num_blocks + 7) / 8; //one bit per block
+	const size_t bitmap_blocks = (bitmap_bytes + block_size - 1) / block_size;
+	if(bitmap_blocks >= num_blocks){ //the bitmap has to leave at least one block for data
+		errno = EINVAL;
 		return NULL;
 	}
 
-	int fd = open(filename, O_RDONLY); //open the file in readonly mode
+	block_store_t *bs = (block_store_t *)calloc(1, sizeof(block_store_t)); //allocating memory for the block
+	if(bs == NULL) return NULL; //checking we allocated correctly
+
+	bs->num_blocks = num_blocks;
+	bs->block_size = block_size;
+	bs->bitmap_blocks = bitmap_blocks;
+	bs->bitmap_start = (BITMAP_START_BLOCK + bitmap_blocks <= num_blocks) ? BITMAP_START_BLOCK : 0;
+	bs->flags = (BLOCK_STORE_FLAGS)flags;
 
-	
-	if(fd == -1){ //check that the file was opened correctly, if not destroy the block store
-	perror("error opening file");
-		block_store_destroy(bs);
+	bs->blocks = storage ? storage : (uint8_t *)calloc(num_blocks, block_size); //all new blocks start out zeroed
+	if(bs->blocks == NULL){
+		free(bs);
 		return NULL;
 	}
 
-	for(size_t i = 0; i < BLOCK_STORE_NUM_BLOCKS; i++){ //Read one block of data from the file into block i.
-		ssize_t bytes_read = read(fd, bs->blocks[i], BLOCK_SIZE_BYTES); //read from the file and store in the block at index i
-		
-		if(bytes_read != BLOCK_SIZE_BYTES){ //check that we read enough values, if not close the file and destroy the block
-			close(fd);
-		
-			block_store_destroy(bs);
-			return NULL;
+	if(bs->flags & BS_HIERARCHICAL){ //same bitmaps, with summary levels so searches skip straight to what they want
+		bs->bitmap = bitmap_overlay_hierarchical(num_blocks, block_store_block(bs, bs->bitmap_start));
+		bs->full_words = bitmap_create_hierarchical(SUMMARY_SIZE_BITS(bs));
+	}else{
+		bs->bitmap = bitmap_overlay(num_blocks, block_store_block(bs, bs->bitmap_start)); //the bitmap lives in its reserved blocks
+		bs->full_words = bitmap_create(SUMMARY_SIZE_BITS(bs)); //one bit per bitmap word, so allocation can skip full words
+	}
+	bs->dirty = bitmap_create(num_blocks); //nothing has been saved yet, but without an image_path nothing is incremental either
+	bs->unjournaled = bitmap_create(num_blocks);
+#ifdef BLOCK_STORE_STATS
+	bs->stats = (block_store_stats_shard_t *)aligned_alloc(64, STATS_SHARDS * sizeof(block_store_stats_shard_t));
+	if(bs->stats){
+		memset(bs->stats, 0, STATS_SHARDS * sizeof(block_store_stats_shard_t));
+	}
+	const bool stats_ok = bs->stats != NULL;
+#else
+	const bool stats_ok = true;
+#endif
+	if(bs->flags & BS_ALLOC_CACHE){ //caches are shared between threads, so they only make sense thread safe
+		bs->flags |= BS_THREADSAFE;
+		bs->caches = (block_store_cache_t *)calloc(CACHE_SLOTS, sizeof(block_store_cache_t));
+		for(size_t i = 0; bs->caches && i < CACHE_SLOTS; i++){
+			pthread_mutex_init(&bs->caches[i].lock, NULL);
+			bs->caches[i].cursor = i * (num_blocks / CACHE_SLOTS);
 		}
-
-		for(size_t j = 0; j < BLOCK_SIZE_BYTES; j++){ //iterate through the blocks
-			if(bs->blocks[i][j] != 0){ //check if the block contains any non zero byte and set as in use if found
-				bitmap_set(bs->bitmap, i);
-				break;
-			}
+	}
+	if(THREADSAFE(bs)){ //block data gets striped reader/writer locks
+		bs->stripes = (pthread_rwlock_t *)malloc(LOCK_STRIPES * sizeof(pthread_rwlock_t));
+		for(size_t i = 0; bs->stripes && i < LOCK_STRIPES; i++){
+			pthread_rwlock_init(&bs->stripes[i], NULL);
+		}
+	}
+	if(bs->bitmap == NULL || bs->full_words == NULL || bs->dirty == NULL || bs->unjournaled == NULL || !stats_ok || (THREADSAFE(bs) && bs->stripes == NULL)
+		|| ((bs->flags & BS_ALLOC_CACHE) && bs->caches == NULL)){ //checking that the bitmaps were created correctly, if not, deallocate all allocated memory
+		if(storage){ //the caller's storage is not ours to free
+			bs->blocks = NULL;
 		}
+		block_store_destroy(bs);
+		return NULL;
 	}
 
-	for(size_t i = 0; i < BLOCK_SIZE_BYTES; i++){ //iterate through the blocks
-		bitmap_set(bs->bitmap, BITMAP_START_BLOCK + i); //mark bitmap storage as in use
+	if(storage){ //existing image, pick up the allocations saved in it
+		block_store_load_bitmap(bs);
+		return bs;
 	}
 
-	close(fd);
-	
+	for(size_t i = 0; i < bs->bitmap_blocks; i++){ //itteratting through the blocks in the bitmap
+		bitmap_set(bs->bitmap, bs->bitmap_start + i); //setting the bitmap
+	}
+	bs->used = bs->bitmap_blocks;
+	block_store_rebuild_summary(bs);
+
 	return bs;
 }
 
-
 /*
-*This function serializes a block store to a file. It returns the size of the resulting file in bytes.
-* Note: If a test case expects a specific number of bytes to be written but your file is smaller, pad
-* the rest of the file with zeros until the file is of the expected size. Modify your block_store_deserialize
-* function accordingly to accept padding if present.
+	Brings the allocation state in line with freshly loaded block contents. The bitmap blocks were loaded along with
+	everything else, so normally there's nothing to do but rebuild the summary and take the one full count of the
+	bitmap the used counter starts from.
+	Images saved before the bitmap was kept in its blocks have those blocks zeroed, which shows up as the bitmap
+	not marking its own blocks as used; for those, fall back to treating every non-zero block as allocated.
 */
-size_t block_store_serialize(const block_store_t *const bs, const char *const filename)
-
+static void block_store_load_bitmap(block_store_t *const bs)
 {
-	//go through blocks one by one
-	if(bs == NULL || bs->blocks == NULL || bs->bitmap == NULL|| filename == NULL){ //check that parameters were passed correctly
-		return 0;
+	bitmap_refresh(bs->bitmap); //the blocks were read in behind a hierarchical bitmap's back
+	bool saved = true;
+	for(size_t i = 0; i < bs->bitmap_blocks; i++){
+		saved = saved && bitmap_test(bs->bitmap, bs->bitmap_start + i);
 	}
 
-	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644); //open the file in write only: https://stackoverflow.com/questions/28466715/using-open-to-create-a-file-in-c
-	
-	if(fd == -1){ //check that file was opened correctly
-			perror("error opening file");
-
-		return 0;
+	if(!saved){
+		bitmap_format(bs->bitmap, 0);
+		block_store_mark_nonzero_blocks(bs);
+		for(size_t i = 0; i < bs->bitmap_blocks; i++){ //mark bitmap storage as in use
+			bitmap_set(bs->bitmap, bs->bitmap_start + i);
+		}
 	}
+	bs->used = bitmap_total_set(bs->bitmap);
+	block_store_rebuild_summary(bs);
+}
 
-	for(size_t i = 0; i < BLOCK_STORE_NUM_BLOCKS; i++){ //write one block of data into the file
-		ssize_t bytes_written = write(fd, bs->blocks[i], BLOCK_SIZE_BYTES);
+// Frees what's left of a store once nothing reads its blocks any more: the stripe locks, the blocks and the store itself
+static void block_store_free_storage(block_store_t *const bs)
+{
+	if(bs->stripes){
+		for(size_t i = 0; i < LOCK_STRIPES; i++){
+			pthread_rwlock_destroy(&bs->stripes[i]);
+		}
+		free(bs->stripes);
+	}
+	if(bs->mapping){ //mapped stores unmap the file instead of freeing the blocks
+		munmap(bs->mapping, bs->mapping_bytes);
+	}else{
+		free(bs->blocks);
+	}
+	free(bs);
+}
 
-	
-		
-		if(bytes_written != BLOCK_SIZE_BYTES){ //check that the amount written matches what we expect, if not close the file
-			close(fd);
-			
-			return 0;
+/*
+	This function destroys a block store by freeing the memory allocated to it. 
+	It first checks if the pointer to the block store is not NULL, and if so, 
+	it frees the memory allocated to the bitmap and then to the block store.
+	A store with snapshots keeps its blocks and stripes until the last snapshot is destroyed; a snapshot leaves
+	them alone, they belong to its origin.
+*/
+void block_store_destroy(block_store_t *const bs)
+{
+	if(bs){ //if the block exists, destroy its bitmap and deallocate its memory
+		block_store_async_stop(bs); //queued requests still use everything below
+		bitmap_destroy(bs->bitmap);
+		bitmap_destroy(bs->full_words);
+		bitmap_destroy(bs->dirty);
+		bitmap_destroy(bs->unjournaled);
+		free(bs->image_path);
+#ifdef BLOCK_STORE_STATS
+		free(bs->stats);
+#endif
+		if(bs->caches){
+			for(size_t i = 0; i < CACHE_SLOTS; i++){
+				pthread_mutex_destroy(&bs->caches[i].lock);
+			}
+			free(bs->caches);
 		}
+		if(bs->journal){ //uncommitted records go with it
+			close(bs->journal->fd);
+			pthread_mutex_destroy(&bs->journal->lock);
+			free(bs->journal->buffer);
+			free(bs->journal);
+		}
+		if(SNAPSHOT(bs)){
+			block_store_snapshot_detach(bs);
+			free(bs);
+			return;
+		}
+		block_store_lock_range(bs, 0, bs->num_blocks, true); //snapshots unlink themselves under every stripe
+		const bool shared = bs->snapshots != NULL;
+		bs->destroyed = shared;
+		block_store_unlock_range(bs, 0, bs->num_blocks);
+		if(!shared){ //otherwise the last snapshot frees it (and may already have)
+			block_store_free_storage(bs);
+		}
+	}
+}
+// The cache slot the calling thread uses, picked round robin the first time it asks
+static size_t block_store_cache_slot(void)
+{
+	static size_t next_slot = 0;
+	static _Thread_local size_t slot = SIZE_MAX;
+	if(slot == SIZE_MAX){
+		slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED) % CACHE_SLOTS;
 	}
+	return slot;
+}
 
-	close(fd); //close the file
+#ifdef BLOCK_STORE_STATS
+// Histogram bucket for a value: floor(log2(value)), 0 for 0 and 1, everything past the last bucket in the last one
+static inline size_t block_store_stats_bucket(const uint64_t value)
+{
+	const size_t bucket = value ? 63 - (size_t)__builtin_clzll(value) : 0;
+	return bucket < BLOCK_STORE_STATS_BUCKETS ? bucket : BLOCK_STORE_STATS_BUCKETS - 1;
+}
+
+// The calling thread's shard of bs's counters
+static inline block_store_stats_t *block_store_stats_shard(const block_store_t *const bs)
+{
+	return &bs->stats[block_store_cache_slot() % STATS_SHARDS].counts;
+}
+
+static inline void block_store_stats_add(uint64_t *const counter, const uint64_t amount)
+{
+	__atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
+}
+
+// Starts timing a call, clearing errno so STATS_END can tell whether the call set it
+static inline uint64_t block_store_stats_begin(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	errno = 0;
+	return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static void block_store_stats_end(const block_store_t *const bs, const BLOCK_STORE_OP op, const uint64_t start, const bool failed, const int saved_errno)
+{
+	const int error = errno;
+	if(bs){
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		const uint64_t elapsed = (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec - start;
+		block_store_stats_t *const counts = block_store_stats_shard(bs);
+		block_store_stats_add(&counts->calls[op], 1);
+		block_store_stats_add(&counts->nanoseconds[op], elapsed);
+		block_store_stats_add(&counts->latency[op][block_store_stats_bucket(elapsed)], 1);
+		if(failed){
+			block_store_stats_add(&counts->failures[op], 1);
+			if(error == ENOSPC){
+				block_store_stats_add(&counts->enospc, 1);
+			}else if(error == EINVAL){
+				block_store_stats_add(&counts->einval, 1);
+			}
+		}
+	}
+	errno = error ? error : saved_errno; //successful calls don't get to clear errno
+}
+
+// Records how many blocks an allocation search went through to find its block (or give up)
+static void block_store_stats_scan(const block_store_t *const bs, const size_t blocks)
+{
+	block_store_stats_t *const counts = block_store_stats_shard(bs);
+	block_store_stats_add(&counts->scan_blocks, blocks);
+	block_store_stats_add(&counts->scans[block_store_stats_bucket(blocks)], 1);
+}
+#endif
+
+// Claims a new batch of free blocks for an empty cache (caller holds its lock). Returns how many it got.
+static size_t block_store_cache_refill(block_store_t *const bs, block_store_cache_t *const cache)
+{
+	block_store_preserve_bits(bs, 0, bs->num_blocks); //the claim picks its bits as it goes, so they could be anywhere
+	size_t claimed = bitmap_claim_zeros(bs->bitmap, cache->cursor, cache->ids, CACHE_MAGAZINE);
+	if(claimed == 0 && cache->cursor != 0){ //nothing left past the cursor, try the rest of the store
+		claimed = bitmap_claim_zeros(bs->bitmap, 0, cache->ids, CACHE_MAGAZINE);
+	}
+	if(claimed){
+		for(size_t i = 0; i < claimed; i++){ //ids come back in order, so one summary update per word is enough
+			if(i + 1 == claimed || cache->ids[i] / 64 != cache->ids[i + 1] / 64){
+				block_store_sync_summary(bs, cache->ids[i]);
+			}
+		}
+		cache->cursor = (cache->ids[claimed - 1] + 1 < bs->num_blocks) ? cache->ids[claimed - 1] + 1 : 0;
+	}
+	block_store_preserve_bits_done(bs, 0, bs->num_blocks);
+	cache->next = 0;
+	cache->count = claimed;
+	return claimed;
+}
+
+// Hands the blocks still in a cache back to the bitmap as free (caller holds its lock)
+static void block_store_cache_empty(block_store_t *const bs, block_store_cache_t *const cache)
+{
+	for(size_t i = cache->next; i < cache->count; i++){
+		block_store_preserve_bits(bs, cache->ids[i], 1);
+		block_store_bit_reset(bs, bs->bitmap, cache->ids[i]);
+		block_store_preserve_bits_done(bs, cache->ids[i], 1);
+		block_store_bit_reset(bs, bs->full_words, cache->ids[i] / 64);
+		block_store_lower_hint(bs, cache->ids[i]);
+	}
+	cache->next = cache->count = 0;
+}
+
+/*
+	This function hands every block sitting in an allocation cache back to the bitmap as free.
+	Allocation does this itself before giving up with ENOSPC, and checkpoint so cached blocks aren't saved as used.
+*/
+void block_store_drain_caches(block_store_t *const bs)
+{
+	if(bs == NULL || bs->caches == NULL){
+		return;
+	}
+	for(size_t slot = 0; slot < CACHE_SLOTS; slot++){
+		block_store_cache_t *const cache = &bs->caches[slot];
+		pthread_mutex_lock(&cache->lock);
+		block_store_cache_empty(bs, cache);
+		pthread_mutex_unlock(&cache->lock);
+	}
+}
+
+/*
+	Locks every allocation cache, in slot order and before any stripe as allocation does, so none hands out a block
+	until block_store_unlock_caches. Images are written in between: the caches' blocks look used in the bitmap, and
+	block_store_image_bitmap leaves them out without the caches themselves having to give them up.
+*/
+static void block_store_lock_caches(const block_store_t *const bs)
+{
+	for(size_t slot = 0; bs->caches && slot < CACHE_SLOTS; slot++){
+		pthread_mutex_lock(&bs->caches[slot].lock);
+	}
+}
+
+static void block_store_unlock_caches(const block_store_t *const bs)
+{
+	for(size_t slot = 0; bs->caches && slot < CACHE_SLOTS; slot++){
+		pthread_mutex_unlock(&bs->caches[slot].lock);
+	}
+}
+
+/*
+	Copies bs's bitmap blocks into buffer as an image saves them: with the blocks sitting in allocation caches shown
+	free (the caller holds the caches, see block_store_lock_caches). Returns false if it couldn't get the memory.
+*/
+static bool block_store_image_bitmap(const block_store_t *const bs, uint8_t *const buffer)
+{
+	block_store_copy_bitmap(bs, buffer);
+	if(bs->caches == NULL){
+		return true;
+	}
+	bitmap_t *const bitmap = bitmap_overlay(bs->num_blocks, buffer);
+	if(bitmap == NULL){
+		return false;
+	}
+	for(size_t slot = 0; slot < CACHE_SLOTS; slot++){
+		const block_store_cache_t *const cache = &bs->caches[slot];
+		for(size_t i = cache->next; i < cache->count; i++){
+			bitmap_reset(bitmap, cache->ids[i]);
+		}
+	}
+	bitmap_destroy(bitmap);
+	return true;
+}
+
+/*
+ This function finds the first free block in the block store and marks it as allocated in the bitmap.
+  It returns the index of the allocated block or SIZE_MAX if no free block is available.
+  The search starts at free_hint (nothing below it is free) and uses the full_words summary to jump straight
+  to the first 64-block word with room in it, so it does not rescan the allocated part of the store every call.
+  The reserved bitmap blocks are always set in the bitmap, so they never need to be skipped by hand.
+  In a thread safe store the bit is claimed with an atomic test-and-set, and losing the race to another thread just
+  means looking again past the block it took. The summary and hint can lag behind other threads there, so before
+  reporting ENOSPC the bitmap itself is searched from the start.
+  With BS_ALLOC_CACHE the block comes out of the calling thread's cache instead, refilled in bulk when it runs dry;
+  only when the store has nothing left for a refill are the other caches drained back and the search above used.
+  Blocks don't come out lowest first in that mode.
+*/
+static size_t block_store_allocate_untimed(block_store_t *const bs)
+{
+	if(bs == NULL || bs->bitmap == NULL || SNAPSHOT(bs)){ //check that parameters were passed in correctly, snapshots are read only
+		errno = EINVAL; //invalid argument
+		return SIZE_MAX; //no free block available
+	}
+
+	if(bs->caches){
+		block_store_cache_t *const cache = &bs->caches[block_store_cache_slot()];
+		pthread_mutex_lock(&cache->lock);
+		if(cache->next < cache->count || block_store_cache_refill(bs, cache)){
+			const size_t id = cache->ids[cache->next++];
+			block_store_add_used(bs, 1); //before a snapshot (which locks the caches) can see the block isn't cached any more
+			pthread_mutex_unlock(&cache->lock);
+			block_store_journal_note(bs, JOURNAL_ALLOC, id, 1, NULL); //only handed out blocks are journaled, not cached ones
+			return id;
+		}
+		pthread_mutex_unlock(&cache->lock);
+		block_store_drain_caches(bs); //other threads' caches may be holding the last free blocks
+	}
+
+	const size_t seen = __atomic_load_n(&bs->free_hint, __ATOMIC_RELAXED);
+	size_t hint = seen;
+	for(;;){
+		const size_t word = bitmap_ffz_from(bs->full_words, hint / 64); //first word that still has a free block
+		if(word == SIZE_MAX){
+			break;
+		}
+
+		//nothing below the hint is free, so if the hint is inside this word start from there
+		const size_t start = (word * 64 > hint) ? word * 64 : hint;
+		const size_t id = bitmap_ffz_from(bs->bitmap, start);
+		if(id == SIZE_MAX){
+			break;
+		}
+		block_store_preserve_bits(bs, id, 1);
+		if(!block_store_bit_set(bs, bs->bitmap, id)){ //mark it as used, if nobody beat us to it
+			block_store_sync_summary(bs, id);
+			block_store_add_used(bs, 1);
+			block_store_preserve_bits_done(bs, id, 1);
+			block_store_journal_note(bs, JOURNAL_ALLOC, id, 1, NULL);
+			STATS_SCAN(bs, id - seen);
+			block_store_raise_hint(bs, seen, id + 1);
+			return id; //return newly allocated index
+		}
+		block_store_preserve_bits_done(bs, id, 1);
+		hint = id + 1;
+	}
+
+	if(THREADSAFE(bs)){ //the summary may have been stale, so make sure with the bitmap itself
+		for(size_t id = bitmap_ffz_from(bs->bitmap, 0); id != SIZE_MAX; id = bitmap_ffz_from(bs->bitmap, id + 1)){
+			block_store_preserve_bits(bs, id, 1);
+			if(!block_store_bit_set(bs, bs->bitmap, id)){
+				block_store_sync_summary(bs, id);
+				block_store_add_used(bs, 1);
+				block_store_preserve_bits_done(bs, id, 1);
+				block_store_journal_note(bs, JOURNAL_ALLOC, id, 1, NULL);
+				STATS_SCAN(bs, bs->num_blocks - seen + id); //the whole way past the hint, then from the start again
+				return id;
+			}
+			block_store_preserve_bits_done(bs, id, 1);
+		}
+	}
+
+	STATS_SCAN(bs, bs->num_blocks - seen);
+	errno = ENOSPC; //no space to allocate to
+	return SIZE_MAX;
+}
+
+// block_store_allocate_untimed, counted and timed when stats are built in
+size_t block_store_allocate(block_store_t *const bs)
+{
+	STATS_BEGIN();
+	const size_t block_id = block_store_allocate_untimed(bs);
+	STATS_END(bs, BS_OP_ALLOCATE, block_id == SIZE_MAX);
+	return block_id;
+}
+
+/*
+	This function marks a specific block as allocated in the bitmap. 
+	It first checks if the pointer to the block store is not NULL and if the block_id is within the range of valid block indices. 
+	If the block is already marked as allocated, it returns false. 
+	Otherwise, it marks the block as allocated and checks that the block was indeed marked as allocated by testing the bitmap. 
+	It returns true if the block was successfully marked as allocated, false otherwise.
+*/
+static bool block_store_request_untimed(block_store_t *const bs, const size_t block_id)
+{
+	if(bs == NULL || bs->bitmap == NULL || block_id >= bs->num_blocks || block_store_is_reserved(bs, block_id) || SNAPSHOT(bs)){ //Check that parameters were passed correctly, the bitmap blocks can't be requested
+		errno = EINVAL;
+		return false;
+	}
+
+	block_store_preserve_bits(bs, block_id, 1);
+	if(block_store_bit_set(bs, bs->bitmap, block_id)){ //set it to used, unless it already was, then return false
+		block_store_preserve_bits_done(bs, block_id, 1);
+		return false;
+	}
+
+	block_store_sync_summary(bs, block_id);
+	block_store_add_used(bs, 1);
+	block_store_preserve_bits_done(bs, block_id, 1);
+	block_store_journal_note(bs, JOURNAL_ALLOC, block_id, 1, NULL);
+	return true;
+
+}
+
+// block_store_request_untimed, counted and timed when stats are built in
+bool block_store_request(block_store_t *const bs, const size_t block_id)
+{
+	STATS_BEGIN();
+	const bool requested = block_store_request_untimed(bs, block_id);
+	STATS_END(bs, BS_OP_REQUEST, !requested);
+	return requested;
+}
+
+/*
+	This function finds the first run of count free blocks, marks them all as allocated and hands back the first id.
+	Like block_store_allocate it starts at free_hint, and the run search itself hops between zero runs a word at a time.
+	The bitmap blocks are always set, so a run can never straddle them.
+	In a thread safe store the blocks are claimed one at a time; if another thread gets one first, the part already
+	claimed is given back and the search carries on past it (and falls back to the start, like block_store_allocate).
+	Blocks parked in allocation caches look used, so like block_store_allocate the caches are drained and the store
+	searched once more before giving up.
+*/
+static bool block_store_allocate_extent_untimed(block_store_t *const bs, const size_t count, size_t *const start)
+{
+	if(bs == NULL || bs->bitmap == NULL || start == NULL || count == 0 || SNAPSHOT(bs)){ //check that parameters were passed in correctly
+		errno = EINVAL; //invalid argument
+		return false;
+	}
+
+	size_t from = __atomic_load_n(&bs->free_hint, __ATOMIC_RELAXED);
+	bool wrapped = !THREADSAFE(bs) || from == 0; //only thread safe stores need the second look from the start
+	bool drained = bs->caches == NULL;
+	for(;;){
+		const size_t first = bitmap_ffz_run(bs->bitmap, from, count);
+		if(first == SIZE_MAX){
+			if(wrapped && !drained){ //the run may be sitting in other threads' caches
+				block_store_drain_caches(bs);
+				drained = true;
+				from = 0;
+				continue;
+			}
+			if(wrapped){
+				break;
+			}
+			wrapped = true; //nothing past the hint, give the whole store one more look
+			from = 0;
+			continue;
+		}
+
+		size_t claimed = 0;
+		block_store_preserve_bits(bs, first, count);
+		if(!THREADSAFE(bs)){ //nobody else can be at the run, mark it used in one go
+			bitmap_set_range(bs->bitmap, first, count);
+			claimed = count;
+		}
+		while(claimed < count && !block_store_bit_set(bs, bs->bitmap, first + claimed)){ //mark the whole run as used
+			claimed++;
+		}
+		if(claimed == count){
+			for(size_t word = first / 64; word <= (first + count - 1) / 64; word++){ //and bring the summary up to date
+				block_store_sync_summary(bs, word * 64);
+			}
+			block_store_add_used(bs, count);
+			block_store_preserve_bits_done(bs, first, count);
+			block_store_journal_note(bs, JOURNAL_ALLOC, first, count, NULL);
+			block_store_raise_hint(bs, first, first + count); //if the run started at the hint, everything up to its end is now used
+			*start = first;
+			return true;
+		}
+
+		for(size_t i = 0; i < claimed; i++){ //lost part of the run to another thread, hand back what we got
+			block_store_bit_reset(bs, bs->bitmap, first + i);
+		}
+		block_store_preserve_bits_done(bs, first, count);
+		from = first + claimed + 1;
+	}
+
+	errno = ENOSPC; //no run long enough
+	return false;
+}
+
+// block_store_allocate_extent_untimed, counted and timed when stats are built in
+bool block_store_allocate_extent(block_store_t *const bs, const size_t count, size_t *const start)
+{
+	STATS_BEGIN();
+	const bool allocated = block_store_allocate_extent_untimed(bs, count, start);
+	STATS_END(bs, BS_OP_ALLOCATE_EXTENT, !allocated);
+	return allocated;
+}
+
+/*This function marks a specific block as free in the bitmap. It first checks if the pointer to the block store is
+ not NULL and if the block_id is within the range of valid block indices. Then, it resets the bit corresponding to 
+ the block in the bitmap.
+ */
+static bool block_store_release_untimed(block_store_t *const bs, const size_t block_id)
+{
+			if(bs == NULL || bs->bitmap == NULL || block_id >= bs->num_blocks || block_store_is_reserved(bs, block_id) || SNAPSHOT(bs)){ //check for valid parameters, the bitmap blocks can't be released
+				errno = EINVAL;
+				return false;
+			}
+
+			//find the bit, reset it 
+			// int bitmapIndex = block_id / (BLOCK_SIZE_BYTES * 8 -1);
+			//uint8_t * bitmap = bs->bitmap[bitmapIndex];
+			//journaled before the bit is cleared (under the journal lock), so the record can't come after
+			//the record of another thread allocating the block again, or miss a checkpoint
+			block_store_preserve_bits(bs, block_id, 1);
+			block_store_journal_begin(bs);
+			block_store_journal_record(bs, JOURNAL_RELEASE, block_id, 1, NULL);
+			if(block_store_bit_reset(bs, bs->bitmap, block_id)){ //releasing a free block doesn't change the count
+				block_store_sub_used(bs, 1);
+			}
+			block_store_journal_end(bs);
+			block_store_preserve_bits_done(bs, block_id, 1);
+			block_store_bit_reset(bs, bs->full_words, block_id / 64); //this word has room again
+			block_store_lower_hint(bs, block_id); //keep the hint at or below the lowest free block
+			return true;
+}
+
+// block_store_release_untimed, counted and timed when stats are built in
+void block_store_release(block_store_t *const bs, const size_t block_id)
+{
+	STATS_BEGIN();
+	const bool released = block_store_release_untimed(bs, block_id);
+	STATS_END(bs, BS_OP_RELEASE, !released);
+}
+
+/*
+	This function marks count blocks starting at start as free, with the same checks as block_store_release
+	applied to the whole range up front.
+*/
+static bool block_store_release_extent_untimed(block_store_t *const bs, const size_t start, const size_t count)
+{
+	if(bs == NULL || bs->bitmap == NULL || count == 0 || start >= bs->num_blocks || count > bs->num_blocks - start || SNAPSHOT(bs)
+		|| (start < bs->bitmap_start + bs->bitmap_blocks && bs->bitmap_start < start + count)){ //check for valid parameters, the range may not touch the bitmap blocks
+		errno = EINVAL;
+		return false;
+	}
+
+	size_t freed = 0;
+	block_store_preserve_bits(bs, start, count);
+	block_store_journal_begin(bs); //same as block_store_release, the record goes in first
+	block_store_journal_record(bs, JOURNAL_RELEASE, start, count, NULL);
+	if(THREADSAFE(bs)){ //bit by bit, so each one is counted by whoever actually cleared it
+		for(size_t i = start; i < start + count; i++){
+			freed += block_store_bit_reset(bs, bs->bitmap, i);
+		}
+	}else{
+		freed = bitmap_count_range(bs->bitmap, start, count);
+		bitmap_reset_range(bs->bitmap, start, count);
+	}
+	block_store_journal_end(bs);
+	block_store_sub_used(bs, freed);
+	block_store_preserve_bits_done(bs, start, count);
+	for(size_t word = start / 64; word <= (start + count - 1) / 64; word++){ //these words have room again
+		block_store_bit_reset(bs, bs->full_words, word);
+	}
+	block_store_lower_hint(bs, start); //keep the hint at or below the lowest free block
+	return true;
+}
+
+// block_store_release_extent_untimed, counted and timed when stats are built in
+void block_store_release_extent(block_store_t *const bs, const size_t start, const size_t count)
+{
+	STATS_BEGIN();
+	const bool released = block_store_release_extent_untimed(bs, start, count);
+	STATS_END(bs, BS_OP_RELEASE_EXTENT, !released);
+}
+
+/*
+	This function takes a copy on write snapshot of bs. The snapshot shares bs's blocks, bitmap blocks included, and
+	stripe locks; all it gets of its own up front is an empty table of saved blocks (whose pages come later, apart
+	from the bitmap blocks') and room for copies of the bitmap blocks, none of it filled in. From then on the first
+	change to each block in bs copies it into that table first (block_store_preserve, or block_store_preserve_bits
+	for allocations), and reads of the snapshot go to the copy if there is one. Nothing is copied, but the table has
+	a pointer for every SAVED_PAGE_BLOCKS blocks, so taking a snapshot is O(n/512) rather than O(1).
+	Caches are emptied first, like checkpoint, so their blocks don't look allocated in the snapshot.
+*/
+block_store_t *block_store_snapshot(block_store_t *const bs)
+{
+	if(bs == NULL || bs->bitmap == NULL || SNAPSHOT(bs)){ //check that parameters were passed correctly, a snapshot never changes so one of it is pointless
+		errno = EINVAL;
+		return NULL;
+	}
+
+	block_store_t *const snapshot = (block_store_t *)calloc(1, sizeof(block_store_t));
+	if(snapshot == NULL){
+		return NULL;
+	}
+	snapshot->blocks = bs->blocks;
+	snapshot->num_blocks = bs->num_blocks;
+	snapshot->block_size = bs->block_size;
+	snapshot->bitmap_start = bs->bitmap_start;
+	snapshot->bitmap_blocks = bs->bitmap_blocks;
+	snapshot->stripes = bs->stripes;
+	snapshot->saved = (uint8_t ***)calloc((bs->num_blocks + SAVED_PAGE_BLOCKS - 1) / SAVED_PAGE_BLOCKS, sizeof(uint8_t **));
+	snapshot->saved_bitmap = (uint8_t *)malloc(bs->bitmap_blocks * bs->block_size); //untouched until the bitmap changes
+	bool saved_ok = snapshot->saved && snapshot->saved_bitmap;
+	for(size_t i = 0; saved_ok && i < bs->bitmap_blocks; i++){ //so copying a bitmap block never needs a page
+		saved_ok = block_store_saved_entry(snapshot, bs->bitmap_start + i, true) != NULL;
+	}
+#ifdef BLOCK_STORE_STATS
+	snapshot->stats = (block_store_stats_shard_t *)aligned_alloc(64, STATS_SHARDS * sizeof(block_store_stats_shard_t));
+	if(snapshot->stats){
+		memset(snapshot->stats, 0, STATS_SHARDS * sizeof(block_store_stats_shard_t));
+	}
+	const bool stats_ok = snapshot->stats != NULL;
+#else
+	const bool stats_ok = true;
+#endif
+	if(!saved_ok || !stats_ok){ //not linked in yet, so not one for block_store_destroy
+		block_store_free_saved(snapshot);
+#ifdef BLOCK_STORE_STATS
+		free(snapshot->stats);
+#endif
+		free(snapshot);
+		return NULL;
+	}
+	block_store_lock_caches(bs); //and emptied, and kept from refilling until the snapshot is in
+	for(size_t slot = 0; bs->caches && slot < CACHE_SLOTS; slot++){
+		block_store_cache_empty(bs, &bs->caches[slot]);
+	}
+	block_store_lock_range(bs, 0, bs->num_blocks, true); //no writer or allocation can be half way through, and nobody is walking the list
+	snapshot->origin = bs;
+	snapshot->next_snapshot = bs->snapshots;
+	snapshot->used = __atomic_load_n(&bs->used, __ATOMIC_RELAXED);
+	__atomic_store_n(&bs->snapshots, snapshot, __ATOMIC_RELEASE);
+	block_store_unlock_range(bs, 0, bs->num_blocks);
+	block_store_unlock_caches(bs);
+	return snapshot;
+}
+
+// Frees a snapshot's table of saved blocks, the copies in it and the room for bitmap copies
+static void block_store_free_saved(block_store_t *const snapshot)
+{
+	const size_t pages = (snapshot->num_blocks + SAVED_PAGE_BLOCKS - 1) / SAVED_PAGE_BLOCKS;
+	for(size_t page = 0; snapshot->saved && page < pages; page++){
+		for(size_t i = 0; snapshot->saved[page] && i < SAVED_PAGE_BLOCKS; i++){
+			if(!block_store_is_reserved(snapshot, page * SAVED_PAGE_BLOCKS + i)){ //those point into saved_bitmap
+				free(snapshot->saved[page][i]);
+			}
+		}
+		free(snapshot->saved[page]);
+	}
+	free(snapshot->saved);
+	free(snapshot->saved_bitmap);
+}
+
+// Takes a snapshot off its origin's list and frees its copies (from block_store_destroy), and the origin too if it's gone and this was the last one
+static void block_store_snapshot_detach(block_store_t *const snapshot)
+{
+	block_store_t *const origin = snapshot->origin;
+	block_store_lock_range(origin, 0, origin->num_blocks, true); //nobody can be copying into it while it goes
+	block_store_t **link = &origin->snapshots;
+	while(*link != snapshot){
+		link = &(*link)->next_snapshot;
+	}
+	__atomic_store_n(link, snapshot->next_snapshot, __ATOMIC_RELEASE);
+	const bool last = origin->destroyed && origin->snapshots == NULL;
+	block_store_unlock_range(origin, 0, origin->num_blocks);
+	if(last){
+		block_store_free_storage(origin);
+	}
+	block_store_free_saved(snapshot);
+}
+
+/*
+	This function runs one batch of compaction, two finger style: the highest allocated block moves into the lowest
+	free block, then the next highest into the next lowest, until max_moves blocks have moved or the fingers meet.
+	The whole batch runs with every stripe locked for writing and the journal lock held, so readers, writers and
+	checkpoints see all of it or none of it. The allocation caches are locked and emptied first and stay locked,
+	since a block sitting in one looks allocated but must not be moved. Each move is journaled as an alloc and a
+	write of the new block and a release of the old one, which replays the same way.
+	In a thread safe store allocations that don't go through a cache can still race the batch, but they only take
+	free blocks, so a target one of them gets first is just skipped. The moved blocks are only marked free once the
+	whole batch is done and journaled, so none of them can be handed out, or released by a caller still holding its
+	old id and freed a second time, while the batch still counts on it.
+*/
+size_t block_store_compact(block_store_t *const bs, block_store_remap_t *const remap, const size_t max_moves)
+{
+	if(bs == NULL || remap == NULL || SNAPSHOT(bs)){ //check that parameters were passed correctly
+		errno = EINVAL;
+		return 0;
+	}
+
+	for(size_t slot = 0; bs->caches && slot < CACHE_SLOTS; slot++){ //same order as allocation: caches, then stripes, then the journal
+		pthread_mutex_lock(&bs->caches[slot].lock);
+		block_store_cache_empty(bs, &bs->caches[slot]);
+	}
+	block_store_lock_range(bs, 0, bs->num_blocks, true);
+	block_store_journal_begin(bs);
+
+	size_t moved = 0;
+	size_t to = __atomic_load_n(&bs->free_hint, __ATOMIC_RELAXED); //nothing below it is free
+	size_t from = bs->num_blocks - 1;
+	while(moved < max_moves){
+		to = bitmap_ffz_from(bs->bitmap, to);
+		from = bitmap_fls_from(bs->bitmap, from);
+		if(from != SIZE_MAX && block_store_is_reserved(bs, from)){ //the bitmap's own blocks stay where they are
+			from = bs->bitmap_start ? bitmap_fls_from(bs->bitmap, bs->bitmap_start - 1) : SIZE_MAX;
+		}
+		if(to == SIZE_MAX || from == SIZE_MAX || from < to){ //everything allocated is below every free block
+			break;
+		}
+		if(!block_store_preserve(bs, to, 1)){ //a snapshot still needs what was in the target, and there's no room to keep it
+			break;
+		}
+		const size_t bits_per_block = bs->block_size * 8; //and the bitmap blocks about to change, every stripe is held already
+		block_store_preserve(bs, bs->bitmap_start + to / bits_per_block, 1);
+		block_store_preserve(bs, bs->bitmap_start + from / bits_per_block, 1);
+		if(block_store_bit_set(bs, bs->bitmap, to)){ //an allocation got there first
+			to++;
+			continue;
+		}
+		block_store_sync_summary(bs, to);
+		memcpy(block_store_block(bs, to), block_store_block(bs, from), bs->block_size);
+		block_store_mark_dirty(bs, to, 1);
+		block_store_journal_record(bs, JOURNAL_ALLOC, to, 1, NULL);
+		block_store_journal_record(bs, JOURNAL_WRITE, to, 1, block_store_block(bs, to));
+		block_store_journal_record(bs, JOURNAL_RELEASE, from, 1, NULL);
+		remap[moved].from = from;
+		remap[moved].to = to;
+		moved++;
+		to++;
+		from--;
+	}
+
+	block_store_journal_end(bs);
+	for(size_t i = 0; i < moved; i++){ //now the sources can go
+		block_store_bit_reset(bs, bs->bitmap, remap[i].from);
+		block_store_bit_reset(bs, bs->full_words, remap[i].from / 64); //the used count doesn't change, and the hint is already below from
+	}
+	block_store_unlock_range(bs, 0, bs->num_blocks);
+	for(size_t slot = 0; bs->caches && slot < CACHE_SLOTS; slot++){
+		pthread_mutex_unlock(&bs->caches[slot].lock);
+	}
+	return moved;
+}
+/*
+*This function returns the number of blocks that are currently allocated in the block store. 
+*It first checks if the pointer to the block store is not NULL and then reads the running count kept by allocate, request and release,
+*so it costs the same on any size of store.
+*/
+size_t block_store_get_used_blocks(const block_store_t *const bs)
+{
+
+	if(bs == NULL || (bs->bitmap == NULL && !SNAPSHOT(bs))) return SIZE_MAX; //check that the parameters were passed correctly
+
+	// size_t used = 0; //count for total used blocks
+	// for(size_t i = 0; i < BLOCK_STORE_NUM_BLOCKS; i++){ //iterate through all blocks
+	// 	if(bitmap_test(bs->bitmap, i)){ //test if the bit is set
+	// 		used++; //increase the total used count
+	// 	}
+	// }
+	return __atomic_load_n(&bs->used, __ATOMIC_RELAXED); //blocks waiting in allocation caches aren't counted
+	// return used; //return the used count
+
+}
+
+/*
+*This function returns the number of blocks that are currently free in the block store. It first checks if the pointer to the block store is not NULL and then calculates the 
+*difference between the total number of blocks and the number of used blocks using the block_store_get_used_blocks and the store's block count.
+*/
+size_t block_store_get_free_blocks(const block_store_t *const bs)
+{
+		if(bs == NULL) return SIZE_MAX; //check correct parameter passing
+	    return bs->num_blocks - block_store_get_used_blocks(bs); //return the total number of blocks minus the amount of used blocks
+}
+
+/*
+	This function reports how the free blocks are split into extents, from the zero runs of the allocation bitmap.
+	The bitmap blocks are always set, so they just split the free space like any other used block.
+	A snapshot has no bitmap of its own to search, so one is put together from its bitmap blocks first.
+*/
+bool block_store_get_fragmentation(const block_store_t *const bs, block_store_fragmentation_t *const fragmentation)
+{
+	if(bs == NULL || fragmentation == NULL){ //check correct parameter passing
+		errno = EINVAL;
+		return false;
+	}
+	uint8_t *const saved = SNAPSHOT(bs) ? (uint8_t *)malloc(bs->bitmap_blocks * bs->block_size) : NULL;
+	bitmap_t *const bitmap = saved ? bitmap_overlay(bs->num_blocks, saved) : bs->bitmap;
+	if(bitmap == NULL){
+		free(saved);
+		errno = ENOMEM;
+		return false;
+	}
+	if(saved){
+		block_store_copy_bitmap(bs, saved);
+	}
+	bitmap_run_stats_t runs;
+	bitmap_zero_runs(bitmap, &runs);
+	if(saved){
+		bitmap_destroy(bitmap);
+		free(saved);
+	}
+	fragmentation->free_blocks = runs.zeros;
+	fragmentation->free_extents = runs.runs;
+	fragmentation->largest_extent = runs.longest;
+	for(size_t i = 0; i < BLOCK_STORE_EXTENT_BUCKETS; i++){
+		fragmentation->extents[i] = runs.histogram[i];
+	}
+	return true;
+}
+
+//This function returns the total number of blocks in a default block store, which is defined by BLOCK_STORE_NUM_BLOCKS.
+size_t block_store_get_total_blocks()
+{
+	return BLOCK_STORE_NUM_BLOCKS; //return the total number of blocks
+}
+
+//This function returns the total number of blocks in the given block store.
+size_t block_store_get_block_count(const block_store_t *const bs)
+{
+	return bs ? bs->num_blocks : 0;
+}
+
+//This function returns the size of one block in the given block store.
+size_t block_store_get_block_size(const block_store_t *const bs)
+{
+	return bs ? bs->block_size : 0;
+}
+
+//This function reads the contents of a block into a buffer. It returns the number of bytes successfully read.
+static size_t block_store_read_untimed(const block_store_t *const bs, const size_t block_id, void *buffer)
+{
+	if(bs == NULL || buffer == NULL || block_id >= bs->num_blocks){ //check that the parameters were passed correctly
+		errno = EINVAL; //Invalid argument
+		return 0;
+	}
+
+	block_store_lock_range(bs, block_id, 1, false);
+	memcpy(buffer, block_store_view(bs, block_id), bs->block_size); //copy the from the block at block_id to the buffer for amount block_size
+	block_store_unlock_range(bs, block_id, 1);
+	return bs->block_size; //return the amount copied
+}
+
+// block_store_read_untimed, counted and timed when stats are built in
+size_t block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer)
+{
+	STATS_BEGIN();
+	const size_t bytes = block_store_read_untimed(bs, block_id, buffer);
+	STATS_END(bs, BS_OP_READ, bytes == 0);
+	return bytes;
+}
+
+//This function writes the contents of a buffer to a block. It returns the number of bytes successfully written.
+static size_t block_store_write_untimed(block_store_t *const bs, const size_t block_id, const void *buffer)
+{
+
+	if(bs == NULL || buffer == NULL || block_id >= bs->num_blocks || block_store_is_reserved(bs, block_id) || SNAPSHOT(bs)){ //check for valid parameters, the bitmap blocks are off limits
+		errno = EINVAL; //Invalid argument
+		return 0;
+	}
+	block_store_lock_range(bs, block_id, 1, true);
+	if(!block_store_preserve(bs, block_id, 1)){ //snapshots get their copy first
+		block_store_unlock_range(bs, block_id, 1);
+		return 0;
+	}
+	block_store_journal_note(bs, JOURNAL_WRITE, block_id, 1, buffer); //under the block's lock, so the journal has writes to it in the same order
+	memcpy(block_store_block(bs, block_id), buffer, bs->block_size); //copy from the buffer to the block at index block_id for amount block_size
+	block_store_mark_dirty(bs, block_id, 1);
+	block_store_unlock_range(bs, block_id, 1);
+
+	return bs->block_size; //return the amount copied
+}
+
+// block_store_write_untimed, counted and timed when stats are built in
+size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer)
+{
+	STATS_BEGIN();
+	const size_t bytes = block_store_write_untimed(bs, block_id, buffer);
+	STATS_END(bs, BS_OP_WRITE, bytes == 0);
+	return bytes;
+}
+//This function returns a pointer into the block storage itself for reading, so no copy is needed.
+const void *block_store_get_block_ptr(const block_store_t *const bs, const size_t block_id)
+{
+	if(bs == NULL || block_id >= bs->num_blocks || SNAPSHOT(bs)){ //check that the parameters were passed correctly, a snapshot's block can move under the pointer
+		errno = EINVAL; //Invalid argument
+		return NULL;
+	}
+	return block_store_block(bs, block_id);
+}
+
+//This function returns a pointer into the block storage itself for writing in place.
+void *block_store_get_block_ptr_mut(block_store_t *const bs, const size_t block_id)
+{
+	if(bs == NULL || block_id >= bs->num_blocks || block_store_is_reserved(bs, block_id) || SNAPSHOT(bs)){ //check that the parameters were passed correctly, the bitmap blocks are off limits
+		errno = EINVAL; //Invalid argument
+		return NULL;
+	}
+	if(bs->snapshots){ //the writes come later, so snapshots get their copy now
+		block_store_lock_range(bs, block_id, 1, true);
+		const bool preserved = block_store_preserve(bs, block_id, 1);
+		block_store_unlock_range(bs, block_id, 1);
+		if(!preserved){
+			return NULL;
+		}
+	}
+	block_store_mark_dirty(bs, block_id, 1); //we can't see the writes, so assume there will be some
+	block_store_bit_set(bs, bs->unjournaled, block_id); //or journal them
+	return block_store_block(bs, block_id);
+}
+
+// Checks a whole vectored batch up front so the copy loops don't have to
+static bool block_store_iovec_valid(const block_store_t *const bs, const block_store_iovec_t *const vec, const size_t count)
+{
+	if(bs == NULL || vec == NULL || count == 0){
+		return false;
+	}
+	for(size_t i = 0; i < count; i++){
+		if(vec[i].buffer == NULL || vec[i].block_id >= bs->num_blocks){
+			return false;
+		}
+	}
+	return true;
+}
+
+// Length of the run of entries starting at vec[0] that are consecutive both in the store and in memory
+static size_t block_store_iovec_run(const block_store_t *const bs, const block_store_iovec_t *const vec, const size_t count)
+{
+	size_t run = 1;
+	while(run < count && vec[run].block_id == vec[0].block_id + run
+		&& (uint8_t *)vec[run].buffer == (uint8_t *)vec[0].buffer + run * bs->block_size){
+		run++;
+	}
+	return run;
+}
+
+//This function reads a batch of blocks, merging adjacent entries into single copies. It returns the number of bytes read.
+static size_t block_store_readv_untimed(const block_store_t *const bs, const block_store_iovec_t *const vec, const size_t count)
+{
+	if(!block_store_iovec_valid(bs, vec, count)){ //check every entry before touching anything
+		errno = EINVAL; //Invalid argument
+		return 0;
+	}
+
+	for(size_t i = 0; i < count;){
+		const size_t run = block_store_iovec_run(bs, vec + i, count - i);
+		block_store_lock_range(bs, vec[i].block_id, run, false);
+		if(bs->saved){ //a snapshot's blocks aren't all in one place, copy them one by one
+			for(size_t j = i; j < i + run; j++){
+				memcpy(vec[j].buffer, block_store_view(bs, vec[j].block_id), bs->block_size);
+			}
+		}else{
+			memcpy(vec[i].buffer, block_store_block(bs, vec[i].block_id), run * bs->block_size);
+		}
+		block_store_unlock_range(bs, vec[i].block_id, run);
+		i += run;
+	}
+	return count * bs->block_size;
+}
+
+// block_store_readv_untimed, counted and timed (as one call) when stats are built in
+size_t block_store_readv(const block_store_t *const bs, const block_store_iovec_t *const vec, const size_t count)
+{
+	STATS_BEGIN();
+	const size_t bytes = block_store_readv_untimed(bs, vec, count);
+	STATS_END(bs, BS_OP_READV, bytes == 0);
+	return bytes;
+}
+
+//This function writes a batch of blocks, merging adjacent entries into single copies. It returns the number of bytes written.
+//If a snapshot's copy can't be made it stops there with ENOMEM, and the entries before that one have been written.
+static size_t block_store_writev_untimed(block_store_t *const bs, const block_store_iovec_t *const vec, const size_t count)
+{
+	if(!block_store_iovec_valid(bs, vec, count) || SNAPSHOT(bs)){ //check every entry before touching anything
+		errno = EINVAL; //Invalid argument
+		return 0;
+	}
+	for(size_t i = 0; i < count; i++){ //the bitmap blocks are off limits for writing
+		if(block_store_is_reserved(bs, vec[i].block_id)){
+			errno = EINVAL;
+			return 0;
+		}
+	}
+
+	for(size_t i = 0; i < count;){
+		const size_t run = block_store_iovec_run(bs, vec + i, count - i);
+		block_store_lock_range(bs, vec[i].block_id, run, true);
+		if(!block_store_preserve(bs, vec[i].block_id, run)){
+			block_store_unlock_range(bs, vec[i].block_id, run);
+			return 0;
+		}
+		for(size_t j = i; bs->journal && j < i + run; j++){
+			block_store_journal_note(bs, JOURNAL_WRITE, vec[j].block_id, 1, vec[j].buffer);
+		}
+		memcpy(block_store_block(bs, vec[i].block_id), vec[i].buffer, run * bs->block_size);
+		block_store_mark_dirty(bs, vec[i].block_id, run);
+		block_store_unlock_range(bs, vec[i].block_id, run);
+		i += run;
+	}
+	return count * bs->block_size;
+}
+
+// block_store_writev_untimed, counted and timed (as one call) when stats are built in
+size_t block_store_writev(block_store_t *const bs, const block_store_iovec_t *const vec, const size_t count)
+{
+	STATS_BEGIN();
+	const size_t bytes = block_store_writev_untimed(bs, vec, count);
+	STATS_END(bs, BS_OP_WRITEV, bytes == 0);
+	return bytes;
+}
+
+// Works out which blocks of a loaded image are in use: any block with a non zero byte is marked as allocated
+static void block_store_mark_nonzero_blocks(block_store_t *const bs)
+{
+	for(size_t i = 0; i < bs->num_blocks; i++){
+		const uint8_t *block = block_store_block(bs, i);
+		for(size_t j = 0; j < bs->block_size; j++){ //iterate through the blocks
+			if(block[j] != 0){ //check if the block contains any non zero byte and set as in use if found
+				bitmap_set(bs->bitmap, i);
+				break;
+			}
+		}
+	}
+}
+
+/*
+	Every serialized image starts with this header, followed by all of the blocks in order.
+	The checksum covers the header only, so a mismatched or damaged image is caught before anything is loaded;
+	the block data isn't checksummed since a mapped store changes it in place.
+*/
+#define BLOCK_STORE_MAGIC "BLKSTORE"
+#define JOURNAL_MAGIC "BLKJOURN" //journals start with the same header, under their own magic
+#define BLOCK_STORE_COMPRESSED_MAGIC "BLKSTCMP" //and so do compressed images, see block_store_write_compressed
+#define BLOCK_STORE_VERSION 1
+
+typedef struct block_store_header 
+{
+	char magic[8]; //BLOCK_STORE_MAGIC (or JOURNAL_MAGIC), no terminator
+	uint32_t version; //BLOCK_STORE_VERSION
+	uint32_t header_bytes; //size of this header, where the blocks start
+	uint64_t num_blocks; //geometry of the store in the image
+	uint64_t block_size;
+	uint64_t reserved[3]; //zero, room to grow (IMAGE_FLAGS; compressed images: COMPRESSED_*)
+	uint64_t checksum; //FNV-1a of everything above
+} block_store_header_t;
+
+_Static_assert(sizeof(block_store_header_t) == BLOCK_STORE_HEADER_BYTES, "image header must stay BLOCK_STORE_HEADER_BYTES long");
+
+// The store flags an image of any kind keeps, so it loads as what it was saved from (threading is up to the loader)
+#define IMAGE_FLAGS(header) ((header)->reserved[1])
+#define IMAGE_KEPT_FLAGS ((uint64_t)BS_HIERARCHICAL)
+
+// What a compressed image was compressed with and how many blocks of the store each of its chunks covers (the low
+// and high halves of one word), and its size
+#define COMPRESSED_CODEC(header) ((header)->reserved[0] & 0xFFFFFFFF)
+#define COMPRESSED_CHUNK_BLOCKS(header) ((header)->reserved[0] >> 32)
+#define COMPRESSED_BYTES(header) ((header)->reserved[2])
+
+// FNV-1a over the header up to (not including) the checksum field
+static uint64_t block_store_header_checksum(const block_store_header_t *const header)
+{
+	const uint8_t *bytes = (const uint8_t *)header;
+	uint64_t hash = BLOCK_STORE_FNV_BASIS;
+	for(size_t i = 0; i < offsetof(block_store_header_t, checksum); i++){
+		hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+// Fills in the header describing the given store, for an image or a journal depending on magic
+static void block_store_fill_header(const block_store_t *const bs, const char *const magic, block_store_header_t *const header)
+{
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, magic, sizeof(header->magic));
+	header->version = BLOCK_STORE_VERSION;
+	header->header_bytes = sizeof(*header);
+	header->num_blocks = bs->num_blocks;
+	header->block_size = bs->block_size;
+	IMAGE_FLAGS(header) = (SNAPSHOT(bs) ? bs->origin : bs)->flags & IMAGE_KEPT_FLAGS;
+	header->checksum = block_store_header_checksum(header);
+}
+
+/*
+	Checks the header read from the start of an image of file_bytes bytes and pulls the geometry out of it.
+	Images from before the header existed are accepted too, if they are exactly one default store long.
+	Compressed images get the same checks, against the file size their header records rather than their geometry.
+	Returns the offset of the first block in the file, SIZE_MAX (with errno set) if the image can't be loaded.
+*/
+static size_t block_store_parse_header(const block_store_header_t *const header, const size_t file_bytes, size_t *const num_blocks, size_t *const block_size)
+{
+	const bool compressed = file_bytes >= sizeof(*header) && memcmp(header->magic, BLOCK_STORE_COMPRESSED_MAGIC, sizeof(header->magic)) == 0;
+	if(compressed || (file_bytes >= sizeof(*header) && memcmp(header->magic, BLOCK_STORE_MAGIC, sizeof(header->magic)) == 0)){
+		if(header->version != BLOCK_STORE_VERSION || header->header_bytes != sizeof(*header) || (IMAGE_FLAGS(header) & ~IMAGE_KEPT_FLAGS)
+			|| header->checksum != block_store_header_checksum(header)){ //from the future, or damaged
+			errno = EINVAL;
+			return SIZE_MAX;
+		}
+		if(header->num_blocks == 0 || header->block_size == 0 || header->num_blocks > SIZE_MAX / header->block_size
+			|| (!compressed && file_bytes - sizeof(*header) != header->num_blocks * header->block_size)
+			|| (compressed && file_bytes != COMPRESSED_BYTES(header))){ //geometry doesn't match the file
+			errno = EINVAL;
+			return SIZE_MAX;
+		}
+		*num_blocks = header->num_blocks;
+		*block_size = header->block_size;
+		return sizeof(*header);
+	}
+
+	if(file_bytes == BLOCK_STORE_NUM_BYTES){ //headerless image of the default geometry
+		*num_blocks = BLOCK_STORE_NUM_BLOCKS;
+		*block_size = BLOCK_SIZE_BYTES;
+		return 0;
+	}
+	errno = EINVAL;
+	return SIZE_MAX;
+}
+
+// pread that keeps going until it has everything, large reads are allowed to come back short
+static bool block_store_pread_all(const int fd, void *const buffer, const size_t bytes, const off_t offset)
+{
+	size_t done = 0;
+	while(done < bytes){
+		const ssize_t got = pread(fd, (uint8_t *)buffer + done, bytes - done, offset + (off_t)done);
+		if(got < 0 && errno == EINTR) continue;
+		if(got <= 0) return false; //error, or the file is shorter than it claimed
+		done += (size_t)got;
+	}
+	return true;
+}
+
+// pwrite that keeps going until everything is written
+static bool block_store_pwrite_all(const int fd, const void *const buffer, const size_t bytes, const off_t offset)
+{
+	size_t done = 0;
+	while(done < bytes){
+		const ssize_t wrote = pwrite(fd, (const uint8_t *)buffer + done, bytes - done, offset + (off_t)done);
+		if(wrote < 0 && errno == EINTR) continue;
+		if(wrote <= 0) return false;
+		done += (size_t)wrote;
+	}
+	return true;
+}
+
+// writev that keeps going until everything is written, picking up partway through an iovec if it has to
+static bool block_store_writev_all(const int fd, struct iovec *iov, int iovcnt)
+{
+	while(iovcnt > 0){
+		ssize_t written = writev(fd, iov, iovcnt);
+		if(written < 0 && errno == EINTR) continue;
+		if(written <= 0) return false;
+		while(iovcnt > 0 && (size_t)written >= iov->iov_len){ //skip whatever went out whole
+			written -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt > 0){ //and trim the one that went out in part
+			iov->iov_base = (uint8_t *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	return true;
+}
+
+/*
+	Writes the image of bs, header and then every block, to fd in a single writev (caller keeps writers out), the
+	bitmap blocks as block_store_image_bitmap has them (caller holds the caches too).
+*/
+static bool block_store_write_image(const block_store_t *const bs, const int fd)
+{
+	block_store_header_t header;
+	block_store_fill_header(bs, BLOCK_STORE_MAGIC, &header);
+	uint8_t *const bitmap = (uint8_t *)malloc(bs->bitmap_blocks * bs->block_size);
+	if(bitmap == NULL || !block_store_image_bitmap(bs, bitmap)){
+		free(bitmap);
+		return false;
+	}
+	const size_t bitmap_end = bs->bitmap_start + bs->bitmap_blocks;
+	struct iovec iov[4] = {
+		{ .iov_base = &header, .iov_len = sizeof(header) },
+		{ .iov_base = bs->blocks, .iov_len = bs->bitmap_start * bs->block_size },
+		{ .iov_base = bitmap, .iov_len = bs->bitmap_blocks * bs->block_size },
+		{ .iov_base = block_store_block(bs, bitmap_end), .iov_len = (bs->num_blocks - bitmap_end) * bs->block_size },
+	};
+	const bool ok = block_store_writev_all(fd, iov, 4);
+	free(bitmap);
+	return ok;
+}
+
+// Most bytes of a snapshot's blocks gathered up before they're written out
+#define SNAPSHOT_CHUNK_BYTES (1 << 20)
+
+/*
+	Writes the image of a snapshot to fd. Its blocks are partly its own copies and partly shared with a store that's
+	still being written, so they are gathered into a buffer a chunk at a time, under that chunk's read locks, and
+	written out after the locks are dropped: writers only ever wait for a memcpy, never for the disk.
+*/
+static bool block_store_write_snapshot(const block_store_t *const bs, const int fd)
+{
+	block_store_header_t header;
+	block_store_fill_header(bs, BLOCK_STORE_MAGIC, &header);
+	const size_t chunk = (bs->block_size < SNAPSHOT_CHUNK_BYTES) ? SNAPSHOT_CHUNK_BYTES / bs->block_size : 1; //blocks per chunk
+	uint8_t *const buffer = (uint8_t *)malloc(chunk * bs->block_size);
+	bool ok = buffer != NULL && block_store_pwrite_all(fd, &header, sizeof(header), 0);
+	for(size_t first = 0; ok && first < bs->num_blocks; first += chunk){
+		const size_t count = (bs->num_blocks - first < chunk) ? bs->num_blocks - first : chunk;
+		block_store_lock_range(bs, first, count, false);
+		for(size_t i = 0; i < count; i++){
+			memcpy(buffer + i * bs->block_size, block_store_view(bs, first + i), bs->block_size);
+		}
+		block_store_unlock_range(bs, first, count);
+		ok = block_store_pwrite_all(fd, buffer, count * bs->block_size, (off_t)(sizeof(header) + first * bs->block_size));
+	}
+	free(buffer);
+	return ok;
+}
+
+/*
+	Compressed images are LZ4, through liblz4, which only builds with BLOCK_STORE_LZ4 link against; other builds
+	can neither write compressed images nor load them, and fail with ENOTSUP.
+*/
+#define IMAGE_CODEC_LZ4 1 //COMPRESSED_CODEC of an image, the only one so far
+
+#ifdef BLOCK_STORE_LZ4
+// Compresses a chunk. Returns the compressed size, 0 if it doesn't fit in capacity (or is too big for liblz4)
+static size_t block_store_compress(const uint8_t *const src, const size_t bytes, uint8_t *const dst, const size_t capacity)
+{
+	if(bytes > LZ4_MAX_INPUT_SIZE){
+		return 0;
+	}
+	const int out = LZ4_compress_default((const char *)src, (char *)dst, (int)bytes, capacity < INT32_MAX ? (int)capacity : INT32_MAX);
+	return out > 0 ? (size_t)out : 0;
+}
+
+// Decompresses a chunk, which must fill dst exactly. False if it's malformed
+static bool block_store_decompress(const uint8_t *const src, const size_t bytes, uint8_t *const dst, const size_t capacity)
+{
+	return bytes <= LZ4_MAX_INPUT_SIZE && capacity <= LZ4_MAX_INPUT_SIZE
+		&& LZ4_decompress_safe((const char *)src, (char *)dst, (int)bytes, (int)capacity) == (int)capacity;
+}
+
+// Blocks of the store each chunk of a compressed image covers, free or not, at least one
+#define COMPRESSED_CHUNK_BYTES (1 << 16)
+#define COMPRESSED_CHUNK_BLOCKS_FOR(bs) (((bs)->block_size < COMPRESSED_CHUNK_BYTES) ? COMPRESSED_CHUNK_BYTES / (bs)->block_size : 1)
+
+// In front of each chunk's data in a compressed image
+typedef struct block_store_chunk_record 
+{
+	uint64_t raw_bytes; //the chunk's allocated blocks, end to end, which is what the data decompresses to
+	uint64_t stored_bytes; //length of the data that follows; raw_bytes means it was stored as is
+	uint64_t checksum; //block_store_checksum of the raw bytes
+} block_store_chunk_record_t;
+
+/*
+	Writes a compressed image of bs to fd: the header (codec, blocks per chunk and image size in its reserved words),
+	the bitmap blocks as they are, then each chunk's record and data, its allocated blocks (bitmap ones aside)
+	compressed if that made them any smaller. The header goes last, once the size is known. A copy of the bitmap
+	decides what goes in, so allocations made meanwhile can't make the chunks disagree with the bitmap written.
+	lock_chunks takes each chunk's read locks while it is gathered, for snapshots; otherwise the caller holds writers
+	off. Returns the size of the image, 0 on error.
+*/
+static size_t block_store_write_compressed(const block_store_t *const bs, const int fd, const bool lock_chunks)
+{
+	const size_t chunk = COMPRESSED_CHUNK_BLOCKS_FOR(bs);
+	const size_t chunk_bytes = chunk * bs->block_size;
+	const size_t bitmap_bytes = bs->bitmap_blocks * bs->block_size;
+	block_store_header_t header;
+	block_store_fill_header(bs, BLOCK_STORE_COMPRESSED_MAGIC, &header);
+	header.reserved[0] = IMAGE_CODEC_LZ4 | (uint64_t)chunk << 32; //COMPRESSED_CODEC and COMPRESSED_CHUNK_BLOCKS
+
+	uint8_t *const saved = (uint8_t *)malloc(bitmap_bytes);
+	uint8_t *const raw = (uint8_t *)malloc(chunk_bytes);
+	uint8_t *const packed = (uint8_t *)malloc(sizeof(block_store_chunk_record_t) + chunk_bytes); //record, then data
+	bitmap_t *const allocated = saved ? bitmap_overlay(bs->num_blocks, saved) : NULL;
+	bool ok = raw && packed && allocated;
+	if(ok){
+		ok = block_store_image_bitmap(bs, saved) && block_store_pwrite_all(fd, saved, bitmap_bytes, (off_t)sizeof(header));
+	}
+
+	size_t offset = sizeof(header) + bitmap_bytes;
+	for(size_t first = 0; ok && first < bs->num_blocks; first += chunk){
+		const size_t end = (bs->num_blocks - first < chunk) ? bs->num_blocks : first + chunk;
+		if(lock_chunks){
+			block_store_lock_range(bs, first, end - first, false);
+		}
+		size_t raw_bytes = 0;
+		for(size_t id = bitmap_ffs_from(allocated, first); id < end; id = bitmap_ffs_from(allocated, id + 1)){
+			if(!block_store_is_reserved(bs, id)){
+				memcpy(raw + raw_bytes, block_store_view(bs, id), bs->block_size);
+				raw_bytes += bs->block_size;
+			}
+		}
+		if(lock_chunks){
+			block_store_unlock_range(bs, first, end - first);
+		}
+
+		block_store_chunk_record_t record = { .raw_bytes = raw_bytes, .stored_bytes = 0, .checksum = block_store_checksum(BLOCK_STORE_FNV_BASIS, raw, raw_bytes) };
+		uint8_t *const data = packed + sizeof(record);
+		record.stored_bytes = raw_bytes ? block_store_compress(raw, raw_bytes, data, raw_bytes - 1) : 0; //only worth it if smaller
+		if(record.stored_bytes == 0){
+			memcpy(data, raw, raw_bytes);
+			record.stored_bytes = raw_bytes;
+		}
+		memcpy(packed, &record, sizeof(record));
+		ok = block_store_pwrite_all(fd, packed, sizeof(record) + record.stored_bytes, (off_t)offset);
+		offset += sizeof(record) + record.stored_bytes;
+	}
+	if(ok){
+		COMPRESSED_BYTES(&header) = offset;
+		header.checksum = block_store_header_checksum(&header);
+		ok = block_store_pwrite_all(fd, &header, sizeof(header), 0);
+	}
+
+	bitmap_destroy(allocated);
+	free(saved);
+	free(raw);
+	free(packed);
+	return ok ? offset : 0;
+}
+
+/*
+	Loads a compressed image into bs, which has the geometry from its header. The bitmap blocks come first and say
+	which blocks each chunk holds; each chunk's record and data are then read, decompressed, checked against the
+	record's checksum and copied out to those blocks, one chunk at a time; the last one must end the file. Chunks
+	can't be bigger than the ones block_store_write_compressed makes, since the header's size for them is trusted
+	for the buffers. Returns false (with errno set) for an image that's damaged or can't be read.
+*/
+static bool block_store_read_compressed(block_store_t *const bs, const int fd, const block_store_header_t *const header)
+{
+	const size_t chunk = COMPRESSED_CHUNK_BLOCKS(header);
+	const size_t bitmap_bytes = bs->bitmap_blocks * bs->block_size;
+	if(COMPRESSED_CODEC(header) != IMAGE_CODEC_LZ4 || chunk == 0 || chunk > COMPRESSED_CHUNK_BLOCKS_FOR(bs)
+		|| !block_store_pread_all(fd, block_store_block(bs, bs->bitmap_start), bitmap_bytes, (off_t)sizeof(*header))){
+		errno = EINVAL;
+		return false;
+	}
+	bitmap_refresh(bs->bitmap); //read in behind its back
+	for(size_t i = 0; i < bs->bitmap_blocks; i++){ //the bitmap always has its own blocks set
+		if(!bitmap_test(bs->bitmap, bs->bitmap_start + i)){
+			errno = EINVAL;
+			return false;
+		}
+	}
+
+	const size_t chunk_bytes = chunk * bs->block_size;
+	uint8_t *const raw = (uint8_t *)malloc(chunk_bytes);
+	uint8_t *const stored = (uint8_t *)malloc(chunk_bytes);
+	bool ok = raw && stored;
+	size_t offset = sizeof(*header) + bitmap_bytes;
+	for(size_t first = 0; ok && first < bs->num_blocks; first += chunk){
+		const size_t end = (bs->num_blocks - first < chunk) ? bs->num_blocks : first + chunk;
+		size_t raw_bytes = 0;
+		for(size_t id = bitmap_ffs_from(bs->bitmap, first); id < end; id = bitmap_ffs_from(bs->bitmap, id + 1)){
+			raw_bytes += block_store_is_reserved(bs, id) ? 0 : bs->block_size;
+		}
+
+		block_store_chunk_record_t record;
+		ok = block_store_pread_all(fd, &record, sizeof(record), (off_t)offset)
+			&& record.raw_bytes == raw_bytes && record.stored_bytes <= raw_bytes; //and it's for the blocks the bitmap says
+		if(ok && record.stored_bytes == raw_bytes){ //stored as is
+			ok = block_store_pread_all(fd, raw, raw_bytes, (off_t)(offset + sizeof(record)));
+		}else if(ok){
+			ok = block_store_pread_all(fd, stored, record.stored_bytes, (off_t)(offset + sizeof(record)))
+				&& block_store_decompress(stored, record.stored_bytes, raw, raw_bytes);
+		}
+		ok = ok && record.checksum == block_store_checksum(BLOCK_STORE_FNV_BASIS, raw, raw_bytes);
+		offset += sizeof(record) + (ok ? record.stored_bytes : 0);
+
+		size_t pos = 0;
+		for(size_t id = bitmap_ffs_from(bs->bitmap, first); ok && id < end; id = bitmap_ffs_from(bs->bitmap, id + 1)){
+			if(!block_store_is_reserved(bs, id)){
+				memcpy(block_store_block(bs, id), raw + pos, bs->block_size);
+				pos += bs->block_size;
+			}
+		}
+	}
+	ok = ok && offset == COMPRESSED_BYTES(header); //nothing may trail the last chunk
+	free(raw);
+	free(stored);
+	if(!ok){
+		errno = (raw && stored) ? EINVAL : ENOMEM;
+	}
+	return ok;
+}
+#else
+// Loading a compressed image needs liblz4 too
+static bool block_store_read_compressed(block_store_t *const bs, const int fd, const block_store_header_t *const header)
+{
+	(void)bs;
+	(void)fd;
+	(void)header;
+	errno = ENOTSUP;
+	return false;
+}
+#endif
+
+/*
+	Opens filename and reads its header, reporting the header itself (zeroed for headerless images), the image's
+	geometry, where its blocks start and the file size.
+	Returns the open file descriptor, -1 on error.
+*/
+static int block_store_open_image(const char *const filename, const int open_flags, block_store_header_t *const header, size_t *const num_blocks, size_t *const block_size, size_t *const data_offset, size_t *const file_bytes)
+{
+	int fd = open(filename, open_flags, 0644);
+	if(fd == -1){ //check that the file was opened correctly
+		return -1;
+	}
+
+	struct stat st;
+	memset(header, 0, sizeof(*header));
+	if(fstat(fd, &st) == -1 || (st.st_size >= (off_t)sizeof(*header) && !block_store_pread_all(fd, header, sizeof(*header), 0))){
+		close(fd);
+		return -1;
+	}
+
+	*file_bytes = (size_t)st.st_size;
+	*data_offset = block_store_parse_header(header, *file_bytes, num_blocks, block_size);
+	if(*data_offset == SIZE_MAX){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+	This function opens an image file written by block_store_serialize as a block store whose blocks live in the
+	file's pages instead of the heap, so nothing is read up front and block_store_flush is an msync.
+	flags are open(2) flags: O_RDWR maps the file shared so changes land in it, O_RDONLY maps it privately so the
+	store can still be changed but the file never is, and O_CREAT with O_RDWR creates an empty image if needed.
+*/
+block_store_t *block_store_open_mmap(const char *const filename, const int flags)
+{
+	if(filename == NULL || (flags & O_ACCMODE) == O_WRONLY){ //check that parameters were passed correctly
+		errno = EINVAL;
+		return NULL;
+	}
+
+	const bool shared = (flags & O_ACCMODE) == O_RDWR;
+	if(shared && (flags & O_CREAT)){ //make sure there's an image to open, creating an empty default one if not
+		int fd = open(filename, O_RDWR | O_CREAT, 0644);
+		if(fd == -1){
+			return NULL;
+		}
+		struct stat st;
+		bool ok = fstat(fd, &st) == 0;
+		if(ok && st.st_size == 0){ //brand new file: header, then zeroed blocks the bitmap gets set up in on load
+			block_store_t *empty = block_store_create();
+			block_store_header_t header;
+			ok = empty != NULL;
+			if(ok){
+				block_store_fill_header(empty, BLOCK_STORE_MAGIC, &header);
+				block_store_destroy(empty);
+				ok = ftruncate(fd, sizeof(header) + BLOCK_STORE_NUM_BYTES) == 0
+					&& pwrite(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header);
+			}
+		}
+		close(fd);
+		if(!ok){
+			return NULL;
+		}
+	}
+
+	size_t num_blocks, block_size, data_offset, image_bytes;
+	block_store_header_t header;
+	int fd = block_store_open_image(filename, shared ? O_RDWR : O_RDONLY, &header, &num_blocks, &block_size, &data_offset, &image_bytes);
+	if(fd == -1){
+		return NULL;
+	}
+	if(memcmp(header.magic, BLOCK_STORE_COMPRESSED_MAGIC, sizeof(header.magic)) == 0){ //the blocks aren't in the file as they are
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	void *mapping = mmap(NULL, image_bytes, PROT_READ | PROT_WRITE, shared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+	close(fd); //the mapping keeps its own reference to the file
+	if(mapping == MAP_FAILED){
+		return NULL;
+	}
+
+	block_store_t *bs = block_store_init(num_blocks, block_size, (unsigned)IMAGE_FLAGS(&header), (uint8_t *)mapping + data_offset);
+	if(bs == NULL){
+		munmap(mapping, image_bytes);
+		return NULL;
+	}
+	bs->mapping = mapping;
+	bs->mapping_bytes = image_bytes;
+	bs->mapping_shared = shared;
+	return bs;
+}
+
+//This function writes the blocks of a shared mapped store back to its image file and waits for it to finish.
+bool block_store_flush(block_store_t *const bs)
+{
+	if(bs == NULL || bs->mapping == NULL){ //only mapped stores have a file behind them
+		errno = EINVAL;
+		return false;
+	}
+	if(!bs->mapping_shared){ //private mappings never reach the file, nothing to do
+		return true;
+	}
+	return msync(bs->mapping, bs->mapping_bytes, MS_SYNC) == 0;
+}
+
+/*
+	This function deserializes a block store from a file. It returns a pointer to the resulting block_store_t struct.
+	The header is checked first and gives the geometry, then all of the blocks come in with one big read
+	(bitmap blocks included, so the allocation state comes with them), or chunk by chunk for a compressed image.
+*/
+static block_store_t *block_store_deserialize_untimed(const char *const filename)
+{
+	if(filename == NULL) return NULL; //check that the filename was passed correctly
+
+	size_t num_blocks, block_size, data_offset, file_bytes;
+	block_store_header_t header;
+	int fd = block_store_open_image(filename, O_RDONLY, &header, &num_blocks, &block_size, &data_offset, &file_bytes); //open the file in readonly mode
+	if(fd == -1){ //check that the file was opened and looks like an image
+		return NULL;
+	}
+
+	block_store_t *bs = block_store_create_flags(num_blocks, block_size, (unsigned)IMAGE_FLAGS(&header)); //create a block store to match, hierarchical if it was
+	if(bs == NULL){ //check that the block store was created correctly
+		close(fd);
+		return NULL;
+	}
+
+	const bool loaded = (memcmp(header.magic, BLOCK_STORE_COMPRESSED_MAGIC, sizeof(header.magic)) == 0)
+		? block_store_read_compressed(bs, fd, &header) //a chunk at a time
+		: block_store_pread_all(fd, bs->blocks, num_blocks * block_size, (off_t)data_offset); //read every block in one go
+	if(!loaded){
+		close(fd);
+		block_store_destroy(bs);
+		return NULL;
+	}
+	close(fd);
+
+	block_store_load_bitmap(bs); //the bitmap blocks came in with the rest, no need to scan the data
+	bs->image_path = strdup(filename); //nothing is dirty relative to this file yet (if this fails, the next checkpoint is just a full one)
+	return bs;
+}
+
+// block_store_deserialize_untimed, counted and timed when stats are built in
+block_store_t *block_store_deserialize(const char *const filename)
+{
+	STATS_BEGIN();
+	block_store_t *const bs = block_store_deserialize_untimed(filename);
+	STATS_END(bs, BS_OP_DESERIALIZE, false); //only a store that loaded has anywhere to record it
+	return bs;
+}
+
+
+/*
+*This function serializes a block store to a file. It returns the size of the resulting file in bytes.
+* The header and every block go out in a single writev.
+*/
+static size_t block_store_serialize_untimed(const block_store_t *const bs, const char *const filename)
+
+{
+	if(bs == NULL || (bs->bitmap == NULL && !SNAPSHOT(bs)) || filename == NULL){ //check that parameters were passed correctly, a snapshot's bitmap is in its blocks
+		return 0;
+	}
+
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644); //open the file in write only: https://stackoverflow.com/questions/28466715/using-open-to-create-a-file-in-c
+	
+	if(fd == -1){ //check that file was opened correctly
+			perror("error opening file");
+
+		return 0;
+	}
+
+	bool written;
+	if(SNAPSHOT(bs)){ //already consistent, writers don't need holding off
+		written = block_store_write_snapshot(bs, fd);
+	}else{
+		block_store_lock_caches(bs); //cached blocks are free, so they're saved as free without leaving the caches
+		block_store_lock_range(bs, 0, bs->num_blocks, false); //hold off writers so the image is consistent
+		written = block_store_write_image(bs, fd);
+		block_store_unlock_range(bs, 0, bs->num_blocks);
+		block_store_unlock_caches(bs);
+	}
+	if(!written){ //check that everything was written, if not close the file
+		close(fd);
+		return 0;
+	}
+
+	close(fd); //close the file
 	
-	return BLOCK_STORE_NUM_BLOCKS * BLOCK_SIZE_BYTES; //size of file written in bytes
+	return sizeof(block_store_header_t) + bs->num_blocks * bs->block_size; //size of file written in bytes
+
+}
+
+// block_store_serialize_untimed, counted and timed when stats are built in
+size_t block_store_serialize(const block_store_t *const bs, const char *const filename)
+{
+	STATS_BEGIN();
+	const size_t bytes = block_store_serialize_untimed(bs, filename);
+	STATS_END(bs, BS_OP_SERIALIZE, bytes == 0);
+	return bytes;
+}
+
+/*
+	This function serializes a block store to a compressed image (see block_store_write_compressed), returning the
+	size of the file written in bytes. Like block_store_serialize, writers are held off for the duration unless bs is
+	a snapshot, which can be written a chunk at a time. Without BLOCK_STORE_LZ4 there's no codec to write one with.
+*/
+static size_t block_store_serialize_compressed_untimed(const block_store_t *const bs, const char *const filename)
+{
+	if(bs == NULL || (bs->bitmap == NULL && !SNAPSHOT(bs)) || filename == NULL){ //check that parameters were passed correctly
+		errno = EINVAL;
+		return 0;
+	}
+#ifdef BLOCK_STORE_LZ4
+	const int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd == -1){
+		return 0;
+	}
+
+	size_t bytes;
+	if(SNAPSHOT(bs)){
+		bytes = block_store_write_compressed(bs, fd, true);
+	}else{
+		block_store_lock_caches(bs); //as serialize, cached blocks are saved as free
+		block_store_lock_range(bs, 0, bs->num_blocks, false); //hold off writers so the image is consistent
+		bytes = block_store_write_compressed(bs, fd, false);
+		block_store_unlock_range(bs, 0, bs->num_blocks);
+		block_store_unlock_caches(bs);
+	}
+	if(close(fd) != 0){
+		bytes = 0;
+	}
+	return bytes;
+#else
+	errno = ENOTSUP;
+	return 0;
+#endif
+}
+
+// block_store_serialize_compressed_untimed, counted and timed (as a serialize) when stats are built in
+size_t block_store_serialize_compressed(const block_store_t *const bs, const char *const filename)
+{
+	STATS_BEGIN();
+	const size_t bytes = block_store_serialize_compressed_untimed(bs, filename);
+	STATS_END(bs, BS_OP_SERIALIZE, bytes == 0);
+	return bytes;
+}
+
+/*
+	Replays the committed records of a journal file of file_bytes bytes onto bs (which isn't journaling yet, so
+	nothing gets journaled again). The first pass finds where the last intact commit record ends, stopping at
+	anything that doesn't check out; the second applies everything before that through the normal calls.
+	Returns the offset the journal's good part ends at, SIZE_MAX if it couldn't be read.
+*/
+static size_t block_store_journal_replay(block_store_t *const bs, const int fd, const size_t file_bytes)
+{
+	const size_t start = sizeof(block_store_header_t);
+	const size_t length = file_bytes - start;
+	if(length == 0){
+		return start;
+	}
+	uint8_t *const data = (uint8_t *)malloc(length);
+	if(data == NULL || !block_store_pread_all(fd, data, length, (off_t)start)){
+		free(data);
+		return SIZE_MAX;
+	}
+
+	size_t committed = 0;
+	block_store_journal_record_t record;
+	for(size_t pos = 0; pos + sizeof(record) <= length;){
+		memcpy(&record, data + pos, sizeof(record));
+		const size_t payload = (record.type == JOURNAL_WRITE) ? bs->block_size : 0;
+		const bool valid = (record.type == JOURNAL_COMMIT)
+			|| ((record.type == JOURNAL_WRITE || record.type == JOURNAL_ALLOC || record.type == JOURNAL_RELEASE)
+				&& record.block_id < bs->num_blocks && record.count > 0 && record.count <= bs->num_blocks - record.block_id
+				&& (record.type != JOURNAL_WRITE || (record.count == 1 && !block_store_is_reserved(bs, record.block_id))));
+		if(!valid || length - pos - sizeof(record) < payload
+			|| record.checksum != block_store_checksum(block_store_checksum(BLOCK_STORE_FNV_BASIS, &record, offsetof(block_store_journal_record_t, checksum)), data + pos + sizeof(record), payload)){
+			break; //torn or damaged, nothing from here on can be trusted
+		}
+		pos += sizeof(record) + payload;
+		if(record.type == JOURNAL_COMMIT){
+			committed = pos;
+		}
+	}
+
+	for(size_t pos = 0; pos < committed;){
+		memcpy(&record, data + pos, sizeof(record));
+		if(record.type == JOURNAL_WRITE){
+			memcpy(block_store_block(bs, record.block_id), data + pos + sizeof(record), bs->block_size);
+			block_store_bit_set(bs, bs->dirty, record.block_id); //the journal still has it, so it isn't unjournaled
+			pos += bs->block_size;
+		}else if(record.type == JOURNAL_ALLOC){
+			for(size_t i = 0; i < record.count; i++){ //already allocated (in the image) is fine
+				block_store_request(bs, record.block_id + i);
+			}
+		}else if(record.type == JOURNAL_RELEASE){
+			block_store_release_extent(bs, record.block_id, record.count);
+		}
+		pos += sizeof(record);
+	}
+	free(data);
+	return start + committed;
+}
+
+/*
+	This function starts journaling changes to bs in filename. A new (empty) file gets a header, an existing one
+	must be for the same geometry and has its committed records replayed onto bs before anything else happens;
+	whatever follows the last commit is cut off so new records carry on from there.
+*/
+bool block_store_journal_open(block_store_t *const bs, const char *const filename)
+{
+	if(bs == NULL || filename == NULL || bs->journal != NULL || SNAPSHOT(bs)){ //check that parameters were passed correctly
+		errno = EINVAL;
+		return false;
+	}
+	if(bs->snapshots){ //replay writes blocks without copying them for snapshots first
+		errno = EBUSY;
+		return false;
+	}
+
+	const int fd = open(filename, O_RDWR | O_CREAT, 0644);
+	if(fd == -1){
+		return false;
+	}
+
+	struct stat st;
+	block_store_header_t header, expected;
+	block_store_fill_header(bs, JOURNAL_MAGIC, &expected);
+	size_t end = sizeof(header);
+	bool ok = fstat(fd, &st) == 0;
+	if(ok && st.st_size == 0){ //brand new journal
+		ok = pwrite(fd, &expected, sizeof(expected), 0) == (ssize_t)sizeof(expected) && fsync(fd) == 0;
+	}else if(ok){
+		ok = (size_t)st.st_size >= sizeof(header) && block_store_pread_all(fd, &header, sizeof(header), 0);
+		if(ok && memcmp(&header, &expected, sizeof(header)) != 0){ //not a journal, or not for a store like this one
+			errno = EINVAL;
+			ok = false;
+		}
+		if(ok){
+			end = block_store_journal_replay(bs, fd, (size_t)st.st_size);
+			ok = end != SIZE_MAX && ftruncate(fd, (off_t)end) == 0;
+		}
+	}
+
+	block_store_journal_t *const journal = ok ? (block_store_journal_t *)calloc(1, sizeof(block_store_journal_t)) : NULL;
+	if(journal == NULL){
+		close(fd);
+		return false;
+	}
+	pthread_mutex_init(&journal->lock, NULL);
+	journal->fd = fd;
+	journal->offset = (off_t)end;
+	bs->journal = journal;
+	return true;
+}
+
+// Closes off the buffered records with a commit record, writes them out and syncs (caller holds the journal lock)
+static bool block_store_journal_sync(const block_store_t *const bs)
+{
+	block_store_journal_t *const journal = bs->journal;
+	block_store_journal_record(bs, JOURNAL_COMMIT, 0, 0, NULL);
+	block_store_journal_write_out(journal);
+	if(!journal->failed && fdatasync(journal->fd) != 0){
+		journal->failed = true;
+		journal->error = errno;
+	}
+	if(journal->failed){
+		errno = journal->error;
+	}
+	return !journal->failed;
+}
+
+/*
+	This function makes everything journaled so far durable. Every thread's buffered records, plus a commit record
+	closing them off, go out in one write and then one fdatasync.
+*/
+bool block_store_journal_commit(block_store_t *const bs)
+{
+	if(bs == NULL || bs->journal == NULL){ //check that parameters were passed correctly
+		errno = EINVAL;
+		return false;
+	}
+
+	pthread_mutex_lock(&bs->journal->lock);
+	const bool ok = block_store_journal_sync(bs);
+	pthread_mutex_unlock(&bs->journal->lock);
+	return ok;
+}
+
+// fsyncs the directory filename is in, so a rename into it is durable too (best effort, not every filesystem allows it)
+static void block_store_sync_dir(const char *const filename)
+{
+	char *const dir = strdup(strchr(filename, '/') ? filename : ".");
+	if(dir){
+		char *const slash = strrchr(dir, '/');
+		if(slash){ //cut the name off, keeping the / if the file is in the root
+			slash[slash == dir ? 1 : 0] = '\0';
+		}
+		const int fd = open(dir, O_RDONLY);
+		if(fd != -1){
+			fsync(fd);
+			close(fd);
+		}
+		free(dir);
+	}
+}
+
+/*
+	Checks that fd holds an uncompressed image with bs's geometry, one a checkpoint can update in place: its header
+	has to be exactly the one a fresh image would get.
+*/
+static bool block_store_image_matches(const block_store_t *const bs, const int fd)
+{
+	struct stat st;
+	block_store_header_t expected, found;
+	block_store_fill_header(bs, BLOCK_STORE_MAGIC, &expected);
+	return fstat(fd, &st) == 0 && (size_t)st.st_size == sizeof(found) + bs->num_blocks * bs->block_size
+		&& block_store_pread_all(fd, &found, sizeof(found), 0) && memcmp(&found, &expected, sizeof(found)) == 0;
+}
+
+/*
+	Before an in-place checkpoint overwrites the image in fd, journals what replaying the journal couldn't otherwise
+	put back if the overwrite tears: the contents of every unjournaled dirty block, and every block whose allocation
+	differs from the image's bitmap (allocations made before journal_open; the rest end up journaled twice, harmlessly).
+	Caller holds the journal lock and every stripe.
+*/
+static bool block_store_journal_catch_up(const block_store_t *const bs, const int fd)
+{
+	for(size_t id = bitmap_ffs(bs->unjournaled); id != SIZE_MAX; id = (id + 1 < bs->num_blocks) ? bitmap_ffs_from(bs->unjournaled, id + 1) : SIZE_MAX){
+		block_store_journal_record(bs, JOURNAL_WRITE, id, 1, block_store_block(bs, id));
+	}
+
+	const size_t bytes = bs->bitmap_blocks * bs->block_size;
+	uint8_t *const saved = (uint8_t *)malloc(bytes);
+	bitmap_t *const changed = saved ? bitmap_overlay(bs->num_blocks, saved) : NULL;
+	const bool ok = changed && block_store_pread_all(fd, saved, bytes, (off_t)(sizeof(block_store_header_t) + bs->bitmap_start * bs->block_size))
+		&& bitmap_xor(changed, bs->bitmap);
+	size_t start = ok ? bitmap_ffs(changed) : SIZE_MAX;
+	while(start != SIZE_MAX){
+		size_t end = bitmap_ffz_from(changed, start);
+		if(end == SIZE_MAX) end = bs->num_blocks; //changed through to the last block
+		while(start < end){ //one record per stretch that's now all allocated or all free
+			const bool allocated = bitmap_test(bs->bitmap, start);
+			size_t flip = allocated ? bitmap_ffz_from(bs->bitmap, start) : bitmap_ffs_from(bs->bitmap, start);
+			if(flip > end) flip = end;
+			block_store_journal_record(bs, allocated ? JOURNAL_ALLOC : JOURNAL_RELEASE, start, flip - start, NULL);
+			start = flip;
+		}
+		start = (end < bs->num_blocks) ? bitmap_ffs_from(changed, end) : SIZE_MAX;
+	}
+	bitmap_destroy(changed);
+	free(saved);
+	return ok;
+}
+
+/*
+	Brings the image in fd, saved from bs and changed only by checkpoints since, up to date in place: each run of dirty
+	blocks goes out in one pwrite, then the bitmap blocks, then it's synced. Nothing guards against a crash part way
+	through, so this is only for journaled stores, where replaying the journal repairs the image.
+*/
+static bool block_store_write_dirty(const block_store_t *const bs, const int fd)
+{
+	size_t start = bitmap_ffs(bs->dirty);
+	while(start != SIZE_MAX){
+		size_t end = bitmap_ffz_from(bs->dirty, start);
+		if(end == SIZE_MAX) end = bs->num_blocks; //dirty through to the last block
+		if(!block_store_pwrite_all(fd, block_store_block(bs, start), (end - start) * bs->block_size, (off_t)(sizeof(block_store_header_t) + start * bs->block_size))){
+			return false;
+		}
+		start = (end < bs->num_blocks) ? bitmap_ffs_from(bs->dirty, end) : SIZE_MAX;
+	}
+	return block_store_pwrite_all(fd, block_store_block(bs, bs->bitmap_start), bs->bitmap_blocks * bs->block_size, (off_t)(sizeof(block_store_header_t) + bs->bitmap_start * bs->block_size))
+		&& fdatasync(fd) == 0;
+}
+
+// Writes the whole store to filename.tmp, syncs it and renames it over filename
+static bool block_store_replace_image(const block_store_t *const bs, const char *const filename)
+{
+	char *const temp = (char *)malloc(strlen(filename) + sizeof(".tmp"));
+	if(temp == NULL){
+		return false;
+	}
+	strcpy(temp, filename);
+	strcat(temp, ".tmp");
+
+	const int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	bool ok = fd != -1 && block_store_write_image(bs, fd) && fsync(fd) == 0;
+	if(fd != -1){
+		ok = (close(fd) == 0) && ok;
+	}
+	ok = ok && rename(temp, filename) == 0;
+	if(ok){
+		block_store_sync_dir(filename);
+	}else{
+		unlink(temp);
+	}
+	free(temp);
+	return ok;
+}
+
+/*
+	This function saves the store to filename and then empties the journal, since every record so far is in the image.
+	If the store has a journal and filename is the image the store was last loaded from or checkpointed to, only the
+	blocks written since then and the bitmap are rewritten, in place. That's crash safe because the journal is made
+	durable first: a torn image is repaired by replaying it, which is exactly what recovery does anyway (changes it
+	never saw, from before it was opened or made through block pointers, are journaled first). Without a journal
+	nothing could repair it, so those checkpoints always rewrite the image whole.
+	A failed in-place update is reported, not redone as a full rewrite; the blocks stay dirty for the next try.
+	Otherwise the whole store goes to filename.tmp, is synced, and is renamed over filename, so there's never a torn
+	image to begin with (a crash before the journal is emptied just replays records the image already has).
+	Writers and the journal are held off for the duration so the image and the journal agree. Allocations stay
+	lock-free and may land in the image before their record reaches the journal; like serialize, the image is then
+	simply a little ahead, holding a block its caller never committed.
+*/
+size_t block_store_checkpoint(block_store_t *const bs, const char *const filename)
+{
+	if(bs == NULL || filename == NULL || SNAPSHOT(bs)){ //check that parameters were passed correctly, a snapshot is saved with serialize
+		errno = EINVAL;
+		return 0;
+	}
+
+	block_store_lock_caches(bs); //cached blocks aren't saved as used: the in-place bitmap is written as it is, so empty them
+	for(size_t slot = 0; bs->caches && slot < CACHE_SLOTS; slot++){
+		block_store_cache_empty(bs, &bs->caches[slot]);
+	}
+	block_store_lock_range(bs, 0, bs->num_blocks, false);
+	block_store_journal_begin(bs);
+	bool ok = false, in_place = false;
+	if(bs->journal && bs->image_path && strcmp(bs->image_path, filename) == 0){ //in place, if the file is still the image we saved
+		const int fd = open(filename, O_RDWR);
+		in_place = fd != -1 && block_store_image_matches(bs, fd);
+		ok = in_place && block_store_journal_catch_up(bs, fd) && block_store_journal_sync(bs) && block_store_write_dirty(bs, fd);
+		if(fd != -1){
+			ok = (close(fd) == 0) && ok;
+		}
+	}
+	if(!in_place && block_store_replace_image(bs, filename)){ //a fresh image
+		ok = true;
+		if(bs->image_path == NULL || strcmp(bs->image_path, filename) != 0){
+			free(bs->image_path);
+			bs->image_path = strdup(filename); //without it the next checkpoint is a full one again, which is fine
+		}
+	}
+	if(ok){
+		bitmap_format(bs->dirty, 0); //writers are held off, so nothing can be marked in between
+		bitmap_format(bs->unjournaled, 0);
+	}
+	if(ok && bs->journal){
+		block_store_journal_t *const journal = bs->journal;
+		journal->length = 0;
+		journal->offset = sizeof(block_store_header_t);
+		ok = ftruncate(journal->fd, journal->offset) == 0 && fsync(journal->fd) == 0;
+		journal->failed = !ok;
+		journal->error = ok ? 0 : errno;
+	}
+	block_store_journal_end(bs);
+	block_store_unlock_range(bs, 0, bs->num_blocks);
+	block_store_unlock_caches(bs);
+
+	return ok ? sizeof(block_store_header_t) + bs->num_blocks * bs->block_size : 0;
+}
+
+// What a flush request does: msync a mapped store, then commit its journal if it has one
+static bool block_store_async_flush(block_store_t *const bs)
+{
+	bool ok = true;
+	if(bs->mapping){
+		ok = block_store_flush(bs);
+	}
+	if(ok && bs->journal){
+		ok = block_store_journal_commit(bs);
+	}
+	return ok;
+}
+
+/*
+	Worker thread: runs queued requests through the synchronous calls until the store is being destroyed and the queue
+	is empty. A barrier at the head of the queue isn't started until nothing else is running.
+*/
+static void *block_store_async_worker(void *const arg)
+{
+	block_store_t *const bs = (block_store_t *)arg;
+	block_store_async_t *const async = bs->async;
+	pthread_mutex_lock(&async->lock);
+	for(;;){
+		block_store_async_request_t *const request = async->head;
+		if(request == NULL || (request->type >= ASYNC_FLUSH && async->running > 0)){
+			if(request == NULL && async->stopping){ //drained, done
+				break;
+			}
+			pthread_cond_wait(&async->work, &async->lock);
+			continue;
+		}
+		async->head = request->next;
+		if(async->head == NULL){
+			async->tail = NULL;
+		}
+		async->running++;
+		pthread_mutex_unlock(&async->lock);
+
+		errno = 0;
+		size_t result = 0;
+		if(request->type == ASYNC_READ){
+			result = block_store_read(bs, request->block_id, request->buffer);
+		}else if(request->type == ASYNC_WRITE){
+			result = block_store_write(bs, request->block_id, request->buffer);
+		}else if(request->type == ASYNC_SERIALIZE){
+			result = block_store_serialize(bs, (const char *)request->buffer);
+		}else if(request->type == ASYNC_CHECKPOINT){
+			result = block_store_checkpoint(bs, (const char *)request->buffer);
+		}else{
+			result = block_store_async_flush(bs);
+		}
+		const int error = result ? 0 : errno;
+		if(request->callback){
+			request->callback(bs, result, error, request->arg);
+		}
+		if(request->type >= ASYNC_SERIALIZE){
+			free(request->buffer);
+		}
+		free(request);
+
+		pthread_mutex_lock(&async->lock);
+		async->running--;
+		async->pending--;
+		if(async->pending == 0){
+			pthread_cond_broadcast(&async->idle);
+		}
+		if(async->running == 0){ //a barrier may have been waiting on this one
+			pthread_cond_broadcast(&async->work);
+		}
+	}
+	pthread_mutex_unlock(&async->lock);
+	return NULL;
+}
+
+/*
+	Queues a request, setting up the worker pool on first use and starting another worker while there are more
+	requests in flight than workers (up to ASYNC_WORKERS, or just the one for stores that aren't thread safe).
+*/
+static bool block_store_async_submit(block_store_t *const bs, const ASYNC_REQUEST_TYPE type, const size_t block_id, void *const buffer, const block_store_callback_t callback, void *const arg)
+{
+	block_store_async_t *async = __atomic_load_n(&bs->async, __ATOMIC_ACQUIRE);
+	if(async == NULL){ //first use; threads racing to set it up keep whichever pool got there first
+		block_store_async_t *const fresh = (block_store_async_t *)calloc(1, sizeof(block_store_async_t));
+		if(fresh == NULL){
+			return false;
+		}
+		pthread_mutex_init(&fresh->lock, NULL);
+		pthread_cond_init(&fresh->work, NULL);
+		pthread_cond_init(&fresh->idle, NULL);
+		if(__atomic_compare_exchange_n(&bs->async, &async, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+			async = fresh;
+		}else{
+			pthread_cond_destroy(&fresh->idle);
+			pthread_cond_destroy(&fresh->work);
+			pthread_mutex_destroy(&fresh->lock);
+			free(fresh);
+		}
+	}
+
+	block_store_async_request_t *const request = (block_store_async_request_t *)malloc(sizeof(block_store_async_request_t));
+	if(request == NULL){
+		return false;
+	}
+	request->next = NULL;
+	request->type = type;
+	request->block_id = block_id;
+	request->buffer = buffer;
+	request->callback = callback;
+	request->arg = arg;
+
+	pthread_mutex_lock(&async->lock);
+	const size_t max_workers = THREADSAFE(bs) ? ASYNC_WORKERS : 1;
+	if(async->workers < max_workers && async->workers <= async->pending){
+		const int error = pthread_create(&async->threads[async->workers], NULL, block_store_async_worker, bs);
+		if(error == 0){
+			async->workers++;
+		}else if(async->workers == 0){ //no one to run it
+			pthread_mutex_unlock(&async->lock);
+			free(request);
+			errno = error;
+			return false;
+		}
+	}
+	if(async->tail){
+		async->tail->next = request;
+	}else{
+		async->head = request;
+	}
+	async->tail = request;
+	async->pending++;
+	pthread_cond_signal(&async->work);
+	pthread_mutex_unlock(&async->lock);
+	return true;
+}
+
+// Lets the workers finish everything queued, then joins them and frees the pool (from block_store_destroy)
+static void block_store_async_stop(block_store_t *const bs)
+{
+	block_store_async_t *const async = bs->async;
+	if(async == NULL){
+		return;
+	}
+	pthread_mutex_lock(&async->lock);
+	async->stopping = true;
+	pthread_cond_broadcast(&async->work);
+	pthread_mutex_unlock(&async->lock);
+	for(size_t i = 0; i < async->workers; i++){
+		pthread_join(async->threads[i], NULL);
+	}
+	pthread_cond_destroy(&async->idle);
+	pthread_cond_destroy(&async->work);
+	pthread_mutex_destroy(&async->lock);
+	free(async);
+	bs->async = NULL;
+}
+
+//This function queues a block_store_read for the worker threads. It returns whether the request was queued.
+bool block_store_read_async(block_store_t *const bs, const size_t block_id, void *buffer, block_store_callback_t callback, void *arg)
+{
+	if(bs == NULL || buffer == NULL || block_id >= bs->num_blocks){ //check that the parameters were passed correctly
+		errno = EINVAL;
+		return false;
+	}
+	return block_store_async_submit(bs, ASYNC_READ, block_id, buffer, callback, arg);
+}
+
+//This function queues a block_store_write for the worker threads. It returns whether the request was queued.
+bool block_store_write_async(block_store_t *const bs, const size_t block_id, const void *buffer, block_store_callback_t callback, void *arg)
+{
+	if(bs == NULL || buffer == NULL || block_id >= bs->num_blocks || block_store_is_reserved(bs, block_id) || SNAPSHOT(bs)){ //check for valid parameters, the bitmap blocks are off limits
+		errno = EINVAL;
+		return false;
+	}
+	return block_store_async_submit(bs, ASYNC_WRITE, block_id, (void *)buffer, callback, arg);
+}
+
+//This function queues a flush of a mapped or journaled store, behind everything already queued. It returns whether the request was queued.
+bool block_store_flush_async(block_store_t *const bs, block_store_callback_t callback, void *arg)
+{
+	if(bs == NULL || (bs->mapping == NULL && bs->journal == NULL)){ //nothing behind the store to flush to
+		errno = EINVAL;
+		return false;
+	}
+	return block_store_async_submit(bs, ASYNC_FLUSH, 0, NULL, callback, arg);
+}
+
+//This function queues a block_store_serialize or block_store_checkpoint to filename, behind everything already queued.
+static bool block_store_async_save(block_store_t *const bs, const ASYNC_REQUEST_TYPE type, const char *const filename, block_store_callback_t callback, void *arg)
+{
+	if(bs == NULL || filename == NULL){ //check that the parameters were passed correctly
+		errno = EINVAL;
+		return false;
+	}
+	char *const name = strdup(filename); //the caller's string only has to last until we return
+	if(name == NULL){
+		return false;
+	}
+	if(!block_store_async_submit(bs, type, 0, name, callback, arg)){
+		free(name);
+		return false;
+	}
+	return true;
+}
+
+//This function queues a block_store_serialize for the worker threads. It returns whether the request was queued.
+bool block_store_serialize_async(block_store_t *const bs, const char *const filename, block_store_callback_t callback, void *arg)
+{
+	return block_store_async_save(bs, ASYNC_SERIALIZE, filename, callback, arg);
+}
 
+//This function queues a block_store_checkpoint for the worker threads. It returns whether the request was queued.
+bool block_store_checkpoint_async(block_store_t *const bs, const char *const filename, block_store_callback_t callback, void *arg)
+{
+	return block_store_async_save(bs, ASYNC_CHECKPOINT, filename, callback, arg);
+}
+
+//This function waits for every asynchronous request queued so far to finish.
+void block_store_wait_async(block_store_t *const bs)
+{
+	block_store_async_t *const async = bs ? __atomic_load_n(&bs->async, __ATOMIC_ACQUIRE) : NULL;
+	if(async == NULL){
+		return;
+	}
+	pthread_mutex_lock(&async->lock);
+	while(async->pending > 0){
+		pthread_cond_wait(&async->idle, &async->lock);
+	}
+	pthread_mutex_unlock(&async->lock);
+}
+
+/*
+	This function adds up every shard of bs's counters into stats. Without BLOCK_STORE_STATS there are none to add up.
+*/
+bool block_store_get_stats(const block_store_t *const bs, block_store_stats_t *const stats)
+{
+	if(bs == NULL || stats == NULL){ //check that parameters were passed correctly
+		errno = EINVAL;
+		return false;
+	}
+	memset(stats, 0, sizeof(*stats));
+#ifdef BLOCK_STORE_STATS
+	uint64_t *const total = (uint64_t *)stats; //the struct is nothing but counters, so add them up as one array
+	for(size_t shard = 0; shard < STATS_SHARDS; shard++){
+		const uint64_t *const counts = (const uint64_t *)&bs->stats[shard].counts;
+		for(size_t i = 0; i < sizeof(*stats) / sizeof(uint64_t); i++){
+			total[i] += __atomic_load_n(&counts[i], __ATOMIC_RELAXED);
+		}
+	}
+	return true;
+#else
+	errno = ENOTSUP;
+	return false;
+#endif
+}
+
+// Upper bound of the histogram bucket the given fraction of the total falls in (an estimate of that percentile)
+static uint64_t block_store_stats_percentile(const uint64_t *const histogram, const uint64_t total, const double fraction)
+{
+	uint64_t seen = 0;
+	for(size_t i = 0; i < BLOCK_STORE_STATS_BUCKETS; i++){
+		seen += histogram[i];
+		if(seen && seen >= fraction * total){
+			return (uint64_t)2 << i;
+		}
+	}
+	return 0;
+}
+
+/*
+	This function prints bs's counters to out, one line per operation with latency estimates from the histograms
+	(the p50/p99 columns are bucket upper bounds, so within a factor of two).
+*/
+bool block_store_dump_stats(const block_store_t *const bs, FILE *const out)
+{
+	block_store_stats_t stats;
+	if(out == NULL || !block_store_get_stats(bs, &stats)){
+		if(out == NULL) errno = EINVAL;
+		return false;
+	}
+
+	static const char *const names[BS_OP_COUNT] = { "allocate", "request", "release", "read", "write", "serialize", "deserialize", "extent",
+		"free extent", "readv", "writev" };
+	fprintf(out, "%-12s %12s %12s %12s %12s %12s\n", "operation", "calls", "failures", "avg ns", "p50 ns <", "p99 ns <");
+	for(size_t op = 0; op < BS_OP_COUNT; op++){
+		fprintf(out, "%-12s %12llu %12llu %12llu %12llu %12llu\n", names[op],
+			(unsigned long long)stats.calls[op], (unsigned long long)stats.failures[op],
+			(unsigned long long)(stats.calls[op] ? stats.nanoseconds[op] / stats.calls[op] : 0),
+			(unsigned long long)block_store_stats_percentile(stats.latency[op], stats.calls[op], 0.5),
+			(unsigned long long)block_store_stats_percentile(stats.latency[op], stats.calls[op], 0.99));
+	}
+
+	uint64_t searches = 0;
+	for(size_t i = 0; i < BLOCK_STORE_STATS_BUCKETS; i++){
+		searches += stats.scans[i];
+	}
+	fprintf(out, "allocation searches %llu, blocks scanned %llu (avg %llu, p99 < %llu)\n",
+		(unsigned long long)searches, (unsigned long long)stats.scan_blocks,
+		(unsigned long long)(searches ? stats.scan_blocks / searches : 0),
+		(unsigned long long)block_store_stats_percentile(stats.scans, searches, 0.99));
+	fprintf(out, "errors ENOSPC %llu, EINVAL %llu\n", (unsigned long long)stats.enospc, (unsigned long long)stats.einval);
+	return ferror(out) == 0;
 }
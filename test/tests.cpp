@@ -1,6 +1,16 @@
 #include <gtest/gtest.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
 #include "block_store.h"
+#include "bitmap.h"
+#ifdef BLOCK_STORE_LZ4
+#include <lz4.h>
+#endif
 
 // The object is opaque, so we can't really test things directly....
 
@@ -30,6 +40,30 @@ int main(int argc, char **argv) {
 
 
 
+// Sets the checksum of an image header to match what's in front of it (FNV-1a of everything before the checksum)
+static void seal_header(uint8_t *const header)
+{
+	uint64_t checksum = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < BLOCK_STORE_HEADER_BYTES - sizeof(checksum); i++)
+	{
+		checksum = (checksum ^ header[i]) * 0x100000001b3ULL;
+	}
+	memcpy(header + BLOCK_STORE_HEADER_BYTES - sizeof(checksum), &checksum, sizeof(checksum));
+}
+
+// Fills in a version 1 image header with the given magic and geometry, reserved words zero, checksum to match
+static void build_header(uint8_t *const header, const char *const magic, const uint64_t num_blocks, const uint64_t block_size)
+{
+	const uint32_t version = 1, header_bytes = BLOCK_STORE_HEADER_BYTES;
+	memset(header, 0, BLOCK_STORE_HEADER_BYTES);
+	memcpy(header, magic, 8);
+	memcpy(header + 8, &version, sizeof(version));
+	memcpy(header + 12, &header_bytes, sizeof(header_bytes));
+	memcpy(header + 16, &num_blocks, sizeof(num_blocks));
+	memcpy(header + 24, &block_size, sizeof(block_size));
+	seal_header(header);
+}
+
 TEST(block_store_create, create) {
 	block_store_t *bs = NULL;
 	bs = block_store_create();
@@ -54,6 +88,106 @@ TEST(block_store_get_total_blocks, num_blocks) {
 	score += 2;
 }
 
+TEST(block_store_create_ex, bad_geometry) {
+	ASSERT_EQ(nullptr, block_store_create_ex(0, BLOCK_SIZE_BYTES));
+	ASSERT_EQ(nullptr, block_store_create_ex(BLOCK_STORE_NUM_BLOCKS, 0));
+	// Word sized blocks, but too many of them to address
+	ASSERT_EQ(nullptr, block_store_create_ex(SIZE_MAX / 8, 64));
+	ASSERT_EQ(EINVAL, errno);
+	// and an image header claiming that geometry is refused before anything is sized from it
+	uint8_t header[BLOCK_STORE_HEADER_BYTES];
+	build_header(header, "BLKSTORE", SIZE_MAX / 8, 64);
+	const int fd = open("test_overflow.bs", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	ASSERT_NE(-1, fd);
+	ASSERT_EQ((ssize_t)sizeof(header), pwrite(fd, header, sizeof(header), 0));
+	close(fd);
+	ASSERT_EQ(nullptr, block_store_deserialize("test_overflow.bs"));
+	ASSERT_EQ(EINVAL, errno);
+	ASSERT_EQ(nullptr, block_store_open_mmap("test_overflow.bs", O_RDONLY));
+	ASSERT_EQ(EINVAL, errno);
+	unlink("test_overflow.bs");
+	// Blocks have to be whole words so the bitmap blocks stay word aligned
+	ASSERT_EQ(nullptr, block_store_create_ex(BLOCK_STORE_NUM_BLOCKS, 12));
+	// One block would be all bitmap, with nothing left for data
+	ASSERT_EQ(nullptr, block_store_create_ex(1, BLOCK_SIZE_BYTES));
+
+	score += 2;
+}
+
+TEST(block_store_create_flags, unknown_flags) {
+	// A bit this version doesn't know, alone or next to known ones, is refused rather than ignored
+	ASSERT_EQ(nullptr, block_store_create_flags(BLOCK_STORE_NUM_BLOCKS, BLOCK_SIZE_BYTES, 0x80));
+	ASSERT_EQ(EINVAL, errno);
+	ASSERT_EQ(nullptr, block_store_create_flags(BLOCK_STORE_NUM_BLOCKS, BLOCK_SIZE_BYTES, BS_THREADSAFE | 0x100));
+	ASSERT_EQ(EINVAL, errno);
+	block_store_t *bs = block_store_create_flags(BLOCK_STORE_NUM_BLOCKS, BLOCK_SIZE_BYTES, BS_THREADSAFE | BS_ALLOC_CACHE);
+	ASSERT_NE(nullptr, bs) << "block_store_create_flags returned NULL when it should not have\n";
+	block_store_destroy(bs);
+	score += 1;
+}
+
+TEST(block_store_create_ex, default_geometry) {
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS, block_store_get_block_count(bs));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_get_block_size(bs));
+	ASSERT_EQ(BITMAP_NUM_BLOCKS, block_store_get_used_blocks(bs));
+	block_store_destroy(bs);
+
+	ASSERT_EQ(0, block_store_get_block_count(NULL));
+	ASSERT_EQ(0, block_store_get_block_size(NULL));
+
+	score += 2;
+}
+
+TEST(block_store_create_ex, small_store) {
+	// Too small to put the bitmap at BITMAP_START_BLOCK, so it goes to block 0
+	block_store_t *bs = block_store_create_ex(64, BLOCK_SIZE_BYTES);
+	ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+	ASSERT_EQ(1, block_store_get_used_blocks(bs));
+	ASSERT_EQ(false, block_store_request(bs, 0));
+	ASSERT_EQ(1, block_store_allocate(bs));
+	ASSERT_EQ(false, block_store_request(bs, 64));
+	block_store_destroy(bs);
+
+	score += 2;
+}
+
+TEST(block_store_create_ex, large_store) {
+	const size_t num_blocks = 1 << 16;
+	const size_t block_size = 4096;
+	block_store_t *bs = block_store_create_ex(num_blocks, block_size);
+	ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+	ASSERT_EQ(num_blocks, block_store_get_block_count(bs));
+	ASSERT_EQ(block_size, block_store_get_block_size(bs));
+
+	// 8 KiB of bitmap is two 4 KiB blocks
+	ASSERT_EQ(2, block_store_get_used_blocks(bs));
+	size_t allocated = 0;
+	while (block_store_allocate(bs) != SIZE_MAX)
+	{
+		++allocated;
+	}
+	ASSERT_EQ(num_blocks - 2, allocated);
+	ASSERT_EQ(0, block_store_get_free_blocks(bs));
+
+	uint8_t *write_buffer = (uint8_t *) malloc(block_size);
+	uint8_t *read_buffer = (uint8_t *) calloc(1, block_size);
+	ASSERT_NE(nullptr, write_buffer) << "malloc ... failed?" << std::endl;
+	ASSERT_NE(nullptr, read_buffer) << "calloc ... failed?" << std::endl;
+	memset(write_buffer, 'Z', block_size);
+	ASSERT_EQ(block_size, block_store_write(bs, num_blocks - 1, write_buffer));
+	ASSERT_EQ(block_size, block_store_read(bs, num_blocks - 1, read_buffer));
+	ASSERT_EQ(0, memcmp(read_buffer, write_buffer, block_size));
+	ASSERT_EQ(0, block_store_write(bs, num_blocks, write_buffer));
+
+	free(read_buffer);
+	free(write_buffer);
+	block_store_destroy(bs);
+
+	score += 5;
+}
+
 TEST(block_store_alloc_free_req, allocate_null) {
 	size_t id;
 	id = block_store_allocate(nullptr);
@@ -135,6 +269,131 @@ TEST(block_store_alloc_free_req, over_allocate) {
 }
 
 
+TEST(block_store_alloc_free_req, allocate_lowest_after_release) {
+	block_store_t *bs = NULL;
+	bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+
+	// Fill the store, then free blocks on either side of a word boundary and past the bitmap blocks
+	while (block_store_allocate(bs) != SIZE_MAX)
+	{
+	}
+	ASSERT_EQ(0, block_store_get_free_blocks(bs));
+	block_store_release(bs, 300);
+	block_store_release(bs, 64);
+	block_store_release(bs, 63);
+
+	// The lowest free block always comes back first, no matter what was allocated last
+	ASSERT_EQ(63, block_store_allocate(bs));
+	ASSERT_EQ(64, block_store_allocate(bs));
+	ASSERT_EQ(300, block_store_allocate(bs));
+	ASSERT_EQ(SIZE_MAX, block_store_allocate(bs));
+
+	// Requesting the last free block in a word must fill it just like allocate does
+	block_store_release(bs, 5);
+	ASSERT_EQ(true, block_store_request(bs, 5));
+	ASSERT_EQ(SIZE_MAX, block_store_allocate(bs));
+
+	// Releasing out of range is ignored
+	block_store_release(bs, BLOCK_STORE_NUM_BLOCKS);
+	ASSERT_EQ(0, block_store_get_free_blocks(bs));
+	block_store_destroy(bs);
+
+	score += 5;
+}
+
+TEST(block_store_alloc_free_req, used_count_is_exact) {
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	size_t used = BITMAP_NUM_BLOCKS;
+
+	// Every path that changes the bitmap has to keep the count, including the ones that change nothing
+	ASSERT_EQ(0, block_store_allocate(bs));
+	ASSERT_EQ(1, block_store_allocate(bs));
+	used += 2;
+	ASSERT_EQ(true, block_store_request(bs, 300));
+	ASSERT_EQ(false, block_store_request(bs, 300));
+	used += 1;
+	block_store_release(bs, 1);
+	block_store_release(bs, 1);
+	block_store_release(bs, 301);
+	used -= 1;
+	ASSERT_EQ(used, block_store_get_used_blocks(bs));
+
+	size_t start = 0;
+	ASSERT_EQ(true, block_store_allocate_extent(bs, 40, &start));
+	used += 40;
+	// Only blocks 290..299 of this are free, plus 300 itself and 301..309 that never were used
+	block_store_release_extent(bs, 290, 20);
+	used -= 1;
+	block_store_release_extent(bs, start, 40);
+	used -= 40;
+	ASSERT_EQ(used, block_store_get_used_blocks(bs));
+	ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS - used, block_store_get_free_blocks(bs));
+
+	// Loading an image starts the count from the saved bitmap
+	ASSERT_EQ(BLOCK_STORE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test.bs"));
+	block_store_destroy(bs);
+	bs = block_store_deserialize("test.bs");
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(used, block_store_get_used_blocks(bs));
+	block_store_destroy(bs);
+
+	score += 2;
+}
+
+TEST(block_store_extent, allocate_and_release) {
+	block_store_t *bs = NULL;
+	bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+
+	size_t start = 0;
+	ASSERT_EQ(true, block_store_allocate_extent(bs, 10, &start));
+	ASSERT_EQ(0, start);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 10, block_store_get_used_blocks(bs));
+
+	// Blocks 10 up to the bitmap are too short for this, so it has to land after the bitmap blocks
+	ASSERT_EQ(true, block_store_allocate_extent(bs, 200, &start));
+	ASSERT_EQ(BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS, start);
+
+	// Single block allocation carries on right after the first extent
+	ASSERT_EQ(10, block_store_allocate(bs));
+
+	// Free part of the first extent and get the same range back
+	block_store_release_extent(bs, 2, 5);
+	ASSERT_EQ(true, block_store_allocate_extent(bs, 5, &start));
+	ASSERT_EQ(2, start);
+
+	// Ranges touching the bitmap blocks or leaving the store are ignored
+	const size_t used = block_store_get_used_blocks(bs);
+	block_store_release_extent(bs, BITMAP_START_BLOCK - 1, 2);
+	block_store_release_extent(bs, BLOCK_STORE_NUM_BLOCKS - 1, 2);
+	block_store_release_extent(bs, 0, 0);
+	ASSERT_EQ(used, block_store_get_used_blocks(bs));
+
+	block_store_destroy(bs);
+
+	score += 5;
+}
+
+TEST(block_store_extent, bad_requests) {
+	size_t start = 0;
+	ASSERT_EQ(false, block_store_allocate_extent(NULL, 1, &start));
+	block_store_release_extent(NULL, 0, 1);
+
+	block_store_t *bs = NULL;
+	bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	ASSERT_EQ(false, block_store_allocate_extent(bs, 0, &start));
+	ASSERT_EQ(false, block_store_allocate_extent(bs, 1, NULL));
+	ASSERT_EQ(false, block_store_allocate_extent(bs, BLOCK_STORE_NUM_BLOCKS, &start));
+	ASSERT_EQ(ENOSPC, errno);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS, block_store_get_used_blocks(bs));
+	block_store_destroy(bs);
+
+	score += 2;
+}
+
 TEST(block_store_alloc_free_req, null_pointers) {
 	size_t res = 0;
 
@@ -342,6 +601,388 @@ TEST(block_store_write_read, valid_write_and_read) {
 }
 
 
+TEST(block_store_write_read, vectored_write_and_read) {
+	block_store_t *bs = NULL;
+	bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+
+	// Blocks 20-22 come from one contiguous buffer so they get merged, block 5 is on its own
+	uint8_t write_buffer[4][BLOCK_SIZE_BYTES];
+	for (size_t i = 0; i < 4; i++)
+	{
+		memset(write_buffer[i], 'a' + i, BLOCK_SIZE_BYTES);
+	}
+	block_store_iovec_t write_vec[4] = {
+		{20, write_buffer[0]}, {21, write_buffer[1]}, {22, write_buffer[2]}, {5, write_buffer[3]}};
+	ASSERT_EQ(4 * BLOCK_SIZE_BYTES, block_store_writev(bs, write_vec, 4));
+
+	// Read them back out of order, checking against the single-block reads
+	uint8_t read_buffer[4][BLOCK_SIZE_BYTES];
+	uint8_t single[BLOCK_SIZE_BYTES];
+	block_store_iovec_t read_vec[4] = {
+		{5, read_buffer[0]}, {20, read_buffer[1]}, {21, read_buffer[2]}, {22, read_buffer[3]}};
+	ASSERT_EQ(4 * BLOCK_SIZE_BYTES, block_store_readv(bs, read_vec, 4));
+	ASSERT_EQ(0, memcmp(read_buffer[0], write_buffer[3], BLOCK_SIZE_BYTES));
+	ASSERT_EQ(0, memcmp(read_buffer[1], write_buffer[0], BLOCK_SIZE_BYTES));
+	ASSERT_EQ(0, memcmp(read_buffer[2], write_buffer[1], BLOCK_SIZE_BYTES));
+	ASSERT_EQ(0, memcmp(read_buffer[3], write_buffer[2], BLOCK_SIZE_BYTES));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 21, single));
+	ASSERT_EQ(0, memcmp(single, write_buffer[1], BLOCK_SIZE_BYTES));
+
+	block_store_destroy(bs);
+
+	score += 5;
+}
+
+TEST(block_store_write_read, vectored_bad_entries) {
+	block_store_t *bs = NULL;
+	bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+
+	uint8_t buffer[BLOCK_SIZE_BYTES];
+	memset(buffer, '~', BLOCK_SIZE_BYTES);
+	block_store_iovec_t vec[2] = {{10, buffer}, {BLOCK_STORE_NUM_BLOCKS, buffer}};
+
+	// One bad entry fails the whole batch before anything is copied
+	ASSERT_EQ(0, block_store_writev(bs, vec, 2));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 10, buffer));
+	for (size_t i = 0; i < BLOCK_SIZE_BYTES; i++)
+	{
+		ASSERT_EQ(0, buffer[i]);
+	}
+
+	vec[1].block_id = 11;
+	vec[1].buffer = NULL;
+	ASSERT_EQ(0, block_store_readv(bs, vec, 2));
+	ASSERT_EQ(0, block_store_readv(bs, vec, 0));
+	ASSERT_EQ(0, block_store_readv(bs, NULL, 1));
+	ASSERT_EQ(0, block_store_writev(NULL, vec, 1));
+
+	block_store_destroy(bs);
+
+	score += 2;
+}
+
+TEST(block_store_write_read, block_pointers) {
+	block_store_t *bs = NULL;
+	bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+
+	ASSERT_EQ(nullptr, block_store_get_block_ptr(NULL, 0));
+	ASSERT_EQ(nullptr, block_store_get_block_ptr(bs, BLOCK_STORE_NUM_BLOCKS));
+	ASSERT_EQ(nullptr, block_store_get_block_ptr_mut(bs, BLOCK_STORE_NUM_BLOCKS));
+
+	// Writes through the mutable pointer are what read returns...
+	uint8_t *block = (uint8_t *) block_store_get_block_ptr_mut(bs, 30);
+	ASSERT_NE(nullptr, block);
+	memset(block, 'p', BLOCK_SIZE_BYTES);
+	uint8_t read_buffer[BLOCK_SIZE_BYTES];
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 30, read_buffer));
+	ASSERT_EQ(0, memcmp(read_buffer, block, BLOCK_SIZE_BYTES));
+
+	// ...and the read-only pointer sees later writes
+	const uint8_t *view = (const uint8_t *) block_store_get_block_ptr(bs, 30);
+	ASSERT_EQ(block, view);
+	uint8_t write_buffer[BLOCK_SIZE_BYTES];
+	memset(write_buffer, 'q', BLOCK_SIZE_BYTES);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 30, write_buffer));
+	ASSERT_EQ(0, memcmp(view, write_buffer, BLOCK_SIZE_BYTES));
+
+	block_store_destroy(bs);
+
+	score += 2;
+}
+
+static void concurrent_allocate_unique(const unsigned flags)
+{
+	const size_t num_blocks = 1 << 16;
+	const size_t thread_count = 8;
+	block_store_t *bs = block_store_create_flags(num_blocks, BLOCK_SIZE_BYTES, flags);
+	ASSERT_NE(nullptr, bs) << "block_store_create_flags returned NULL when it should not have\n";
+	const size_t start_used = block_store_get_used_blocks(bs);
+
+	// Every thread allocates until the store runs dry; no block may be handed out twice
+	std::vector<std::vector<size_t>> ids(thread_count);
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < thread_count; t++)
+	{
+		threads.emplace_back([bs, &ids, t]() {
+			for (size_t id = block_store_allocate(bs); id != SIZE_MAX; id = block_store_allocate(bs))
+			{
+				ids[t].push_back(id);
+			}
+		});
+	}
+	for (auto &thread : threads)
+	{
+		thread.join();
+	}
+
+	std::vector<size_t> all;
+	for (auto &list : ids)
+	{
+		all.insert(all.end(), list.begin(), list.end());
+	}
+	std::sort(all.begin(), all.end());
+	ASSERT_EQ(all.end(), std::adjacent_find(all.begin(), all.end()));
+	ASSERT_EQ(num_blocks - start_used, all.size());
+	ASSERT_EQ(0, block_store_get_free_blocks(bs));
+	block_store_destroy(bs);
+}
+
+TEST(block_store_threadsafe, concurrent_allocate_unique)
+{
+	concurrent_allocate_unique(BS_THREADSAFE);
+
+	score += 5;
+}
+
+TEST(block_store_threadsafe, concurrent_allocate_unique_cached)
+{
+	concurrent_allocate_unique(BS_ALLOC_CACHE);
+
+	score += 5;
+}
+
+static void allocate_release_churn(const unsigned flags)
+{
+	const size_t num_blocks = 1024;
+	const size_t thread_count = 8;
+	block_store_t *bs = block_store_create_flags(num_blocks, BLOCK_SIZE_BYTES, flags);
+	ASSERT_NE(nullptr, bs) << "block_store_create_flags returned NULL when it should not have\n";
+	const size_t start_used = block_store_get_used_blocks(bs);
+
+	// Each thread stamps the blocks it owns with its own byte; if two threads ever shared a block
+	// one of them would read back the other's stamp
+	std::vector<size_t> failures(thread_count, 0);
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < thread_count; t++)
+	{
+		threads.emplace_back([bs, &failures, t]() {
+			uint8_t stamp[BLOCK_SIZE_BYTES];
+			uint8_t check[BLOCK_SIZE_BYTES];
+			memset(stamp, 'A' + t, BLOCK_SIZE_BYTES);
+			std::vector<size_t> owned;
+			for (size_t round = 0; round < 2000; round++)
+			{
+				size_t id = block_store_allocate(bs);
+				if (id != SIZE_MAX)
+				{
+					block_store_write(bs, id, stamp);
+					owned.push_back(id);
+				}
+				size_t extent = 0;
+				if (round % 7 == 0 && block_store_allocate_extent(bs, 3, &extent))
+				{
+					block_store_release_extent(bs, extent, 3);
+				}
+				if (owned.size() > 16 || (id == SIZE_MAX && !owned.empty()))
+				{
+					block_store_read(bs, owned.front(), check);
+					failures[t] += memcmp(check, stamp, BLOCK_SIZE_BYTES) != 0;
+					block_store_release(bs, owned.front());
+					owned.erase(owned.begin());
+				}
+			}
+			for (size_t id : owned)
+			{
+				block_store_read(bs, id, check);
+				failures[t] += memcmp(check, stamp, BLOCK_SIZE_BYTES) != 0;
+				block_store_release(bs, id);
+			}
+		});
+	}
+	for (auto &thread : threads)
+	{
+		thread.join();
+	}
+
+	for (size_t t = 0; t < thread_count; t++)
+	{
+		ASSERT_EQ(0, failures[t]) << "thread " << t << " found another thread's data in its block\n";
+	}
+	ASSERT_EQ(start_used, block_store_get_used_blocks(bs));
+
+	// With everything given back, a single thread can fill the store again
+	size_t allocated = 0;
+	while (block_store_allocate(bs) != SIZE_MAX)
+	{
+		++allocated;
+	}
+	ASSERT_EQ(num_blocks - start_used, allocated);
+	block_store_destroy(bs);
+}
+
+TEST(block_store_threadsafe, allocate_release_churn)
+{
+	allocate_release_churn(BS_THREADSAFE);
+
+	score += 5;
+}
+
+TEST(block_store_threadsafe, allocate_release_churn_cached)
+{
+	allocate_release_churn(BS_ALLOC_CACHE);
+
+	score += 5;
+}
+
+TEST(block_store_threadsafe, freed_low_blocks_reused)
+{
+	for (size_t round = 0; round < 20; round++)
+	{
+		block_store_t *bs = block_store_create_flags(4096, BLOCK_SIZE_BYTES, BS_THREADSAFE);
+		ASSERT_NE(nullptr, bs) << "block_store_create_flags returned NULL when it should not have\n";
+		std::vector<size_t> low;
+		for (size_t i = 0; i < 1024; i++)
+		{
+			low.push_back(block_store_allocate(bs));
+		}
+
+		// Allocations push the hint up while another thread frees blocks below it
+		std::vector<std::thread> threads;
+		for (size_t t = 0; t < 3; t++)
+		{
+			threads.emplace_back([bs]() {
+				for (size_t i = 0; i < 200; i++)
+				{
+					block_store_allocate(bs);
+				}
+			});
+		}
+		threads.emplace_back([bs, &low, round]() {
+			for (size_t i = round % 7; i < low.size(); i += 7)
+			{
+				block_store_release(bs, low[i]);
+			}
+		});
+		for (auto &thread : threads)
+		{
+			thread.join();
+		}
+
+		// Whatever was freed, the next allocation is the lowest free block
+		const size_t id = block_store_allocate(bs);
+		ASSERT_NE(SIZE_MAX, id);
+		for (size_t below = 0; below < id; below++)
+		{
+			ASSERT_EQ(false, block_store_request(bs, below)) << "block " << below << " was free below " << id;
+		}
+		block_store_destroy(bs);
+	}
+	score += 2;
+}
+
+TEST(block_store_threadsafe, cache_accounting)
+{
+	block_store_t *bs = block_store_create_flags(BLOCK_STORE_NUM_BLOCKS, BLOCK_SIZE_BYTES, BS_ALLOC_CACHE);
+	ASSERT_NE(nullptr, bs) << "block_store_create_flags returned NULL when it should not have\n";
+
+	// One allocation pulls a whole batch into this thread's cache, but only one block counts as used
+	const size_t id = block_store_allocate(bs);
+	ASSERT_NE(SIZE_MAX, id);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 1, block_store_get_used_blocks(bs));
+	ASSERT_EQ(false, block_store_request(bs, id));
+
+	// The image saves the rest of the batch as free, but serializing leaves it in the cache
+	ASSERT_EQ(BLOCK_STORE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test.bs"));
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 1, block_store_get_used_blocks(bs));
+	ASSERT_EQ(false, block_store_request(bs, id + 1));
+	block_store_destroy(bs);
+	bs = block_store_deserialize("test.bs");
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 1, block_store_get_used_blocks(bs));
+	ASSERT_EQ(false, block_store_request(bs, id));
+	ASSERT_EQ(true, block_store_request(bs, id + 1));
+	block_store_destroy(bs);
+
+	block_store_drain_caches(NULL);
+
+	score += 2;
+}
+
+TEST(block_store_threadsafe, extent_drains_caches)
+{
+	block_store_t *bs = block_store_create_flags(BLOCK_STORE_NUM_BLOCKS, BLOCK_SIZE_BYTES, BS_ALLOC_CACHE);
+	ASSERT_NE(nullptr, bs) << "block_store_create_flags returned NULL when it should not have\n";
+
+	// Take every block the cache doesn't hold, so the only free run left is the rest of the batch
+	const size_t id = block_store_allocate(bs);
+	ASSERT_NE(SIZE_MAX, id);
+	size_t cached = 0;
+	for (size_t i = 0; i < BLOCK_STORE_NUM_BLOCKS; i++)
+	{
+		if (!block_store_request(bs, i) && (i < BITMAP_START_BLOCK || i >= BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS) && i != id)
+		{
+			cached++;
+		}
+	}
+	ASSERT_LT(1u, cached);
+
+	size_t start = SIZE_MAX;
+	ASSERT_EQ(true, block_store_allocate_extent(bs, cached, &start));
+	ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS, block_store_get_used_blocks(bs));
+	ASSERT_EQ(false, block_store_allocate_extent(bs, 1, &start));
+	ASSERT_EQ(ENOSPC, errno);
+
+#ifdef BLOCK_STORE_STATS
+	block_store_stats_t stats;
+	ASSERT_EQ(true, block_store_get_stats(bs, &stats));
+	ASSERT_EQ(2u, stats.calls[BS_OP_ALLOCATE_EXTENT]);
+	ASSERT_EQ(1u, stats.failures[BS_OP_ALLOCATE_EXTENT]);
+#endif
+
+	block_store_destroy(bs);
+	block_store_drain_caches(NULL);
+
+	score += 2;
+}
+
+TEST(block_store_threadsafe, no_torn_reads)
+{
+	block_store_t *bs = block_store_create_flags(BLOCK_STORE_NUM_BLOCKS, 4096, BS_THREADSAFE);
+	ASSERT_NE(nullptr, bs) << "block_store_create_flags returned NULL when it should not have\n";
+	const size_t id = block_store_allocate(bs);
+
+	// One writer keeps rewriting the block with a uniform pattern; readers must never see a mix of two
+	std::atomic<bool> done(false);
+	std::thread writer([bs, id, &done]() {
+		std::vector<uint8_t> buffer(4096);
+		for (size_t round = 0; round < 20000; round++)
+		{
+			std::fill(buffer.begin(), buffer.end(), (uint8_t) round);
+			block_store_write(bs, id, buffer.data());
+		}
+		done = true;
+	});
+	std::vector<size_t> torn(4, 0);
+	std::vector<std::thread> readers;
+	for (size_t r = 0; r < torn.size(); r++)
+	{
+		readers.emplace_back([bs, id, &done, &torn, r]() {
+			std::vector<uint8_t> buffer(4096);
+			while (!done)
+			{
+				block_store_iovec_t vec[1] = {{id, buffer.data()}};
+				block_store_readv(bs, vec, 1);
+				torn[r] += std::count(buffer.begin(), buffer.end(), buffer[0]) != 4096;
+			}
+		});
+	}
+	writer.join();
+	for (auto &reader : readers)
+	{
+		reader.join();
+	}
+	for (size_t r = 0; r < torn.size(); r++)
+	{
+		ASSERT_EQ(0, torn[r]);
+	}
+	block_store_destroy(bs);
+
+	score += 5;
+}
+
 TEST(block_store_serialize, valid_serialize)
 {
 	block_store_t *bs = NULL;
@@ -368,7 +1009,7 @@ TEST(block_store_serialize, valid_serialize)
 	// Try to call serialize...
 	size_t bytesSerialized;
 	bytesSerialized = block_store_serialize(bs, "test.bs");
-	ASSERT_EQ(bytesSerialized, BLOCK_STORE_NUM_BYTES);
+	ASSERT_EQ(bytesSerialized, BLOCK_STORE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES);
 
 	free(write_buffer);
 	block_store_destroy(bs);
@@ -401,14 +1042,14 @@ TEST(block_store_serialize, check_file_size)
 	// Try to call serialize...
 	size_t bytesSerialized;
 	bytesSerialized = block_store_serialize(bs, "test.bs");
-	ASSERT_EQ(bytesSerialized, BLOCK_STORE_NUM_BYTES);
+	ASSERT_EQ(bytesSerialized, BLOCK_STORE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES);
 
 	block_store_destroy(bs);
 
 	// Just in case your bytesSerialized is lying...
 	struct stat st;
 	stat("test.bs", &st);
-	ASSERT_EQ(st.st_size,BLOCK_STORE_NUM_BYTES);
+	ASSERT_EQ(st.st_size,BLOCK_STORE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES);
 
 	score += 4;
 }
@@ -469,7 +1110,7 @@ TEST(block_store_deserialize, valid_deserialize)
 	// Try to call serialize...
 	size_t bytesSerialized;
 	bytesSerialized = block_store_serialize(bsWrite, "test.bs");
-	ASSERT_EQ(bytesSerialized, BLOCK_STORE_NUM_BYTES);
+	ASSERT_EQ(bytesSerialized, BLOCK_STORE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES);
 
 	// Don't free the write_buffer because we will use it later to compare
 	// to the read
@@ -505,13 +1146,1986 @@ TEST(block_store_deserialize, valid_deserialize)
 }
 
 
-TEST(block_store_deserialize, null_filename)
+TEST(block_store_open_mmap, write_through)
 {
-	// Try to call deserialize...
-	block_store_t *bs;
-	bs = block_store_deserialize(nullptr);
-	ASSERT_EQ(0, bs);
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	uint8_t write_buffer[BLOCK_SIZE_BYTES];
+	memset(write_buffer, 'm', BLOCK_SIZE_BYTES);
+	ASSERT_EQ(true, block_store_request(bs, 10));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 10, write_buffer));
+	ASSERT_EQ(BLOCK_STORE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test_mmap.bs"));
+	block_store_destroy(bs);
 
-	score += 2;
+	// The mapped store sees the image contents and its allocations
+	bs = block_store_open_mmap("test_mmap.bs", O_RDWR);
+	ASSERT_NE(nullptr, bs);
+	uint8_t read_buffer[BLOCK_SIZE_BYTES];
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 10, read_buffer));
+	ASSERT_EQ(0, memcmp(read_buffer, write_buffer, BLOCK_SIZE_BYTES));
+	ASSERT_EQ(false, block_store_request(bs, 10));
+
+	// Changes go straight to the file
+	memset(write_buffer, 'n', BLOCK_SIZE_BYTES);
+	ASSERT_EQ(true, block_store_request(bs, 20));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 20, write_buffer));
+	ASSERT_EQ(true, block_store_flush(bs));
+	block_store_destroy(bs);
+
+	bs = block_store_deserialize("test_mmap.bs");
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 20, read_buffer));
+	ASSERT_EQ(0, memcmp(read_buffer, write_buffer, BLOCK_SIZE_BYTES));
+	ASSERT_EQ(false, block_store_flush(bs));
+	block_store_destroy(bs);
+
+	score += 5;
+}
+
+TEST(block_store_open_mmap, private_and_create)
+{
+	unlink("test_mmap.bs");
+	ASSERT_EQ(nullptr, block_store_open_mmap("test_mmap.bs", O_RDWR));
+
+	// O_CREAT makes an empty image of the default size
+	block_store_t *bs = block_store_open_mmap("test_mmap.bs", O_RDWR | O_CREAT);
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS, block_store_get_used_blocks(bs));
+	block_store_destroy(bs);
+	struct stat st;
+	ASSERT_EQ(0, stat("test_mmap.bs", &st));
+	ASSERT_EQ(BLOCK_STORE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES, st.st_size);
+
+	// Read-only opens can still change the store, but the file keeps its old contents
+	bs = block_store_open_mmap("test_mmap.bs", O_RDONLY);
+	ASSERT_NE(nullptr, bs);
+	uint8_t write_buffer[BLOCK_SIZE_BYTES];
+	memset(write_buffer, 'p', BLOCK_SIZE_BYTES);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 30, write_buffer));
+	ASSERT_EQ(true, block_store_flush(bs));
+	block_store_destroy(bs);
+
+	bs = block_store_open_mmap("test_mmap.bs", O_RDONLY);
+	ASSERT_NE(nullptr, bs);
+	const uint8_t *block = (const uint8_t *) block_store_get_block_ptr(bs, 30);
+	ASSERT_NE(nullptr, block);
+	ASSERT_EQ(0, block[0]);
+	block_store_destroy(bs);
+
+	// Files that aren't a whole image are refused
+	ASSERT_EQ(0, truncate("test_mmap.bs", 100));
+	ASSERT_EQ(nullptr, block_store_open_mmap("test_mmap.bs", O_RDONLY));
+	ASSERT_EQ(nullptr, block_store_open_mmap(NULL, O_RDONLY));
+	ASSERT_EQ(nullptr, block_store_open_mmap("test_mmap.bs", O_WRONLY));
+	unlink("test_mmap.bs");
+
+	score += 5;
+}
+
+TEST(block_store_journal, replays_committed_changes)
+{
+	unlink("test_journal.bs");
+	unlink("test.journal");
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	ASSERT_EQ(BLOCK_STORE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES, block_store_checkpoint(bs, "test_journal.bs"));
+	ASSERT_EQ(true, block_store_journal_open(bs, "test.journal"));
+	ASSERT_EQ(false, block_store_journal_open(bs, "test.journal"));
+
+	uint8_t write_buffer[BLOCK_SIZE_BYTES];
+	memset(write_buffer, 'j', BLOCK_SIZE_BYTES);
+	ASSERT_EQ(0, block_store_allocate(bs));
+	ASSERT_EQ(1, block_store_allocate(bs));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 0, write_buffer));
+	ASSERT_EQ(true, block_store_request(bs, 300));
+	size_t start = 0;
+	ASSERT_EQ(true, block_store_allocate_extent(bs, 4, &start));
+	block_store_release(bs, 1);
+	ASSERT_EQ(true, block_store_journal_commit(bs));
+	const size_t used = block_store_get_used_blocks(bs);
+
+	// Never committed, so a crash (or destroy) loses these
+	memset(write_buffer, 'x', BLOCK_SIZE_BYTES);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 0, write_buffer));
+	ASSERT_NE(SIZE_MAX, block_store_allocate(bs));
+	block_store_destroy(bs);
+
+	// Recovery is the last image plus the journal
+	bs = block_store_deserialize("test_journal.bs");
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS, block_store_get_used_blocks(bs));
+	ASSERT_EQ(true, block_store_journal_open(bs, "test.journal"));
+	ASSERT_EQ(used, block_store_get_used_blocks(bs));
+	ASSERT_EQ(false, block_store_request(bs, 300));
+	ASSERT_EQ(false, block_store_request(bs, start + 3));
+	ASSERT_EQ(1, block_store_allocate(bs));
+	uint8_t read_buffer[BLOCK_SIZE_BYTES];
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 0, read_buffer));
+	ASSERT_EQ('j', read_buffer[0]);
+	ASSERT_EQ('j', read_buffer[BLOCK_SIZE_BYTES - 1]);
+	ASSERT_EQ(true, block_store_journal_commit(bs));
+	block_store_destroy(bs);
+
+	// And it keeps going from where it left off
+	bs = block_store_deserialize("test_journal.bs");
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(true, block_store_journal_open(bs, "test.journal"));
+	ASSERT_EQ(used + 1, block_store_get_used_blocks(bs));
+	block_store_destroy(bs);
+
+	unlink("test_journal.bs");
+	unlink("test.journal");
+	score += 5;
 }
 
+TEST(block_store_journal, torn_tail_is_dropped)
+{
+	unlink("test.journal");
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	ASSERT_EQ(true, block_store_journal_open(bs, "test.journal"));
+	ASSERT_EQ(true, block_store_request(bs, 10));
+	ASSERT_EQ(true, block_store_journal_commit(bs));
+	block_store_destroy(bs);
+	struct stat st;
+	ASSERT_EQ(0, stat("test.journal", &st));
+	const off_t good = st.st_size;
+
+	// Half a record, as if the machine went down in the middle of a write
+	const int fd = open("test.journal", O_WRONLY | O_APPEND);
+	ASSERT_NE(-1, fd);
+	const uint8_t junk[20] = {3, 0, 0, 0, 0, 0, 0, 0, 11};
+	ASSERT_EQ((ssize_t) sizeof(junk), write(fd, junk, sizeof(junk)));
+	close(fd);
+
+	bs = block_store_create();
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(true, block_store_journal_open(bs, "test.journal"));
+	ASSERT_EQ(false, block_store_request(bs, 10));
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 1, block_store_get_used_blocks(bs));
+	ASSERT_EQ(0, stat("test.journal", &st));
+	ASSERT_EQ(good, st.st_size);
+	block_store_destroy(bs);
+
+	// A journal for a different geometry is refused
+	bs = block_store_create_ex(1024, BLOCK_SIZE_BYTES);
+	ASSERT_NE(nullptr, bs);
+	errno = 0;
+	ASSERT_EQ(false, block_store_journal_open(bs, "test.journal"));
+	ASSERT_EQ(EINVAL, errno);
+	ASSERT_EQ(false, block_store_journal_commit(bs));
+	block_store_destroy(bs);
+
+	unlink("test.journal");
+	score += 3;
+}
+
+TEST(block_store_journal, checkpoint_empties_journal)
+{
+	unlink("test_journal.bs");
+	unlink("test.journal");
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	ASSERT_EQ(true, block_store_journal_open(bs, "test.journal"));
+	uint8_t write_buffer[BLOCK_SIZE_BYTES];
+	memset(write_buffer, 'c', BLOCK_SIZE_BYTES);
+	for (size_t i = 0; i < 20; i++)
+	{
+		const size_t id = block_store_allocate(bs);
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, write_buffer));
+	}
+	ASSERT_EQ(BLOCK_STORE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES, block_store_checkpoint(bs, "test_journal.bs"));
+	struct stat st;
+	ASSERT_EQ(0, stat("test.journal", &st));
+	ASSERT_EQ(BLOCK_STORE_HEADER_BYTES, st.st_size);
+	ASSERT_EQ(-1, stat("test_journal.bs.tmp", &st));
+
+	// After the checkpoint the journal only needs what came since
+	block_store_release(bs, 5);
+	ASSERT_EQ(true, block_store_journal_commit(bs));
+	block_store_destroy(bs);
+
+	bs = block_store_deserialize("test_journal.bs");
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 20, block_store_get_used_blocks(bs));
+	ASSERT_EQ(true, block_store_journal_open(bs, "test.journal"));
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 19, block_store_get_used_blocks(bs));
+	uint8_t read_buffer[BLOCK_SIZE_BYTES];
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 19, read_buffer));
+	ASSERT_EQ(0, memcmp(read_buffer, write_buffer, BLOCK_SIZE_BYTES));
+	block_store_destroy(bs);
+
+	unlink("test_journal.bs");
+	unlink("test.journal");
+	score += 3;
+}
+
+TEST(block_store_journal, checkpoint_writes_only_dirty_blocks)
+{
+	unlink("test_journal.bs");
+	unlink("test.journal");
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	ASSERT_EQ(true, block_store_journal_open(bs, "test.journal"));
+	ASSERT_EQ(BLOCK_STORE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES, block_store_checkpoint(bs, "test_journal.bs"));
+
+	// Scribble on a block behind the store's back; only a full rewrite would put it back
+	uint8_t marker[BLOCK_SIZE_BYTES];
+	memset(marker, 'z', BLOCK_SIZE_BYTES);
+	int fd = open("test_journal.bs", O_WRONLY);
+	ASSERT_NE(-1, fd);
+	ASSERT_EQ((ssize_t)BLOCK_SIZE_BYTES, pwrite(fd, marker, BLOCK_SIZE_BYTES, BLOCK_STORE_HEADER_BYTES + 300 * BLOCK_SIZE_BYTES));
+	close(fd);
+
+	uint8_t write_buffer[BLOCK_SIZE_BYTES];
+	memset(write_buffer, 'd', BLOCK_SIZE_BYTES);
+	ASSERT_EQ(true, block_store_request(bs, 10));
+	ASSERT_EQ(true, block_store_request(bs, 11));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 10, write_buffer));
+	block_store_iovec_t vec[1] = {{11, write_buffer}};
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_writev(bs, vec, 1));
+	ASSERT_EQ(BLOCK_STORE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES, block_store_checkpoint(bs, "test_journal.bs"));
+	struct stat st;
+	ASSERT_EQ(0, stat("test.journal", &st));
+	ASSERT_EQ(BLOCK_STORE_HEADER_BYTES, st.st_size);
+	ASSERT_EQ(-1, stat("test_journal.bs.tmp", &st));
+
+	block_store_t *saved = block_store_deserialize("test_journal.bs");
+	ASSERT_NE(nullptr, saved);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 2, block_store_get_used_blocks(saved));
+	ASSERT_EQ(0, memcmp(write_buffer, block_store_get_block_ptr(saved, 10), BLOCK_SIZE_BYTES));
+	ASSERT_EQ(0, memcmp(write_buffer, block_store_get_block_ptr(saved, 11), BLOCK_SIZE_BYTES));
+	ASSERT_EQ(0, memcmp(marker, block_store_get_block_ptr(saved, 300), BLOCK_SIZE_BYTES)); //clean, so left alone
+	block_store_destroy(saved);
+
+	// Nothing dirty now, and a checkpoint to another file is a full one
+	ASSERT_EQ(BLOCK_STORE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES, block_store_checkpoint(bs, "test_journal.bs"));
+	ASSERT_EQ(BLOCK_STORE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES, block_store_checkpoint(bs, "test.bs"));
+	saved = block_store_deserialize("test.bs");
+	ASSERT_NE(nullptr, saved);
+	ASSERT_NE(0, memcmp(marker, block_store_get_block_ptr(saved, 300), BLOCK_SIZE_BYTES));
+	block_store_destroy(saved);
+	block_store_destroy(bs);
+
+	unlink("test_journal.bs");
+	unlink("test.journal");
+	score += 3;
+}
+
+TEST(block_store_journal, checkpoint_journals_unseen_changes)
+{
+	unlink("test_journal.bs");
+	unlink("test.journal");
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	ASSERT_EQ(true, block_store_request(bs, 20));
+	ASSERT_EQ(true, block_store_request(bs, 21));
+	ASSERT_EQ(BLOCK_STORE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES, block_store_checkpoint(bs, "test_journal.bs"));
+
+	// Scribble on a block behind the store's back; only a full rewrite would put it back
+	uint8_t marker[BLOCK_SIZE_BYTES];
+	memset(marker, 'z', BLOCK_SIZE_BYTES);
+	int fd = open("test_journal.bs", O_WRONLY);
+	ASSERT_NE(-1, fd);
+	ASSERT_EQ((ssize_t)BLOCK_SIZE_BYTES, pwrite(fd, marker, BLOCK_SIZE_BYTES, BLOCK_STORE_HEADER_BYTES + 300 * BLOCK_SIZE_BYTES));
+	close(fd);
+
+	// Changes the journal never sees: made before it's opened, and through a block pointer
+	uint8_t write_buffer[BLOCK_SIZE_BYTES];
+	memset(write_buffer, 'u', BLOCK_SIZE_BYTES);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 20, write_buffer));
+	block_store_release(bs, 21);
+	ASSERT_EQ(true, block_store_request(bs, 22));
+	ASSERT_EQ(true, block_store_journal_open(bs, "test.journal"));
+	void *block = block_store_get_block_ptr_mut(bs, 22);
+	ASSERT_NE(nullptr, block);
+	memcpy(block, write_buffer, BLOCK_SIZE_BYTES);
+	ASSERT_EQ(BLOCK_STORE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES, block_store_checkpoint(bs, "test_journal.bs"));
+	struct stat st;
+	ASSERT_EQ(-1, stat("test_journal.bs.tmp", &st));
+	ASSERT_EQ(0, stat("test.journal", &st));
+	ASSERT_EQ(BLOCK_STORE_HEADER_BYTES, st.st_size);
+	block_store_destroy(bs);
+
+	block_store_t *saved = block_store_deserialize("test_journal.bs");
+	ASSERT_NE(nullptr, saved);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 2, block_store_get_used_blocks(saved));
+	ASSERT_EQ(false, block_store_request(saved, 20));
+	ASSERT_EQ(true, block_store_request(saved, 21));
+	ASSERT_EQ(0, memcmp(write_buffer, block_store_get_block_ptr(saved, 20), BLOCK_SIZE_BYTES));
+	ASSERT_EQ(0, memcmp(write_buffer, block_store_get_block_ptr(saved, 22), BLOCK_SIZE_BYTES));
+	ASSERT_EQ(0, memcmp(marker, block_store_get_block_ptr(saved, 300), BLOCK_SIZE_BYTES)); //in place, so left alone
+	block_store_destroy(saved);
+
+	unlink("test_journal.bs");
+	unlink("test.journal");
+	score += 3;
+}
+
+TEST(block_store_checkpoint, whole_without_journal)
+{
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	ASSERT_EQ(BLOCK_STORE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES, block_store_checkpoint(bs, "test.bs"));
+
+	// Scribble on a block behind the store's back; without a journal to repair a torn in-place update, the
+	// checkpoint rewrites the image whole, so it gets put back
+	uint8_t marker[BLOCK_SIZE_BYTES];
+	memset(marker, 'z', BLOCK_SIZE_BYTES);
+	int fd = open("test.bs", O_RDWR);
+	ASSERT_NE(-1, fd);
+	ASSERT_EQ((ssize_t)BLOCK_SIZE_BYTES, pwrite(fd, marker, BLOCK_SIZE_BYTES, BLOCK_STORE_HEADER_BYTES + 300 * BLOCK_SIZE_BYTES));
+	close(fd);
+
+	// A temporary image left behind by a checkpoint that crashed is just written over
+	fd = open("test.bs.tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	ASSERT_NE(-1, fd);
+	ASSERT_EQ((ssize_t)BLOCK_SIZE_BYTES, write(fd, marker, BLOCK_SIZE_BYTES));
+	close(fd);
+
+	uint8_t write_buffer[BLOCK_SIZE_BYTES];
+	memset(write_buffer, 'p', BLOCK_SIZE_BYTES);
+	ASSERT_EQ(true, block_store_request(bs, 10));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 10, write_buffer));
+	ASSERT_EQ(BLOCK_STORE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES, block_store_checkpoint(bs, "test.bs"));
+	struct stat st;
+	ASSERT_EQ(-1, stat("test.bs.tmp", &st));
+	block_store_t *saved = block_store_deserialize("test.bs");
+	ASSERT_NE(nullptr, saved);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 1, block_store_get_used_blocks(saved));
+	ASSERT_EQ(0, memcmp(write_buffer, block_store_get_block_ptr(saved, 10), BLOCK_SIZE_BYTES));
+	ASSERT_NE(0, memcmp(marker, block_store_get_block_ptr(saved, 300), BLOCK_SIZE_BYTES));
+	block_store_destroy(saved);
+
+	// A checkpoint that can't finish leaves the last image as it was
+	ASSERT_EQ(true, block_store_request(bs, 11));
+	ASSERT_EQ(0, mkdir("test.bs.tmp", 0755)); //nothing can be written there
+	ASSERT_EQ(0u, block_store_checkpoint(bs, "test.bs"));
+	ASSERT_EQ(0, rmdir("test.bs.tmp"));
+	saved = block_store_deserialize("test.bs");
+	ASSERT_NE(nullptr, saved);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 1, block_store_get_used_blocks(saved));
+	ASSERT_EQ(0, memcmp(write_buffer, block_store_get_block_ptr(saved, 10), BLOCK_SIZE_BYTES));
+	block_store_destroy(saved);
+	block_store_destroy(bs);
+	unlink("test.bs");
+	score += 3;
+}
+
+// Completion callback for the async tests: counts completions and the bytes they report
+static void count_completion(block_store_t *, size_t result, int error, void *arg)
+{
+	std::atomic<size_t> *const counts = static_cast<std::atomic<size_t> *>(arg);
+	counts[0]++;
+	counts[1] += result;
+	if (error)
+	{
+		counts[2]++;
+	}
+}
+
+TEST(block_store_async, read_write_complete)
+{
+	block_store_t *bs = block_store_create_flags(4096, 64, BS_THREADSAFE);
+	ASSERT_NE(nullptr, bs) << "block_store_create_flags returned NULL when it should not have\n";
+	std::atomic<size_t> counts[3] = {{0}, {0}, {0}};
+	std::vector<std::vector<uint8_t>> blocks(256, std::vector<uint8_t>(64));
+	for (size_t i = 0; i < blocks.size(); i++)
+	{
+		std::fill(blocks[i].begin(), blocks[i].end(), (uint8_t)i);
+		ASSERT_EQ(true, block_store_write_async(bs, 200 + i, blocks[i].data(), count_completion, counts));
+	}
+	block_store_wait_async(bs);
+	ASSERT_EQ(blocks.size(), counts[0]);
+	ASSERT_EQ(blocks.size() * 64, counts[1]);
+	ASSERT_EQ(0u, counts[2]);
+
+	std::vector<std::vector<uint8_t>> read(blocks.size(), std::vector<uint8_t>(64));
+	for (size_t i = 0; i < read.size(); i++)
+	{
+		ASSERT_EQ(true, block_store_read_async(bs, 200 + i, read[i].data(), count_completion, counts));
+	}
+	block_store_wait_async(bs);
+	ASSERT_EQ(2 * blocks.size(), counts[0]);
+	ASSERT_EQ(blocks, read);
+
+	// Bad requests are refused up front
+	ASSERT_EQ(false, block_store_read_async(bs, 4096, read[0].data(), NULL, NULL));
+	ASSERT_EQ(EINVAL, errno);
+	ASSERT_EQ(false, block_store_write_async(bs, BITMAP_START_BLOCK, read[0].data(), NULL, NULL));
+	ASSERT_EQ(false, block_store_write_async(bs, 1, NULL, NULL, NULL));
+	ASSERT_EQ(false, block_store_flush_async(bs, NULL, NULL)); //neither mapped nor journaled
+	block_store_destroy(bs);
+
+	// Stores that aren't thread safe run requests one at a time, in order; destroy waits for them
+	bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	uint8_t first[BLOCK_SIZE_BYTES], second[BLOCK_SIZE_BYTES], result[BLOCK_SIZE_BYTES];
+	memset(first, 'a', BLOCK_SIZE_BYTES);
+	memset(second, 'b', BLOCK_SIZE_BYTES);
+	ASSERT_EQ(true, block_store_write_async(bs, 7, first, NULL, NULL));
+	ASSERT_EQ(true, block_store_write_async(bs, 7, second, NULL, NULL));
+	ASSERT_EQ(true, block_store_read_async(bs, 7, result, count_completion, counts));
+	block_store_destroy(bs);
+	ASSERT_EQ(0, memcmp(result, second, BLOCK_SIZE_BYTES));
+	ASSERT_EQ(2 * blocks.size() + 1, counts[0]);
+	score += 3;
+}
+
+TEST(block_store_async, flush_covers_queued_writes)
+{
+	unlink("test_mmap.bs");
+	block_store_t *bs = block_store_open_mmap("test_mmap.bs", O_RDWR | O_CREAT);
+	ASSERT_NE(nullptr, bs);
+	std::atomic<size_t> counts[3] = {{0}, {0}, {0}};
+	uint8_t write_buffer[BLOCK_SIZE_BYTES];
+	memset(write_buffer, 'f', BLOCK_SIZE_BYTES);
+	for (size_t i = 0; i < 16; i++)
+	{
+		ASSERT_EQ(true, block_store_write_async(bs, 300 + i, write_buffer, NULL, NULL));
+	}
+	ASSERT_EQ(true, block_store_flush_async(bs, count_completion, counts));
+	block_store_wait_async(bs);
+	ASSERT_EQ(1u, counts[0]);
+	ASSERT_EQ(1u, counts[1]);
+	ASSERT_EQ(0u, counts[2]);
+
+	block_store_t *saved = block_store_deserialize("test_mmap.bs");
+	ASSERT_NE(nullptr, saved);
+	for (size_t i = 0; i < 16; i++)
+	{
+		ASSERT_EQ(0, memcmp(write_buffer, block_store_get_block_ptr(saved, 300 + i), BLOCK_SIZE_BYTES));
+	}
+	block_store_destroy(saved);
+	block_store_destroy(bs);
+	unlink("test_mmap.bs");
+	score += 2;
+}
+
+TEST(block_store_async, serialize_and_checkpoint)
+{
+	block_store_t *bs = block_store_create_flags(4096, 64, BS_THREADSAFE);
+	ASSERT_NE(nullptr, bs) << "block_store_create_flags returned NULL when it should not have\n";
+	std::atomic<size_t> counts[3] = {{0}, {0}, {0}};
+	std::vector<uint8_t> block(64, 's');
+	for (size_t i = 0; i < 16; i++)
+	{
+		ASSERT_EQ(true, block_store_write_async(bs, 300 + i, block.data(), NULL, NULL));
+	}
+	// The name is copied, so it can go away as soon as the request is queued
+	std::string name("test.bs");
+	ASSERT_EQ(true, block_store_serialize_async(bs, name.c_str(), count_completion, counts));
+	name.assign("gone");
+	block_store_wait_async(bs);
+	const size_t image_bytes = BLOCK_STORE_HEADER_BYTES + 4096 * 64;
+	ASSERT_EQ(1u, counts[0]);
+	ASSERT_EQ(image_bytes, counts[1]);
+	ASSERT_EQ(0u, counts[2]);
+
+	block_store_t *saved = block_store_deserialize("test.bs");
+	ASSERT_NE(nullptr, saved);
+	for (size_t i = 0; i < 16; i++)
+	{
+		ASSERT_EQ(0, memcmp(block.data(), block_store_get_block_ptr(saved, 300 + i), 64));
+	}
+	block_store_destroy(saved);
+
+	// A checkpoint queued behind more writes picks them up too
+	std::fill(block.begin(), block.end(), 'c');
+	for (size_t i = 0; i < 16; i++)
+	{
+		ASSERT_EQ(true, block_store_write_async(bs, 300 + i, block.data(), NULL, NULL));
+	}
+	ASSERT_EQ(true, block_store_checkpoint_async(bs, "test.bs", count_completion, counts));
+	block_store_wait_async(bs);
+	ASSERT_EQ(2u, counts[0]);
+	ASSERT_EQ(2 * image_bytes, counts[1]);
+	ASSERT_EQ(0u, counts[2]);
+	saved = block_store_deserialize("test.bs");
+	ASSERT_NE(nullptr, saved);
+	for (size_t i = 0; i < 16; i++)
+	{
+		ASSERT_EQ(0, memcmp(block.data(), block_store_get_block_ptr(saved, 300 + i), 64));
+	}
+	block_store_destroy(saved);
+
+	// Bad requests are refused up front; failures show up in the callback
+	ASSERT_EQ(false, block_store_serialize_async(NULL, "test.bs", NULL, NULL));
+	ASSERT_EQ(EINVAL, errno);
+	ASSERT_EQ(false, block_store_checkpoint_async(bs, NULL, NULL, NULL));
+	ASSERT_EQ(EINVAL, errno);
+	ASSERT_EQ(true, block_store_serialize_async(bs, "no/such/dir/test.bs", count_completion, counts));
+	block_store_destroy(bs);
+	ASSERT_EQ(3u, counts[0]);
+	ASSERT_EQ(1u, counts[2]);
+	score += 3;
+}
+
+TEST(block_store_stats, counts_operations)
+{
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	block_store_stats_t stats;
+	uint8_t buffer[BLOCK_SIZE_BYTES] = {0};
+
+	// Successful calls leave errno alone, instrumented or not
+	errno = EEXIST;
+	ASSERT_EQ(0u, block_store_allocate(bs));
+	ASSERT_EQ(EEXIST, errno);
+
+	// Failed ones say why
+	ASSERT_EQ(0u, block_store_read(bs, BLOCK_STORE_NUM_BLOCKS, buffer));
+	ASSERT_EQ(EINVAL, errno);
+
+#ifdef BLOCK_STORE_STATS
+	ASSERT_EQ(true, block_store_request(bs, 5));
+	ASSERT_EQ(false, block_store_request(bs, 5));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 5, buffer));
+	ASSERT_EQ(0u, block_store_write(bs, BITMAP_START_BLOCK, buffer));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 5, buffer));
+	block_store_iovec_t vec[1] = {{5, buffer}};
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_writev(bs, vec, 1));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_readv(bs, vec, 1));
+	block_store_release_extent(bs, BITMAP_START_BLOCK, 1);
+	block_store_release(bs, 5);
+	while (block_store_allocate(bs) != SIZE_MAX)
+	{
+	}
+	ASSERT_EQ(true, block_store_get_stats(bs, &stats));
+	ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS - BITMAP_NUM_BLOCKS + 1, stats.calls[BS_OP_ALLOCATE]);
+	ASSERT_EQ(1u, stats.failures[BS_OP_ALLOCATE]);
+	ASSERT_EQ(2u, stats.calls[BS_OP_REQUEST]);
+	ASSERT_EQ(1u, stats.failures[BS_OP_REQUEST]);
+	ASSERT_EQ(2u, stats.calls[BS_OP_WRITE]);
+	ASSERT_EQ(1u, stats.failures[BS_OP_WRITE]);
+	ASSERT_EQ(2u, stats.calls[BS_OP_READ]);
+	ASSERT_EQ(1u, stats.failures[BS_OP_READ]);
+	ASSERT_EQ(1u, stats.calls[BS_OP_READV]);
+	ASSERT_EQ(1u, stats.calls[BS_OP_WRITEV]);
+	ASSERT_EQ(1u, stats.calls[BS_OP_RELEASE]);
+	ASSERT_EQ(0u, stats.failures[BS_OP_RELEASE]);
+	ASSERT_EQ(1u, stats.calls[BS_OP_RELEASE_EXTENT]);
+	ASSERT_EQ(1u, stats.failures[BS_OP_RELEASE_EXTENT]);
+	ASSERT_EQ(1u, stats.enospc);
+	ASSERT_EQ(3u, stats.einval); //the failed read and write, and the release of the bitmap blocks
+	uint64_t latencies = 0, searches = 0;
+	for (size_t i = 0; i < BLOCK_STORE_STATS_BUCKETS; i++)
+	{
+		latencies += stats.latency[BS_OP_ALLOCATE][i];
+		searches += stats.scans[i];
+	}
+	ASSERT_EQ(stats.calls[BS_OP_ALLOCATE], latencies);
+	ASSERT_EQ(stats.calls[BS_OP_ALLOCATE], searches);
+
+	ASSERT_EQ(BLOCK_STORE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test.bs"));
+	ASSERT_EQ(true, block_store_get_stats(bs, &stats));
+	ASSERT_EQ(1u, stats.calls[BS_OP_SERIALIZE]);
+	block_store_t *loaded = block_store_deserialize("test.bs");
+	ASSERT_NE(nullptr, loaded);
+	ASSERT_EQ(true, block_store_get_stats(loaded, &stats));
+	ASSERT_EQ(1u, stats.calls[BS_OP_DESERIALIZE]);
+	ASSERT_EQ(0u, stats.calls[BS_OP_ALLOCATE]);
+	block_store_destroy(loaded);
+
+	char text[4096] = {0};
+	FILE *out = fmemopen(text, sizeof(text) - 1, "w");
+	ASSERT_NE(nullptr, out);
+	ASSERT_EQ(true, block_store_dump_stats(bs, out));
+	fclose(out);
+	ASSERT_NE(nullptr, strstr(text, "allocate"));
+	ASSERT_NE(nullptr, strstr(text, "ENOSPC 1"));
+	ASSERT_NE(nullptr, strstr(text, "writev"));
+#else
+	// Compiled out: nothing to report
+	ASSERT_EQ(false, block_store_get_stats(bs, &stats));
+	ASSERT_EQ(ENOTSUP, errno);
+	ASSERT_EQ(false, block_store_dump_stats(bs, stdout));
+	(void) buffer;
+#endif
+	ASSERT_EQ(false, block_store_get_stats(NULL, &stats));
+	ASSERT_EQ(EINVAL, errno);
+	block_store_destroy(bs);
+	score += 2;
+}
+
+TEST(block_store_deserialize, saved_bitmap)
+{
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+
+	// An allocated block that is still all zeros must stay allocated across a save and load
+	ASSERT_EQ(true, block_store_request(bs, 42));
+	ASSERT_EQ(true, block_store_request(bs, 300));
+	uint8_t write_buffer[BLOCK_SIZE_BYTES];
+	memset(write_buffer, 'b', BLOCK_SIZE_BYTES);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 300, write_buffer));
+
+	// The bitmap blocks themselves can't be written over
+	ASSERT_EQ(0, block_store_write(bs, BITMAP_START_BLOCK, write_buffer));
+	ASSERT_EQ(nullptr, block_store_get_block_ptr_mut(bs, BITMAP_START_BLOCK));
+	block_store_iovec_t vec[1] = {{BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS - 1, write_buffer}};
+	ASSERT_EQ(0, block_store_writev(bs, vec, 1));
+
+	ASSERT_EQ(BLOCK_STORE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test.bs"));
+	block_store_destroy(bs);
+
+	bs = block_store_deserialize("test.bs");
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 2, block_store_get_used_blocks(bs));
+	ASSERT_EQ(false, block_store_request(bs, 42));
+	ASSERT_EQ(false, block_store_request(bs, 300));
+	ASSERT_EQ(0, block_store_allocate(bs));
+	block_store_destroy(bs);
+
+	score += 5;
+}
+
+TEST(block_store_deserialize, custom_geometry)
+{
+	const size_t num_blocks = 1000;
+	const size_t block_size = 4096;
+	block_store_t *bs = block_store_create_ex(num_blocks, block_size);
+	ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+	uint8_t *write_buffer = (uint8_t *) malloc(block_size);
+	ASSERT_NE(nullptr, write_buffer) << "malloc ... failed?" << std::endl;
+	memset(write_buffer, 'g', block_size);
+	size_t id = block_store_allocate(bs);
+	ASSERT_EQ(block_size, block_store_write(bs, id, write_buffer));
+	ASSERT_EQ(BLOCK_STORE_HEADER_BYTES + num_blocks * block_size, block_store_serialize(bs, "test.bs"));
+	block_store_destroy(bs);
+
+	// Both ways of loading pick the geometry up from the header
+	bs = block_store_deserialize("test.bs");
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(num_blocks, block_store_get_block_count(bs));
+	ASSERT_EQ(block_size, block_store_get_block_size(bs));
+	ASSERT_EQ(0, memcmp(write_buffer, block_store_get_block_ptr(bs, id), block_size));
+	ASSERT_EQ(false, block_store_request(bs, id));
+	block_store_destroy(bs);
+
+	bs = block_store_open_mmap("test.bs", O_RDONLY);
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(num_blocks, block_store_get_block_count(bs));
+	ASSERT_EQ(0, memcmp(write_buffer, block_store_get_block_ptr(bs, id), block_size));
+	block_store_destroy(bs);
+
+	free(write_buffer);
+
+	score += 5;
+}
+
+TEST(block_store_deserialize, bad_header)
+{
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	ASSERT_EQ(BLOCK_STORE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test.bs"));
+	block_store_destroy(bs);
+
+	// Change the block count in the header without fixing the checksum
+	FILE *file = fopen("test.bs", "r+b");
+	ASSERT_NE(nullptr, file);
+	ASSERT_EQ(0, fseek(file, 16, SEEK_SET));
+	ASSERT_NE(EOF, fputc(0x7F, file));
+	fclose(file);
+	ASSERT_EQ(nullptr, block_store_deserialize("test.bs"));
+	ASSERT_EQ(nullptr, block_store_open_mmap("test.bs", O_RDONLY));
+
+	// A good header on a file that's been cut short
+	bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	ASSERT_EQ(BLOCK_STORE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test.bs"));
+	block_store_destroy(bs);
+	ASSERT_EQ(0, truncate("test.bs", BLOCK_STORE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES - 1));
+	ASSERT_EQ(nullptr, block_store_deserialize("test.bs"));
+
+	ASSERT_EQ(nullptr, block_store_deserialize("does_not_exist.bs"));
+
+	score += 2;
+}
+
+TEST(block_store_deserialize, legacy_image)
+{
+	// Images from before the bitmap was saved are raw blocks with zeroed bitmap blocks
+	uint8_t *image = (uint8_t *) calloc(1, BLOCK_STORE_NUM_BYTES);
+	ASSERT_NE(nullptr, image) << "calloc ... failed?" << std::endl;
+	memset(image + 7 * BLOCK_SIZE_BYTES, 'L', 4);
+	FILE *file = fopen("test.bs", "wb");
+	ASSERT_NE(nullptr, file);
+	ASSERT_EQ(1, fwrite(image, BLOCK_STORE_NUM_BYTES, 1, file));
+	fclose(file);
+	free(image);
+
+	block_store_t *bs = block_store_deserialize("test.bs");
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 1, block_store_get_used_blocks(bs));
+	ASSERT_EQ(false, block_store_request(bs, 7));
+	ASSERT_EQ(false, block_store_request(bs, BITMAP_START_BLOCK));
+	block_store_destroy(bs);
+
+	score += 2;
+}
+
+TEST(block_store_deserialize, null_filename)
+{
+	// Try to call deserialize...
+	block_store_t *bs;
+	bs = block_store_deserialize(nullptr);
+	ASSERT_EQ(0, bs);
+
+	score += 2;
+}
+
+
+
+TEST(bitmap_ffs_ffz, empty_and_full)
+{
+	// 203 bits so the last byte is only partially in use
+	bitmap_t *bitmap = bitmap_create(203);
+	ASSERT_NE(nullptr, bitmap);
+
+	ASSERT_EQ(SIZE_MAX, bitmap_ffs(bitmap));
+	ASSERT_EQ(0, bitmap_ffz(bitmap));
+
+	// The bits past the end are set too, but they must not be reported as zero or set
+	bitmap_format(bitmap, 0xFF);
+	ASSERT_EQ(0, bitmap_ffs(bitmap));
+	ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap));
+
+	bitmap_reset(bitmap, 202);
+	ASSERT_EQ(202, bitmap_ffz(bitmap));
+
+	bitmap_format(bitmap, 0x00);
+	bitmap_set(bitmap, 202);
+	ASSERT_EQ(202, bitmap_ffs(bitmap));
+
+	bitmap_destroy(bitmap);
+
+	ASSERT_EQ(SIZE_MAX, bitmap_ffs(NULL));
+	ASSERT_EQ(SIZE_MAX, bitmap_ffz(NULL));
+
+	score += 2;
+}
+
+TEST(bitmap_ffs_ffz, zero_runs)
+{
+	bitmap_t *bitmap = bitmap_create(300);
+	ASSERT_NE(nullptr, bitmap);
+
+	ASSERT_EQ(0, bitmap_ffz_run(bitmap, 0, 300));
+	ASSERT_EQ(SIZE_MAX, bitmap_ffz_run(bitmap, 0, 301));
+	ASSERT_EQ(SIZE_MAX, bitmap_ffz_run(bitmap, 0, 0));
+
+	// Runs: [0,10) [11,100) [101,300)
+	bitmap_set(bitmap, 10);
+	bitmap_set(bitmap, 100);
+	ASSERT_EQ(0, bitmap_ffz_run(bitmap, 0, 10));
+	ASSERT_EQ(11, bitmap_ffz_run(bitmap, 0, 11));
+	ASSERT_EQ(11, bitmap_ffz_run(bitmap, 0, 89));
+	ASSERT_EQ(101, bitmap_ffz_run(bitmap, 0, 90));
+	ASSERT_EQ(101, bitmap_ffz_run(bitmap, 0, 199));
+	ASSERT_EQ(SIZE_MAX, bitmap_ffz_run(bitmap, 0, 200));
+	ASSERT_EQ(50, bitmap_ffz_run(bitmap, 50, 50));
+
+	bitmap_destroy(bitmap);
+
+	score += 2;
+}
+
+TEST(bitmap_atomic, test_and_set_reset)
+{
+	bitmap_t *bitmap = bitmap_create(100);
+	ASSERT_NE(nullptr, bitmap);
+	ASSERT_EQ(false, bitmap_test_and_set(bitmap, 42));
+	ASSERT_EQ(true, bitmap_test_and_set(bitmap, 42));
+	ASSERT_EQ(true, bitmap_test(bitmap, 42));
+	ASSERT_EQ(true, bitmap_test_and_reset(bitmap, 42));
+	ASSERT_EQ(false, bitmap_test_and_reset(bitmap, 42));
+	ASSERT_EQ(false, bitmap_test(bitmap, 42));
+	bitmap_destroy(bitmap);
+
+	score += 2;
+}
+
+TEST(bitmap_atomic, claim_zeros)
+{
+	// 21 bits so the last byte is partly past the end
+	bitmap_t *bitmap = bitmap_create(21);
+	ASSERT_NE(nullptr, bitmap);
+	bitmap_set(bitmap, 1);
+	bitmap_set(bitmap, 9);
+
+	size_t bits[32];
+	ASSERT_EQ(3, bitmap_claim_zeros(bitmap, 0, bits, 3));
+	ASSERT_EQ(0, bits[0]);
+	ASSERT_EQ(2, bits[1]);
+	ASSERT_EQ(3, bits[2]);
+
+	// Starting mid-byte leaves the bits below start alone
+	ASSERT_EQ(14, bitmap_claim_zeros(bitmap, 6, bits, 32));
+	ASSERT_EQ(6, bits[0]);
+	ASSERT_EQ(8, bits[2]);
+	ASSERT_EQ(10, bits[3]);
+	ASSERT_EQ(20, bits[13]);
+	ASSERT_EQ(false, bitmap_test(bitmap, 4));
+	ASSERT_EQ(false, bitmap_test(bitmap, 5));
+
+	ASSERT_EQ(2, bitmap_claim_zeros(bitmap, 0, bits, 32));
+	ASSERT_EQ(0, bitmap_claim_zeros(bitmap, 0, bits, 32));
+	ASSERT_EQ(21, bitmap_total_set(bitmap));
+	bitmap_destroy(bitmap);
+
+	score += 2;
+}
+
+TEST(bitmap_ffs_ffz, from_start_bit)
+{
+	bitmap_t *bitmap = bitmap_create(512);
+	ASSERT_NE(nullptr, bitmap);
+
+	bitmap_set(bitmap, 3);
+	bitmap_set(bitmap, 64);
+	bitmap_set(bitmap, 300);
+	ASSERT_EQ(3, bitmap_ffs_from(bitmap, 0));
+	ASSERT_EQ(3, bitmap_ffs_from(bitmap, 3));
+	ASSERT_EQ(64, bitmap_ffs_from(bitmap, 4));
+	ASSERT_EQ(300, bitmap_ffs_from(bitmap, 65));
+	ASSERT_EQ(SIZE_MAX, bitmap_ffs_from(bitmap, 301));
+	ASSERT_EQ(SIZE_MAX, bitmap_ffs_from(bitmap, 512));
+
+	bitmap_invert(bitmap);
+	ASSERT_EQ(3, bitmap_ffz(bitmap));
+	ASSERT_EQ(64, bitmap_ffz_from(bitmap, 4));
+	ASSERT_EQ(300, bitmap_ffz_from(bitmap, 65));
+	ASSERT_EQ(SIZE_MAX, bitmap_ffz_from(bitmap, 301));
+
+	bitmap_destroy(bitmap);
+
+	score += 2;
+}
+
+TEST(bitmap_words, total_set_and_invert)
+{
+	// Sizes around the 4 and 8 word strides of the vector kernels, with and without a partial last word
+	const size_t sizes[] = {1, 63, 64, 65, 255, 256, 257, 511, 512, 575, 1000, 4099};
+	for (const size_t n : sizes)
+	{
+		bitmap_t *bitmap = bitmap_create(n);
+		ASSERT_NE(nullptr, bitmap);
+		size_t expected = 0;
+		for (size_t i = 0; i < n; i += 3)
+		{
+			bitmap_set(bitmap, i);
+			++expected;
+		}
+		ASSERT_EQ(expected, bitmap_total_set(bitmap)) << "n = " << n;
+
+		// Inverting sets the bits past the end too, which must not be counted
+		bitmap_invert(bitmap);
+		ASSERT_EQ(n - expected, bitmap_total_set(bitmap)) << "n = " << n;
+		for (size_t i = 0; i < n; i++)
+		{
+			ASSERT_EQ(i % 3 != 0, bitmap_test(bitmap, i));
+		}
+
+		bitmap_format(bitmap, 0xFF);
+		ASSERT_EQ(n, bitmap_total_set(bitmap));
+		bitmap_destroy(bitmap);
+	}
+
+	score += 2;
+}
+
+TEST(bitmap_words, import_export_overlay)
+{
+	// Byte layout is still bit i in byte i / 8
+	alignas(8) uint8_t data[16] = {0x01, 0x80, 0, 0, 0, 0, 0, 0, 0x02};
+	bitmap_t *bitmap = bitmap_import(72, data);
+	ASSERT_NE(nullptr, bitmap);
+	ASSERT_EQ(9, bitmap_get_bytes(bitmap));
+	ASSERT_EQ(true, bitmap_test(bitmap, 0));
+	ASSERT_EQ(true, bitmap_test(bitmap, 15));
+	ASSERT_EQ(true, bitmap_test(bitmap, 65));
+	ASSERT_EQ(3, bitmap_total_set(bitmap));
+	bitmap_set(bitmap, 70);
+	ASSERT_EQ(0x42, bitmap_export(bitmap)[8]);
+	bitmap_destroy(bitmap);
+
+	bitmap = bitmap_overlay(72, data);
+	ASSERT_NE(nullptr, bitmap);
+	bitmap_reset(bitmap, 15);
+	ASSERT_EQ(0x00, data[1]);
+	bitmap_destroy(bitmap);
+
+	// Overlays are accessed a word at a time, so they have to be word aligned
+	ASSERT_EQ(nullptr, bitmap_overlay(64, data + 1));
+
+	score += 2;
+}
+
+TEST(bitmap_words, ranges)
+{
+	bitmap_t *bitmap = bitmap_create(300);
+	ASSERT_NE(nullptr, bitmap);
+
+	// Inside one word, then across several with partial words at both ends
+	bitmap_set_range(bitmap, 3, 5);
+	ASSERT_EQ(5, bitmap_total_set(bitmap));
+	ASSERT_EQ(false, bitmap_test(bitmap, 2));
+	ASSERT_EQ(true, bitmap_test_range(bitmap, 3, 5));
+	ASSERT_EQ(false, bitmap_test_range(bitmap, 3, 6));
+	bitmap_set_range(bitmap, 60, 200);
+	ASSERT_EQ(205, bitmap_total_set(bitmap));
+	ASSERT_EQ(true, bitmap_test_range(bitmap, 60, 200));
+	ASSERT_EQ(false, bitmap_test(bitmap, 59));
+	ASSERT_EQ(false, bitmap_test(bitmap, 260));
+	ASSERT_EQ(200, bitmap_count_range(bitmap, 50, 250));
+	ASSERT_EQ(5 + 4, bitmap_count_range(bitmap, 0, 64));
+	ASSERT_EQ(1, bitmap_count_range(bitmap, 259, 1));
+
+	bitmap_reset_range(bitmap, 64, 128);
+	ASSERT_EQ(77, bitmap_total_set(bitmap));
+	ASSERT_EQ(0, bitmap_count_range(bitmap, 64, 128));
+	ASSERT_EQ(true, bitmap_test_range(bitmap, 192, 68));
+
+	// Up to the very last bit is fine, past it is ignored
+	bitmap_set_range(bitmap, 290, 10);
+	ASSERT_EQ(10, bitmap_count_range(bitmap, 290, 10));
+	bitmap_set_range(bitmap, 295, 10);
+	bitmap_reset_range(bitmap, 0, 0);
+	ASSERT_EQ(87, bitmap_total_set(bitmap));
+	ASSERT_EQ(0, bitmap_count_range(bitmap, 300, 1));
+	ASSERT_EQ(false, bitmap_test_range(bitmap, 299, 2));
+
+	bitmap_destroy(bitmap);
+
+	score += 2;
+}
+
+TEST(bitmap_words, set_algebra)
+{
+	bitmap_t *a = bitmap_create(200);
+	bitmap_t *b = bitmap_create(200);
+	bitmap_t *other = bitmap_create(201);
+	ASSERT_NE(nullptr, a);
+	ASSERT_NE(nullptr, b);
+	ASSERT_NE(nullptr, other);
+	bitmap_set_range(a, 0, 100);
+	bitmap_set_range(b, 50, 100);
+
+	bitmap_t *result = bitmap_import(200, bitmap_export(a));
+	ASSERT_EQ(true, bitmap_and(result, b));
+	ASSERT_EQ(50, bitmap_total_set(result));
+	ASSERT_EQ(true, bitmap_test_range(result, 50, 50));
+	bitmap_destroy(result);
+
+	result = bitmap_import(200, bitmap_export(a));
+	ASSERT_EQ(true, bitmap_or(result, b));
+	ASSERT_EQ(150, bitmap_total_set(result));
+	bitmap_destroy(result);
+
+	result = bitmap_import(200, bitmap_export(a));
+	ASSERT_EQ(true, bitmap_xor(result, b));
+	ASSERT_EQ(100, bitmap_total_set(result));
+	ASSERT_EQ(50, bitmap_count_range(result, 0, 50));
+	ASSERT_EQ(50, bitmap_count_range(result, 100, 50));
+	bitmap_destroy(result);
+
+	result = bitmap_import(200, bitmap_export(a));
+	ASSERT_EQ(true, bitmap_andnot(result, b));
+	ASSERT_EQ(50, bitmap_total_set(result));
+	ASSERT_EQ(true, bitmap_test_range(result, 0, 50));
+
+	// Mismatched sizes are refused and leave dst alone
+	ASSERT_EQ(false, bitmap_or(result, other));
+	ASSERT_EQ(false, bitmap_and(result, NULL));
+	ASSERT_EQ(50, bitmap_total_set(result));
+	bitmap_destroy(result);
+
+	bitmap_destroy(a);
+	bitmap_destroy(b);
+	bitmap_destroy(other);
+
+	score += 2;
+}
+
+static void collect_bit(size_t bit, void *arg)
+{
+	static_cast<std::vector<size_t> *>(arg)->push_back(bit);
+}
+
+TEST(bitmap_words, set_bit_iteration)
+{
+	// Sparse, dense and a partial last word with junk past the end after the invert
+	bitmap_t *bitmap = bitmap_create(1000);
+	ASSERT_NE(nullptr, bitmap);
+	bitmap_invert(bitmap);
+	bitmap_reset_range(bitmap, 0, 1000);
+	std::vector<size_t> expected;
+	for (size_t i = 0; i < 1000; i += (i < 200 ? 1 : 77))
+	{
+		bitmap_set(bitmap, i);
+		expected.push_back(i);
+	}
+	bitmap_set(bitmap, 999);
+	expected.push_back(999);
+
+	std::vector<size_t> seen;
+	bitmap_for_each(bitmap, collect_bit, &seen);
+	ASSERT_EQ(expected, seen);
+
+	// Small batches, resuming one past the last hit each time
+	seen.clear();
+	size_t bits[7];
+	for (size_t n, from = 0; (n = bitmap_ffs_batch(bitmap, from, bits, 7)) != 0; from = bits[n - 1] + 1)
+	{
+		seen.insert(seen.end(), bits, bits + n);
+	}
+	ASSERT_EQ(expected, seen);
+
+	ASSERT_EQ(1, bitmap_ffs_batch(bitmap, 999, bits, 7));
+	ASSERT_EQ(0, bitmap_ffs_batch(bitmap, 1000, bits, 7));
+	ASSERT_EQ(0, bitmap_ffs_batch(bitmap, 0, bits, 0));
+	ASSERT_EQ(0, bitmap_ffs_batch(NULL, 0, bits, 7));
+	bitmap_destroy(bitmap);
+
+	score += 2;
+}
+
+// Runs the same random changes on a flat and a hierarchical bitmap and checks every search agrees
+static void compare_hierarchical(const size_t n)
+{
+	bitmap_t *flat = bitmap_create(n);
+	bitmap_t *tree = bitmap_create_hierarchical(n);
+	ASSERT_NE(nullptr, flat);
+	ASSERT_NE(nullptr, tree);
+
+	unsigned seed = 12345;
+	auto next = [&seed](size_t limit) {
+		seed = seed * 1103515245 + 12345;
+		return (size_t) (seed >> 8) % limit;
+	};
+	for (int round = 0; round < 400; round++)
+	{
+		const size_t bit = next(n);
+		const size_t count = 1 + next(n - bit);
+		switch (next(6))
+		{
+			case 0:
+				bitmap_set(flat, bit);
+				bitmap_set(tree, bit);
+				break;
+			case 1:
+				bitmap_reset(flat, bit);
+				bitmap_test_and_reset(tree, bit);
+				break;
+			case 2:
+				bitmap_flip(flat, bit);
+				bitmap_flip(tree, bit);
+				break;
+			case 3:
+				bitmap_set_range(flat, bit, count);
+				bitmap_set_range(tree, bit, count);
+				break;
+			case 4:
+				bitmap_reset_range(flat, bit, count);
+				bitmap_reset_range(tree, bit, count);
+				break;
+			default:
+				// Fill a stretch solid so there are full words, and whole words, for the summaries to skip
+				bitmap_set_range(flat, bit, count / 4 + 1);
+				bitmap_set_range(tree, bit, count / 4 + 1);
+				break;
+		}
+
+		for (int probe = 0; probe < 8; probe++)
+		{
+			const size_t from = next(n);
+			ASSERT_EQ(bitmap_ffs_from(flat, from), bitmap_ffs_from(tree, from)) << "n = " << n;
+			ASSERT_EQ(bitmap_ffz_from(flat, from), bitmap_ffz_from(tree, from)) << "n = " << n;
+			ASSERT_EQ(bitmap_ffz_run(flat, from, 70), bitmap_ffz_run(tree, from, 70)) << "n = " << n;
+		}
+		size_t a[16], b[16];
+		const size_t from = next(n);
+		const size_t got = bitmap_ffs_batch(flat, from, a, 16);
+		ASSERT_EQ(got, bitmap_ffs_batch(tree, from, b, 16));
+		ASSERT_TRUE(std::equal(a, a + got, b));
+	}
+	ASSERT_EQ(bitmap_total_set(flat), bitmap_total_set(tree));
+
+	// Bulk changes rebuild the summaries
+	bitmap_format(tree, 0xFF);
+	ASSERT_EQ(SIZE_MAX, bitmap_ffz(tree));
+	bitmap_reset(tree, n - 1);
+	ASSERT_EQ(n - 1, bitmap_ffz(tree));
+	bitmap_invert(tree);
+	ASSERT_EQ(n - 1, bitmap_ffs(tree));
+	ASSERT_EQ(0, bitmap_ffz(tree));
+
+	bitmap_destroy(flat);
+	bitmap_destroy(tree);
+}
+
+// Checks bitmap_zero_runs against counting the runs one bit at a time, over random mixes of set ranges and bits
+static void compare_zero_runs(const size_t n, const bool hierarchical)
+{
+	bitmap_t *bitmap = hierarchical ? bitmap_create_hierarchical(n) : bitmap_create(n);
+	ASSERT_NE(nullptr, bitmap);
+	unsigned seed = 4321;
+	auto next = [&seed](size_t limit) {
+		seed = seed * 1103515245 + 12345;
+		return (size_t) (seed >> 8) % limit;
+	};
+	for (int round = 0; round < 60; round++)
+	{
+		const size_t bit = next(n);
+		const size_t count = 1 + next(std::min<size_t>(n - bit, 300));
+		if (next(3))
+		{
+			bitmap_set_range(bitmap, bit, count);
+		}
+		else
+		{
+			bitmap_reset_range(bitmap, bit, count);
+		}
+
+		bitmap_run_stats_t expected, stats;
+		memset(&expected, 0, sizeof(expected));
+		for (size_t i = 0, run = 0; i <= n; i++)
+		{
+			if (i < n && !bitmap_test(bitmap, i))
+			{
+				run++;
+				continue;
+			}
+			if (run)
+			{
+				expected.zeros += run;
+				expected.runs++;
+				expected.longest = std::max(expected.longest, run);
+				size_t bucket = 0;
+				while ((run >> (bucket + 1)) != 0)
+				{
+					bucket++;
+				}
+				expected.histogram[bucket]++;
+			}
+			run = 0;
+		}
+		bitmap_zero_runs(bitmap, &stats);
+		ASSERT_EQ(expected.zeros, stats.zeros);
+		ASSERT_EQ(expected.runs, stats.runs);
+		ASSERT_EQ(expected.longest, stats.longest);
+		ASSERT_EQ(0, memcmp(expected.histogram, stats.histogram, sizeof(stats.histogram)));
+	}
+	bitmap_destroy(bitmap);
+}
+
+TEST(bitmap_words, zero_runs)
+{
+	// Partial last word, whole words only, and big enough for summary levels
+	for (const bool hierarchical : {false, true})
+	{
+		compare_zero_runs(50, hierarchical);
+		compare_zero_runs(64 * 3, hierarchical);
+		compare_zero_runs(64 * 64 * 3 + 17, hierarchical);
+	}
+	bitmap_t *bitmap = bitmap_create(200);
+	bitmap_run_stats_t stats;
+	bitmap_zero_runs(bitmap, &stats);
+	ASSERT_EQ(1u, stats.runs);
+	ASSERT_EQ(200u, stats.longest);
+	ASSERT_EQ(1u, stats.histogram[7]);
+	bitmap_set_range(bitmap, 0, 200);
+	bitmap_zero_runs(bitmap, &stats);
+	ASSERT_EQ(0u, stats.runs);
+	ASSERT_EQ(0u, stats.longest);
+	bitmap_destroy(bitmap);
+
+	score += 2;
+}
+
+TEST(block_store_fragmentation, reports_free_extents)
+{
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	block_store_fragmentation_t fragmentation;
+	ASSERT_EQ(false, block_store_get_fragmentation(NULL, &fragmentation));
+	ASSERT_EQ(EINVAL, errno);
+
+	// The bitmap blocks split an empty store in two
+	ASSERT_EQ(true, block_store_get_fragmentation(bs, &fragmentation));
+	ASSERT_EQ(block_store_get_free_blocks(bs), fragmentation.free_blocks);
+	ASSERT_EQ(2u, fragmentation.free_extents);
+	ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS - BITMAP_START_BLOCK - BITMAP_NUM_BLOCKS, fragmentation.largest_extent);
+
+	// Fill it, then free every other block of the first 100 and a run of 40 at the end
+	while (block_store_allocate(bs) != SIZE_MAX)
+	{
+	}
+	for (size_t i = 0; i < 100; i += 2)
+	{
+		block_store_release(bs, i);
+	}
+	block_store_release_extent(bs, BLOCK_STORE_NUM_BLOCKS - 40, 40);
+	ASSERT_EQ(true, block_store_get_fragmentation(bs, &fragmentation));
+	ASSERT_EQ(90u, fragmentation.free_blocks);
+	ASSERT_EQ(51u, fragmentation.free_extents);
+	ASSERT_EQ(40u, fragmentation.largest_extent);
+	ASSERT_EQ(50u, fragmentation.extents[0]);
+	ASSERT_EQ(1u, fragmentation.extents[5]);
+	size_t start;
+	ASSERT_EQ(false, block_store_allocate_extent(bs, fragmentation.largest_extent + 1, &start));
+	ASSERT_EQ(true, block_store_allocate_extent(bs, fragmentation.largest_extent, &start));
+	block_store_destroy(bs);
+	score += 2;
+}
+
+TEST(bitmap_words, fls)
+{
+	bitmap_t *bitmap = bitmap_create(200);
+	ASSERT_EQ(SIZE_MAX, bitmap_fls_from(bitmap, SIZE_MAX));
+	bitmap_set(bitmap, 3);
+	bitmap_set(bitmap, 130);
+	bitmap_set(bitmap, 199);
+	ASSERT_EQ(199u, bitmap_fls_from(bitmap, SIZE_MAX));
+	ASSERT_EQ(130u, bitmap_fls_from(bitmap, 198));
+	ASSERT_EQ(130u, bitmap_fls_from(bitmap, 130));
+	ASSERT_EQ(3u, bitmap_fls_from(bitmap, 129));
+	ASSERT_EQ(SIZE_MAX, bitmap_fls_from(bitmap, 2));
+	bitmap_destroy(bitmap);
+
+	score += 2;
+}
+
+TEST(block_store_compact, packs_blocks_and_remaps)
+{
+	unlink("test_journal.bs");
+	unlink("test.journal");
+	const size_t num_blocks = 4096, block_size = 64;
+	block_store_t *bs = block_store_create_ex(num_blocks, block_size);
+	ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+	block_store_remap_t remap[37];
+	ASSERT_EQ(0u, block_store_compact(NULL, remap, 37));
+	ASSERT_EQ(EINVAL, errno);
+
+	// Every other block in use, each holding its own id
+	std::vector<uint8_t> buffer(block_size);
+	std::vector<size_t> owner(num_blocks, SIZE_MAX); //which original block's contents each block holds
+	while (block_store_allocate(bs) != SIZE_MAX)
+	{
+	}
+	for (size_t id = 0; id < num_blocks; id++)
+	{
+		if (id >= BITMAP_START_BLOCK && id < BITMAP_START_BLOCK + 8)
+		{
+			continue;
+		}
+		if (id % 2)
+		{
+			block_store_release(bs, id);
+			continue;
+		}
+		memcpy(buffer.data(), &id, sizeof(id));
+		ASSERT_EQ(block_size, block_store_write(bs, id, buffer.data()));
+		owner[id] = id;
+	}
+	const size_t used = block_store_get_used_blocks(bs);
+	ASSERT_EQ(BLOCK_STORE_HEADER_BYTES + num_blocks * block_size, block_store_checkpoint(bs, "test_journal.bs"));
+	ASSERT_EQ(true, block_store_journal_open(bs, "test.journal"));
+
+	size_t moved, batches = 0;
+	while ((moved = block_store_compact(bs, remap, 37)) != 0)
+	{
+		ASSERT_LE(moved, 37u);
+		for (size_t i = 0; i < moved; i++)
+		{
+			ASSERT_LT(remap[i].to, remap[i].from);
+			ASSERT_EQ(SIZE_MAX, owner[remap[i].to]);
+			owner[remap[i].to] = owner[remap[i].from];
+			owner[remap[i].from] = SIZE_MAX;
+		}
+		batches++;
+	}
+	ASSERT_GT(batches, 1u);
+	ASSERT_EQ(used, block_store_get_used_blocks(bs));
+	ASSERT_EQ(true, block_store_journal_commit(bs));
+
+	// All the free space is now one extent at the top, and every block's contents followed the remap
+	block_store_fragmentation_t fragmentation;
+	ASSERT_EQ(true, block_store_get_fragmentation(bs, &fragmentation));
+	ASSERT_EQ(1u, fragmentation.free_extents);
+	ASSERT_EQ(num_blocks - used, fragmentation.largest_extent);
+	for (size_t id = 0; id < num_blocks; id++)
+	{
+		if (owner[id] != SIZE_MAX)
+		{
+			ASSERT_EQ(0, memcmp(&owner[id], block_store_get_block_ptr(bs, id), sizeof(size_t)));
+		}
+	}
+	block_store_destroy(bs);
+
+	// The journal replays the moves onto the image from before them
+	bs = block_store_deserialize("test_journal.bs");
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(true, block_store_journal_open(bs, "test.journal"));
+	ASSERT_EQ(used, block_store_get_used_blocks(bs));
+	for (size_t id = 0; id < num_blocks; id++)
+	{
+		if (owner[id] != SIZE_MAX)
+		{
+			ASSERT_EQ(0, memcmp(&owner[id], block_store_get_block_ptr(bs, id), sizeof(size_t)));
+		}
+	}
+	ASSERT_EQ(0u, block_store_compact(bs, remap, 37));
+	block_store_destroy(bs);
+	unlink("test_journal.bs");
+	unlink("test.journal");
+
+	// Blocks sitting in an allocation cache aren't allocated, so they're not moved
+	bs = block_store_create_flags(num_blocks, block_size, BS_ALLOC_CACHE);
+	ASSERT_NE(nullptr, bs);
+	size_t id = block_store_allocate(bs);
+	moved = block_store_compact(bs, remap, 37);
+	ASSERT_LE(moved, 1u); //at most the one handed out, if it wasn't already at the bottom
+	if (moved)
+	{
+		ASSERT_EQ(id, remap[0].from);
+		id = remap[0].to;
+	}
+	ASSERT_EQ(0u, block_store_compact(bs, remap, 37));
+	ASSERT_EQ(false, block_store_request(bs, id));
+	ASSERT_EQ(8u + 1, block_store_get_used_blocks(bs)); //the bitmap blocks and the one handed out
+	block_store_destroy(bs);
+	score += 3;
+}
+
+TEST(block_store_snapshot, sees_blocks_as_they_were)
+{
+	unlink("test_snapshot.bs");
+	const size_t num_blocks = 1024, block_size = 64;
+	block_store_t *bs = block_store_create_ex(num_blocks, block_size);
+	ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+	ASSERT_EQ(nullptr, block_store_snapshot(NULL));
+
+	std::vector<uint8_t> before(block_size, 0xAA), after(block_size, 0x55), buffer(block_size);
+	for (size_t id = 100; id < 110; id++)
+	{
+		ASSERT_EQ(true, block_store_request(bs, id));
+		ASSERT_EQ(block_size, block_store_write(bs, id, before.data()));
+	}
+	const size_t used = block_store_get_used_blocks(bs);
+	block_store_t *snapshot = block_store_snapshot(bs);
+	ASSERT_NE(nullptr, snapshot);
+	ASSERT_EQ(nullptr, block_store_snapshot(snapshot));
+	ASSERT_EQ(EINVAL, errno);
+
+	// Changes to the store after the snapshot don't show through it
+	ASSERT_EQ(block_size, block_store_write(bs, 100, after.data()));
+	block_store_iovec_t vec[2] = {{101, after.data()}, {102, after.data()}};
+	ASSERT_EQ(2 * block_size, block_store_writev(bs, vec, 2));
+	memset(block_store_get_block_ptr_mut(bs, 103), 0x55, block_size);
+	block_store_release(bs, 104);
+	ASSERT_NE(SIZE_MAX, block_store_allocate(bs));
+	ASSERT_EQ(used, block_store_get_used_blocks(snapshot));
+	for (size_t id = 100; id < 110; id++)
+	{
+		ASSERT_EQ(block_size, block_store_read(snapshot, id, buffer.data()));
+		ASSERT_EQ(before, buffer);
+	}
+	std::vector<uint8_t> both(2 * block_size);
+	block_store_iovec_t read_vec[2] = {{100, both.data()}, {101, both.data() + block_size}};
+	ASSERT_EQ(2 * block_size, block_store_readv(snapshot, read_vec, 2));
+	ASSERT_EQ(std::vector<uint8_t>(2 * block_size, 0xAA), both);
+	ASSERT_EQ(block_size, block_store_read(bs, 100, buffer.data()));
+	ASSERT_EQ(after, buffer);
+
+	// Snapshots are read only
+	block_store_remap_t remap[4];
+	ASSERT_EQ(SIZE_MAX, block_store_allocate(snapshot));
+	ASSERT_EQ(false, block_store_request(snapshot, 200));
+	ASSERT_EQ(0u, block_store_write(snapshot, 100, after.data()));
+	ASSERT_EQ(nullptr, block_store_get_block_ptr_mut(snapshot, 100));
+	ASSERT_EQ(nullptr, block_store_get_block_ptr(snapshot, 100));
+	ASSERT_EQ(0u, block_store_compact(snapshot, remap, 4));
+	ASSERT_EQ(false, block_store_journal_open(bs, "test.journal"));
+	ASSERT_EQ(EBUSY, errno);
+
+	// Saving the snapshot gives an image of the store as it was, bitmap included
+	ASSERT_EQ(BLOCK_STORE_HEADER_BYTES + num_blocks * block_size, block_store_serialize(snapshot, "test_snapshot.bs"));
+	block_store_t *loaded = block_store_deserialize("test_snapshot.bs");
+	ASSERT_NE(nullptr, loaded);
+	ASSERT_EQ(used, block_store_get_used_blocks(loaded));
+	ASSERT_EQ(false, block_store_request(loaded, 104));
+	ASSERT_EQ(block_size, block_store_read(loaded, 103, buffer.data()));
+	ASSERT_EQ(before, buffer);
+	block_store_destroy(loaded);
+	unlink("test_snapshot.bs");
+
+	// The snapshot outlives the store, and a second one can go first
+	block_store_t *second = block_store_snapshot(bs);
+	ASSERT_NE(nullptr, second);
+	ASSERT_EQ(block_size, block_store_write(bs, 105, after.data()));
+	block_store_destroy(second);
+	ASSERT_EQ(block_size, block_store_write(bs, 106, after.data()));
+	block_store_destroy(bs);
+	for (size_t id = 100; id < 110; id++)
+	{
+		ASSERT_EQ(block_size, block_store_read(snapshot, id, buffer.data()));
+		ASSERT_EQ(before, buffer);
+	}
+	block_store_destroy(snapshot);
+	score += 3;
+}
+
+TEST(block_store_snapshot, stays_put_under_writes)
+{
+	const size_t block_size = 256, blocks = 16;
+	block_store_t *bs = block_store_create_flags(BLOCK_STORE_NUM_BLOCKS, block_size, BS_THREADSAFE);
+	ASSERT_NE(nullptr, bs) << "block_store_create_flags returned NULL when it should not have\n";
+	size_t first = 0;
+	ASSERT_EQ(true, block_store_allocate_extent(bs, blocks, &first));
+
+	// One writer keeps rewriting every block with a uniform pattern while snapshots are taken and read back twice
+	std::atomic<bool> done(false);
+	std::thread writer([bs, first, &done]() {
+		std::vector<uint8_t> buffer(block_size);
+		for (size_t round = 0; !done; round++)
+		{
+			std::fill(buffer.begin(), buffer.end(), (uint8_t) round);
+			for (size_t id = first; id < first + blocks; id++)
+			{
+				block_store_write(bs, id, buffer.data());
+			}
+		}
+	});
+	std::vector<uint8_t> once(blocks * block_size), again(blocks * block_size);
+	for (size_t round = 0; round < 200; round++)
+	{
+		block_store_t *snapshot = block_store_snapshot(bs);
+		ASSERT_NE(nullptr, snapshot);
+		for (size_t i = 0; i < blocks; i++)
+		{
+			ASSERT_EQ(block_size, block_store_read(snapshot, first + i, once.data() + i * block_size));
+			ASSERT_EQ(block_size, (size_t) std::count(once.begin() + i * block_size, once.begin() + (i + 1) * block_size, once[i * block_size]));
+		}
+		for (size_t i = 0; i < blocks; i++)
+		{
+			ASSERT_EQ(block_size, block_store_read(snapshot, first + i, again.data() + i * block_size));
+		}
+		ASSERT_EQ(once, again);
+		block_store_destroy(snapshot);
+	}
+	done = true;
+	writer.join();
+	block_store_destroy(bs);
+
+	score += 5;
+}
+
+TEST(block_store_snapshot, count_matches_bitmap_under_allocations)
+{
+	block_store_t *bs = block_store_create_flags(BLOCK_STORE_NUM_BLOCKS, BLOCK_SIZE_BYTES, BS_ALLOC_CACHE);
+	ASSERT_NE(nullptr, bs) << "block_store_create_flags returned NULL when it should not have\n";
+
+	// Snapshots taken while the bitmap keeps changing still see each change in both the bitmap and the count, or in neither
+	std::atomic<bool> done(false);
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < 2; t++)
+	{
+		threads.emplace_back([bs, t, &done]() {
+			for (size_t round = 0; !done; round++)
+			{
+				const size_t id = block_store_allocate(bs);
+				size_t start = 0;
+				if (block_store_allocate_extent(bs, 3, &start))
+				{
+					block_store_release_extent(bs, start, 3);
+				}
+				const size_t requested = 2 + t + 2 * (round % 200);
+				if (block_store_request(bs, requested))
+				{
+					block_store_release(bs, requested);
+				}
+				if (id != SIZE_MAX)
+				{
+					block_store_release(bs, id);
+				}
+			}
+		});
+	}
+	block_store_fragmentation_t seen;
+	for (size_t round = 0; round < 200; round++)
+	{
+		block_store_t *snapshot = block_store_snapshot(bs);
+		ASSERT_NE(nullptr, snapshot);
+		ASSERT_EQ(true, block_store_get_fragmentation(snapshot, &seen));
+		ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS, seen.free_blocks + block_store_get_used_blocks(snapshot));
+		block_store_destroy(snapshot);
+	}
+	done = true;
+	for (std::thread &thread : threads)
+	{
+		thread.join();
+	}
+	block_store_destroy(bs);
+
+	score += 3;
+}
+
+TEST(block_store_snapshot, bitmap_stays_put_under_allocations)
+{
+	unlink("test_snapshot.bs");
+	const size_t block_size = 64; //a bitmap many blocks long, each copied on its own
+	block_store_t *bs = block_store_create_flags(BLOCK_STORE_NUM_BLOCKS, block_size, BS_ALLOC_CACHE);
+	ASSERT_NE(nullptr, bs) << "block_store_create_flags returned NULL when it should not have\n";
+	for (size_t id = 0; id < BLOCK_STORE_NUM_BLOCKS; id += 3)
+	{
+		block_store_request(bs, id);
+	}
+	block_store_drain_caches(bs);
+	const size_t used = block_store_get_used_blocks(bs);
+	block_store_fragmentation_t before, seen;
+	ASSERT_EQ(true, block_store_get_fragmentation(bs, &before));
+	block_store_t *snapshot = block_store_snapshot(bs);
+	ASSERT_NE(nullptr, snapshot);
+
+	// Every way of changing the bitmap, from several threads, while the snapshot is read
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < 2; t++)
+	{
+		threads.emplace_back([bs, t]() {
+			for (size_t round = 0; round < 200; round++)
+			{
+				const size_t id = block_store_allocate(bs);
+				size_t start = 0;
+				if (block_store_allocate_extent(bs, 2, &start))
+				{
+					block_store_release_extent(bs, start, 2);
+				}
+				block_store_request(bs, 1 + 3 * (round + 200 * t));
+				block_store_release(bs, 3 * (round + 200 * t));
+				if (round % 2 && id != SIZE_MAX)
+				{
+					block_store_release(bs, id);
+				}
+			}
+		});
+	}
+	for (size_t round = 0; round < 20; round++)
+	{
+		ASSERT_EQ(used, block_store_get_used_blocks(snapshot));
+		ASSERT_EQ(true, block_store_get_fragmentation(snapshot, &seen));
+		ASSERT_EQ(before.free_blocks, seen.free_blocks);
+		ASSERT_EQ(before.free_extents, seen.free_extents);
+	}
+	for (std::thread &thread : threads)
+	{
+		thread.join();
+	}
+	ASSERT_NE(used, block_store_get_used_blocks(bs));
+
+	ASSERT_EQ(true, block_store_get_fragmentation(snapshot, &seen));
+	ASSERT_EQ(before.free_blocks, seen.free_blocks);
+	ASSERT_EQ(before.free_extents, seen.free_extents);
+	ASSERT_EQ(before.largest_extent, seen.largest_extent);
+	ASSERT_EQ(BLOCK_STORE_HEADER_BYTES + BLOCK_STORE_NUM_BLOCKS * block_size, block_store_serialize(snapshot, "test_snapshot.bs"));
+	block_store_destroy(snapshot);
+	block_store_destroy(bs);
+	block_store_drain_caches(NULL);
+
+	block_store_t *loaded = block_store_deserialize("test_snapshot.bs");
+	ASSERT_NE(nullptr, loaded);
+	ASSERT_EQ(used, block_store_get_used_blocks(loaded));
+	ASSERT_EQ(false, block_store_request(loaded, 3)); //released after the snapshot
+	ASSERT_EQ(true, block_store_request(loaded, 4)); //requested after it
+	block_store_destroy(loaded);
+	unlink("test_snapshot.bs");
+
+	score += 5;
+}
+
+#ifdef BLOCK_STORE_LZ4
+TEST(block_store_serialize_compressed, round_trip)
+{
+	unlink("test_compressed.bs");
+	const size_t num_blocks = 8192, block_size = 256;
+	block_store_t *bs = block_store_create_ex(num_blocks, block_size);
+	ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+	ASSERT_EQ(0u, block_store_serialize_compressed(NULL, "test_compressed.bs"));
+
+	// A sparse store: patterned blocks, random ones, allocated zero ones, and a freed block that still holds data
+	std::vector<std::vector<uint8_t>> contents(num_blocks);
+	std::vector<uint8_t> buffer(block_size);
+	srand(7);
+	for (size_t id = 100; id < num_blocks; id += 37)
+	{
+		ASSERT_EQ(true, block_store_request(bs, id));
+		for (size_t i = 0; i < block_size; i++)
+		{
+			buffer[i] = (id % 3 == 0) ? (uint8_t) rand() : (id % 3 == 1) ? (uint8_t)(i % 16) : 0;
+		}
+		ASSERT_EQ(block_size, block_store_write(bs, id, buffer.data()));
+		contents[id] = buffer;
+	}
+	ASSERT_EQ(true, block_store_request(bs, 50));
+	std::fill(buffer.begin(), buffer.end(), 0x77);
+	ASSERT_EQ(block_size, block_store_write(bs, 50, buffer.data()));
+	block_store_release(bs, 50);
+	const size_t used = block_store_get_used_blocks(bs);
+
+	const size_t bytes = block_store_serialize_compressed(bs, "test_compressed.bs");
+	ASSERT_NE(0u, bytes);
+	ASSERT_LT(bytes, num_blocks * block_size / 8); //most of the store is free
+	struct stat st;
+	ASSERT_EQ(0, stat("test_compressed.bs", &st));
+	ASSERT_EQ(bytes, (size_t) st.st_size);
+	ASSERT_EQ(nullptr, block_store_open_mmap("test_compressed.bs", O_RDONLY));
+
+	block_store_t *loaded = block_store_deserialize("test_compressed.bs");
+	ASSERT_NE(nullptr, loaded);
+	ASSERT_EQ(num_blocks, block_store_get_block_count(loaded));
+	ASSERT_EQ(block_size, block_store_get_block_size(loaded));
+	ASSERT_EQ(used, block_store_get_used_blocks(loaded));
+	for (size_t id = 0; id < num_blocks; id++)
+	{
+		ASSERT_EQ(block_size, block_store_read(loaded, id, buffer.data()));
+		if (!contents[id].empty())
+		{
+			ASSERT_EQ(contents[id], buffer);
+			ASSERT_EQ(false, block_store_request(loaded, id));
+		}
+		else if (id < BITMAP_START_BLOCK || id >= BITMAP_START_BLOCK + 4) //8192 bits of bitmap take four blocks
+		{
+			ASSERT_EQ(std::vector<uint8_t>(block_size, 0), buffer); //free blocks come back zeroed, block 50 too
+		}
+	}
+	block_store_destroy(loaded);
+
+	// A snapshot compresses the same way, while the store moves on
+	block_store_t *snapshot = block_store_snapshot(bs);
+	ASSERT_NE(nullptr, snapshot);
+	ASSERT_EQ(block_size, block_store_write(bs, 137, buffer.data()));
+	ASSERT_EQ(bytes, block_store_serialize_compressed(snapshot, "test_compressed.bs"));
+	block_store_destroy(snapshot);
+	loaded = block_store_deserialize("test_compressed.bs");
+	ASSERT_NE(nullptr, loaded);
+	ASSERT_EQ(block_size, block_store_read(loaded, 137, buffer.data()));
+	ASSERT_EQ(contents[137], buffer);
+	block_store_destroy(loaded);
+
+	// Damaged data is caught by the chunk checksum
+	int fd = open("test_compressed.bs", O_RDWR);
+	ASSERT_NE(-1, fd);
+	uint8_t byte = 0;
+	ASSERT_EQ(1, pread(fd, &byte, 1, bytes - 10));
+	byte ^= 0x01;
+	ASSERT_EQ(1, pwrite(fd, &byte, 1, bytes - 10));
+	close(fd);
+	ASSERT_EQ(nullptr, block_store_deserialize("test_compressed.bs"));
+	ASSERT_EQ(0, truncate("test_compressed.bs", bytes / 2));
+	ASSERT_EQ(nullptr, block_store_deserialize("test_compressed.bs"));
+
+	block_store_destroy(bs);
+	unlink("test_compressed.bs");
+
+	// A full default store of repeated data shrinks too
+	bs = block_store_create();
+	ASSERT_NE(nullptr, bs);
+	std::vector<uint8_t> pattern(BLOCK_SIZE_BYTES, 0x42);
+	size_t id;
+	while ((id = block_store_allocate(bs)) != SIZE_MAX)
+	{
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, pattern.data()));
+	}
+	ASSERT_LT(block_store_serialize_compressed(bs, "test_compressed.bs"), BLOCK_STORE_NUM_BYTES / 4);
+	loaded = block_store_deserialize("test_compressed.bs");
+	ASSERT_NE(nullptr, loaded);
+	ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS, block_store_get_used_blocks(loaded));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(loaded, 511, buffer.data()));
+	ASSERT_EQ(0, memcmp(pattern.data(), buffer.data(), BLOCK_SIZE_BYTES));
+	block_store_destroy(loaded);
+	block_store_destroy(bs);
+	unlink("test_compressed.bs");
+	score += 3;
+}
+
+TEST(block_store_serialize_compressed, library_codec)
+{
+	// 1024 blocks of 256 bytes: one bitmap block (127), chunks of 256 blocks, so the blocks below are all in the first
+	unlink("test_compressed.bs");
+	const size_t num_blocks = 1024, block_size = 256;
+	block_store_t *bs = block_store_create_ex(num_blocks, block_size);
+	ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+	std::vector<uint8_t> raw; //the allocated blocks of the first chunk, end to end
+	std::vector<uint8_t> buffer(block_size);
+	for (size_t id = 10; id < 74; id++)
+	{
+		ASSERT_EQ(true, block_store_request(bs, id));
+		for (size_t i = 0; i < block_size; i++)
+		{
+			buffer[i] = (uint8_t)(id + i % 16);
+		}
+		ASSERT_EQ(block_size, block_store_write(bs, id, buffer.data()));
+		raw.insert(raw.end(), buffer.begin(), buffer.end());
+	}
+	const size_t bytes = block_store_serialize_compressed(bs, "test_compressed.bs");
+	ASSERT_NE(0u, bytes);
+	block_store_destroy(bs);
+
+	// The header records LZ4, the blocks per chunk, no flags and the image size
+	int fd = open("test_compressed.bs", O_RDONLY);
+	ASSERT_NE(-1, fd);
+	uint64_t reserved[3];
+	ASSERT_EQ((ssize_t)sizeof(reserved), pread(fd, reserved, sizeof(reserved), 32));
+	ASSERT_EQ(1u | 256ull << 32, reserved[0]); //codec, then blocks per chunk
+	ASSERT_EQ(0u, reserved[1]); //flags
+	ASSERT_EQ(bytes, reserved[2]);
+
+	// The first chunk's data, after its record, is an LZ4 block liblz4 decompresses to exactly those blocks
+	uint64_t record[3]; //raw bytes, stored bytes, checksum
+	const off_t chunk_offset = BLOCK_STORE_HEADER_BYTES + block_size;
+	ASSERT_EQ((ssize_t)sizeof(record), pread(fd, record, sizeof(record), chunk_offset));
+	ASSERT_EQ(raw.size(), record[0]);
+	ASSERT_LT(record[1], record[0]);
+	std::vector<char> stored(record[1]);
+	ASSERT_EQ((ssize_t)stored.size(), pread(fd, stored.data(), stored.size(), chunk_offset + sizeof(record)));
+	close(fd);
+	std::vector<char> decompressed(raw.size());
+	ASSERT_EQ((int)raw.size(), LZ4_decompress_safe(stored.data(), decompressed.data(), (int)stored.size(), (int)decompressed.size()));
+	ASSERT_EQ(0, memcmp(raw.data(), decompressed.data(), raw.size()));
+
+	// And the store decompresses them with it just the same
+	block_store_t *loaded = block_store_deserialize("test_compressed.bs");
+	ASSERT_NE(nullptr, loaded);
+	for (size_t id = 10; id < 74; id++)
+	{
+		ASSERT_EQ(block_size, block_store_read(loaded, id, buffer.data()));
+		ASSERT_EQ(0, memcmp(&raw[(id - 10) * block_size], buffer.data(), block_size));
+	}
+	block_store_destroy(loaded);
+	unlink("test_compressed.bs");
+	score += 2;
+}
+
+// Rewrites the image size recorded in the header of a compressed image
+static void set_compressed_bytes(const char *const filename, const uint64_t bytes)
+{
+	uint8_t header[BLOCK_STORE_HEADER_BYTES];
+	const int fd = open(filename, O_RDWR);
+	ASSERT_NE(-1, fd);
+	ASSERT_EQ((ssize_t)sizeof(header), pread(fd, header, sizeof(header), 0));
+	memcpy(header + 48, &bytes, sizeof(bytes));
+	seal_header(header);
+	ASSERT_EQ((ssize_t)sizeof(header), pwrite(fd, header, sizeof(header), 0));
+	close(fd);
+}
+
+TEST(block_store_serialize_compressed, rejects_trailing_and_missized)
+{
+	unlink("test_compressed.bs");
+	block_store_t *bs = block_store_create_ex(1024, 256);
+	ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+	std::vector<uint8_t> buffer(256, 0x3C);
+	ASSERT_EQ(true, block_store_request(bs, 10));
+	ASSERT_EQ(256u, block_store_write(bs, 10, buffer.data()));
+	const size_t bytes = block_store_serialize_compressed(bs, "test_compressed.bs");
+	ASSERT_NE(0u, bytes);
+	block_store_destroy(bs);
+
+	// Bytes after the last chunk, whether or not the header owns up to them
+	const uint8_t junk[16] = {0};
+	int fd = open("test_compressed.bs", O_RDWR);
+	ASSERT_NE(-1, fd);
+	ASSERT_EQ((ssize_t)sizeof(junk), pwrite(fd, junk, sizeof(junk), bytes));
+	close(fd);
+	ASSERT_EQ(nullptr, block_store_deserialize("test_compressed.bs"));
+	ASSERT_EQ(EINVAL, errno);
+	set_compressed_bytes("test_compressed.bs", bytes + sizeof(junk));
+	ASSERT_EQ(nullptr, block_store_deserialize("test_compressed.bs"));
+	ASSERT_EQ(EINVAL, errno);
+
+	// A size that disagrees with the file, bigger or smaller; put back as it was written, it loads
+	ASSERT_EQ(0, truncate("test_compressed.bs", bytes));
+	ASSERT_EQ(nullptr, block_store_deserialize("test_compressed.bs"));
+	ASSERT_EQ(EINVAL, errno);
+	set_compressed_bytes("test_compressed.bs", bytes);
+	block_store_t *loaded = block_store_deserialize("test_compressed.bs");
+	ASSERT_NE(nullptr, loaded);
+	ASSERT_EQ(256u, block_store_read(loaded, 10, buffer.data()));
+	ASSERT_EQ(std::vector<uint8_t>(256, 0x3C), buffer);
+	block_store_destroy(loaded);
+
+	// Chunks bigger than any this version writes, which would have the reader allocate whatever the header says
+	uint8_t header[BLOCK_STORE_HEADER_BYTES], patched[BLOCK_STORE_HEADER_BYTES];
+	fd = open("test_compressed.bs", O_RDWR);
+	ASSERT_NE(-1, fd);
+	ASSERT_EQ((ssize_t)sizeof(header), pread(fd, header, sizeof(header), 0));
+	memcpy(patched, header, sizeof(header));
+	const uint64_t codec = 1 | 0xFFFFFFFFull << 32;
+	memcpy(patched + 32, &codec, sizeof(codec));
+	seal_header(patched);
+	ASSERT_EQ((ssize_t)sizeof(patched), pwrite(fd, patched, sizeof(patched), 0));
+	ASSERT_EQ(nullptr, block_store_deserialize("test_compressed.bs"));
+	ASSERT_EQ(EINVAL, errno);
+	ASSERT_EQ((ssize_t)sizeof(header), pwrite(fd, header, sizeof(header), 0));
+	close(fd);
+
+	ASSERT_EQ(0, truncate("test_compressed.bs", bytes - 1));
+	ASSERT_EQ(nullptr, block_store_deserialize("test_compressed.bs"));
+	ASSERT_EQ(EINVAL, errno);
+	unlink("test_compressed.bs");
+	score += 2;
+}
+#else
+TEST(block_store_serialize_compressed, needs_liblz4)
+{
+	// Without BLOCK_STORE_LZ4 compressed images can't be written, and the file isn't touched
+	unlink("test_compressed.bs");
+	block_store_t *bs = block_store_create_ex(1024, 256);
+	ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+	ASSERT_EQ(0u, block_store_serialize_compressed(bs, "test_compressed.bs"));
+	ASSERT_EQ(ENOTSUP, errno);
+	struct stat st;
+	ASSERT_EQ(-1, stat("test_compressed.bs", &st));
+	block_store_destroy(bs);
+
+	// Nor loaded: a valid header of one with no blocks to it
+	uint8_t header[BLOCK_STORE_HEADER_BYTES];
+	const uint64_t reserved[3] = {1 | 256ull << 32, 0, BLOCK_STORE_HEADER_BYTES};
+	build_header(header, "BLKSTCMP", 1024, 256);
+	memcpy(header + 32, reserved, sizeof(reserved));
+	seal_header(header);
+	const int fd = open("test_compressed.bs", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	ASSERT_NE(-1, fd);
+	ASSERT_EQ((ssize_t)sizeof(header), pwrite(fd, header, sizeof(header), 0));
+	close(fd);
+	ASSERT_EQ(nullptr, block_store_deserialize("test_compressed.bs"));
+	ASSERT_EQ(ENOTSUP, errno);
+	unlink("test_compressed.bs");
+	score += 3;
+}
+#endif
+
+TEST(bitmap_hierarchical, matches_flat)
+{
+	// One word (no summary needed), two levels, three levels with a partial word at every level
+	compare_hierarchical(50);
+	compare_hierarchical(64 * 64 * 3 + 17);
+	compare_hierarchical(64 * 64 * 70 + 5);
+
+	score += 5;
+}
+
+TEST(bitmap_hierarchical, overlay_builds_summaries)
+{
+	std::vector<uint64_t> data(4096 / 64 * 3, 0);
+	data[100] = 0x10;
+	bitmap_t *bitmap = bitmap_overlay_hierarchical(4096 * 3, data.data());
+	ASSERT_NE(nullptr, bitmap);
+	ASSERT_EQ(100 * 64 + 4, bitmap_ffs(bitmap));
+	bitmap_set_range(bitmap, 0, 4096 * 3);
+	ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap));
+	bitmap_reset(bitmap, 9000);
+	ASSERT_EQ(9000, bitmap_ffz_from(bitmap, 5));
+	bitmap_destroy(bitmap);
+
+	ASSERT_EQ(nullptr, bitmap_overlay_hierarchical(64, (uint8_t *) data.data() + 1));
+
+	score += 2;
+}
+
+TEST(block_store_create_ex, hierarchical)
+{
+	// Flags that need atomic bitmaps don't go with it
+	ASSERT_EQ(nullptr, block_store_create_flags(1 << 16, BLOCK_SIZE_BYTES, BS_HIERARCHICAL | BS_THREADSAFE));
+	ASSERT_EQ(nullptr, block_store_create_flags(1 << 16, BLOCK_SIZE_BYTES, BS_HIERARCHICAL | BS_ALLOC_CACHE));
+
+	const size_t num_blocks = 1 << 20;
+	block_store_t *bs = block_store_create_flags(num_blocks, BLOCK_SIZE_BYTES, BS_HIERARCHICAL);
+	ASSERT_NE(nullptr, bs) << "block_store_create_flags returned NULL when it should not have\n";
+	const size_t reserved = block_store_get_used_blocks(bs);
+	for (size_t i = 0; i < num_blocks - reserved; i++)
+	{
+		ASSERT_NE(SIZE_MAX, block_store_allocate(bs));
+	}
+	ASSERT_EQ(SIZE_MAX, block_store_allocate(bs));
+
+	// A hole near the end is found straight away, and so is a run of them
+	block_store_release(bs, num_blocks - 10);
+	ASSERT_EQ(num_blocks - 10, block_store_allocate(bs));
+	block_store_release_extent(bs, num_blocks - 300, 200);
+	size_t start = 0;
+	ASSERT_EQ(true, block_store_allocate_extent(bs, 150, &start));
+	ASSERT_EQ(num_blocks - 300, start);
+	ASSERT_EQ(num_blocks - 50, block_store_get_used_blocks(bs));
+	block_store_destroy(bs);
+
+	score += 2;
+}
+
+TEST(block_store_create_ex, hierarchical_round_trip)
+{
+	// A full store with one hole near the end, so stale summaries would send a search the wrong way
+	const size_t num_blocks = 1 << 16;
+	block_store_t *bs = block_store_create_flags(num_blocks, BLOCK_SIZE_BYTES, BS_HIERARCHICAL);
+	ASSERT_NE(nullptr, bs) << "block_store_create_flags returned NULL when it should not have\n";
+	while (block_store_allocate(bs) != SIZE_MAX)
+	{
+	}
+	block_store_release(bs, num_blocks - 10);
+	const size_t bytes = block_store_serialize(bs, "test_hierarchical.bs");
+	ASSERT_EQ(BLOCK_STORE_HEADER_BYTES + num_blocks * BLOCK_SIZE_BYTES, bytes);
+	block_store_destroy(bs);
+
+	// The image keeps the flag (the header's second reserved word)
+	uint64_t flags = 0;
+	int fd = open("test_hierarchical.bs", O_RDONLY);
+	ASSERT_NE(-1, fd);
+	ASSERT_EQ((ssize_t)sizeof(flags), pread(fd, &flags, sizeof(flags), 40));
+	close(fd);
+	ASSERT_EQ((uint64_t)BS_HIERARCHICAL, flags);
+
+	// Loaded either way it's hierarchical again, with summaries that match the blocks, and saving it again keeps the flag
+	for (int mapped = 0; mapped < 2; mapped++)
+	{
+		bs = mapped ? block_store_open_mmap("test_hierarchical.bs", O_RDONLY) : block_store_deserialize("test_hierarchical.bs");
+		ASSERT_NE(nullptr, bs);
+		ASSERT_EQ(num_blocks - 1, block_store_get_used_blocks(bs));
+		// A free block at the end of a word past the bitmap's blocks: finding where its run ends means asking the
+		// summaries for the next set bit
+		block_store_release(bs, 1023);
+		size_t start = 0;
+		ASSERT_EQ(false, block_store_allocate_extent(bs, 2, &start));
+		ASSERT_EQ(1023u, block_store_allocate(bs));
+		ASSERT_EQ(num_blocks - 10, block_store_allocate(bs));
+		ASSERT_EQ(SIZE_MAX, block_store_allocate(bs));
+		block_store_release_extent(bs, num_blocks - 300, 200);
+		ASSERT_EQ(true, block_store_allocate_extent(bs, 150, &start));
+		ASSERT_EQ(num_blocks - 300, start);
+		ASSERT_EQ(bytes, block_store_serialize(bs, "test_hierarchical_again.bs"));
+		block_store_destroy(bs);
+		fd = open("test_hierarchical_again.bs", O_RDONLY);
+		ASSERT_NE(-1, fd);
+		flags = 0;
+		ASSERT_EQ((ssize_t)sizeof(flags), pread(fd, &flags, sizeof(flags), 40));
+		close(fd);
+		ASSERT_EQ((uint64_t)BS_HIERARCHICAL, flags);
+	}
+
+	// Flags this version doesn't keep in images are refused, as from a newer version
+	uint8_t header[BLOCK_STORE_HEADER_BYTES];
+	fd = open("test_hierarchical.bs", O_RDWR);
+	ASSERT_NE(-1, fd);
+	ASSERT_EQ((ssize_t)sizeof(header), pread(fd, header, sizeof(header), 0));
+	flags = BS_THREADSAFE;
+	memcpy(header + 40, &flags, sizeof(flags));
+	seal_header(header);
+	ASSERT_EQ((ssize_t)sizeof(header), pwrite(fd, header, sizeof(header), 0));
+	close(fd);
+	ASSERT_EQ(nullptr, block_store_deserialize("test_hierarchical.bs"));
+	ASSERT_EQ(EINVAL, errno);
+	unlink("test_hierarchical.bs");
+	unlink("test_hierarchical_again.bs");
+
+	score += 2;
+}